@@ -195,6 +195,28 @@ for test in tests:
 		print('Expected {}, got {}'.format(test[1], p.returncode))
 		exit_failure()
 
+# Lines changing the shell itself must not be run in parallel with '-j',
+# even behind the 'time' prefix.
+tests = [
+("time cd /\npwd\n", "/\n", 0),
+("time exit 4\necho next\n", "", 4),
+]
+for test in tests:
+	p = subprocess.Popen([args.e, '-j', '2'], shell=False,
+			     stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+			     stderr=subprocess.DEVNULL, bufsize=0)
+	try:
+		output = p.communicate(test[0].encode(), 3)[0].decode()
+	except subprocess.TimeoutExpired:
+		print('Too long no output with -j')
+		finish(-1)
+	p.terminate()
+	if output != test[1] or p.returncode != test[2]:
+		print('Wrong result with -j in test "{}"'.format(test[0]))
+		print('Expected {} and code {}, got {} and code {}'.format(
+		      repr(test[1]), test[2], repr(output), p.returncode))
+		exit_failure()
+
 # Test an extra long command. To ensure the shell doesn't have an internal
 # buffer size limit (well, it always can allocate like 1GB, but this has to be
 # caught at review).
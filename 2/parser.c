@@ -6,9 +6,16 @@
 #include <string.h>
 
 struct parser {
+	/** Own buffer for the fed data. */
 	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
+	size_t capacity;
+	/** Data to parse: either the own buffer or an attached one. */
+	const char *data;
+	/** Offset of the first not parsed byte in the data. */
+	size_t pos;
+	size_t size;
+	/** Whether '$' starts an expansion. */
+	bool is_expanding;
 };
 
 enum token_type {
@@ -23,20 +30,35 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+enum expand_mode {
+	/** '$' is an ordinary character. */
+	EXPAND_MODE_NONE,
+	/** Expansions are found and kept as is, to be done later. */
+	EXPAND_MODE_SCAN,
+	/** Expansions are replaced with their values. */
+	EXPAND_MODE_EXPAND,
+};
+
 struct token {
 	enum token_type type;
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
+	/** Whether the token has any expansions. */
+	bool has_expansion;
+	/** The fields below are set per line and aren't reset per token. */
+	enum expand_mode expand_mode;
+	const struct parser_expander *expander;
 };
 
 static char *
 token_strdup(const struct token *t)
 {
+	/* Can be empty, like '' or "". */
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
 	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
+	if (t->size > 0)
+		memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
 }
@@ -53,11 +75,28 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_run(struct token *t, const char *str, uint32_t len)
+{
+	if (len == 0)
+		return;
+	if (t->capacity - t->size < len) {
+		uint32_t new_capacity = (t->capacity + 1) * 2;
+		if (new_capacity - t->size < len)
+			new_capacity = t->size + len;
+		t->data = realloc(t->data, sizeof(*t->data) * new_capacity);
+		t->capacity = new_capacity;
+	}
+	memcpy(t->data + t->size, str, len);
+	t->size += len;
+}
+
 static void
 token_reset(struct token *t)
 {
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
+	t->has_expansion = false;
 }
 
 static void
@@ -72,22 +111,28 @@ command_append_arg(struct command *cmd, char *arg)
 	cmd->args[cmd->arg_count++] = arg;
 }
 
+static void
+command_destroy(struct command *cmd)
+{
+	free(cmd->exe);
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+		free(cmd->args[i]);
+	free(cmd->args);
+	free(cmd->source);
+}
+
 void
 command_line_delete(struct command_line *line)
 {
 	while (line->head != NULL) {
 		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
+		if (e->type == EXPR_TYPE_COMMAND)
+			command_destroy(&e->cmd);
 		line->head = e->next;
 		free(e);
 	}
 	free(line->out_file);
+	free(line->out_file_source);
 	free(line);
 }
 
@@ -110,29 +155,264 @@ parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
-	uint32_t cap = p->capacity - p->size;
-	if (cap < len) {
-		uint32_t new_capacity = (p->capacity + 1) * 2;
-		if (new_capacity - p->size < len)
-			new_capacity = p->size + len;
-		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
-		p->capacity = new_capacity;
+	if (len == 0)
+		return;
+	if (p->data != p->buffer || p->capacity - p->size < len) {
+		/*
+		 * Move the not parsed rest to the beginning of the own buffer.
+		 * It is grown when would be more than half full, so as the
+		 * moves are amortized by the appended data.
+		 */
+		size_t rest = p->size - p->pos;
+		size_t need = rest + len;
+		if (need > p->capacity / 2) {
+			size_t new_capacity = (p->capacity + 1) * 2;
+			if (new_capacity < need * 2)
+				new_capacity = need * 2;
+			char *new_buffer = malloc(new_capacity);
+			if (rest > 0)
+				memcpy(new_buffer, p->data + p->pos, rest);
+			free(p->buffer);
+			p->buffer = new_buffer;
+			p->capacity = new_capacity;
+		} else if (rest > 0) {
+			memmove(p->buffer, p->data + p->pos, rest);
+		}
+		p->data = p->buffer;
+		p->pos = 0;
+		p->size = rest;
 	}
 	memcpy(p->buffer + p->size, str, len);
 	p->size += len;
 	assert(p->size <= p->capacity);
 }
 
+void
+parser_attach(struct parser *p, const char *str, size_t len)
+{
+	assert(p->pos == p->size);
+	p->data = str;
+	p->pos = 0;
+	p->size = len;
+}
+
 static void
-parser_consume(struct parser *p, uint32_t size)
+parser_consume(struct parser *p, size_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->pos >= size);
+	p->pos += size;
+	if (p->pos == p->size && p->data == p->buffer) {
+		p->pos = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+}
+
+enum {
+	/** The byte ends a run of ordinary characters outside of quotes. */
+	TOKEN_SPECIAL_NO_QUOTE = 1,
+	/** The same inside "double quotes". */
+	TOKEN_SPECIAL_DOUBLE_QUOTE = 2,
+	/** The same inside 'single quotes'. */
+	TOKEN_SPECIAL_SINGLE_QUOTE = 4,
+};
+
+static const uint8_t token_special[256] = {
+	[' '] = TOKEN_SPECIAL_NO_QUOTE,
+	['\t'] = TOKEN_SPECIAL_NO_QUOTE,
+	['\r'] = TOKEN_SPECIAL_NO_QUOTE,
+	['\n'] = TOKEN_SPECIAL_NO_QUOTE,
+	['&'] = TOKEN_SPECIAL_NO_QUOTE,
+	['|'] = TOKEN_SPECIAL_NO_QUOTE,
+	['>'] = TOKEN_SPECIAL_NO_QUOTE,
+	['#'] = TOKEN_SPECIAL_NO_QUOTE,
+	['\\'] = TOKEN_SPECIAL_NO_QUOTE | TOKEN_SPECIAL_DOUBLE_QUOTE,
+	['$'] = TOKEN_SPECIAL_NO_QUOTE | TOKEN_SPECIAL_DOUBLE_QUOTE,
+	['"'] = TOKEN_SPECIAL_NO_QUOTE | TOKEN_SPECIAL_DOUBLE_QUOTE,
+	['\''] = TOKEN_SPECIAL_NO_QUOTE | TOKEN_SPECIAL_SINGLE_QUOTE,
+};
+
+#define SWAR_ONES 0x0101010101010101ull
+#define SWAR_HIGHS 0x8080808080808080ull
+
+/** Non-zero if any byte of @a word equals to @a c. */
+static inline uint64_t
+swar_has_byte(uint64_t word, char c)
+{
+	uint64_t x = word ^ (SWAR_ONES * (uint8_t)c);
+	return (x - SWAR_ONES) & ~x & SWAR_HIGHS;
+}
+
+/** Non-zero if any byte of @a word is less than @a c. */
+static inline uint64_t
+swar_has_less(uint64_t word, uint8_t c)
+{
+	return (word - SWAR_ONES * c) & ~word & SWAR_HIGHS;
+}
+
+/**
+ * Skip ordinary token characters starting from @a pos, i.e. the ones which
+ * are just copied into the token. Returns position of the first special byte
+ * or @a end. The bytes are checked by 8 at once (SWAR), and the exact one is
+ * found then via the table. The SWAR checks may give false positives, but
+ * never miss a special byte.
+ */
+static const char *
+token_skip_ordinary(const char *pos, const char *end, char quote)
+{
+	uint8_t mask;
+	uint64_t w;
+	if (quote == 0) {
+		mask = TOKEN_SPECIAL_NO_QUOTE;
+		for (; end - pos >= 8; pos += 8) {
+			memcpy(&w, pos, sizeof(w));
+			/* Whitespaces, quotes, '#', '&', '$' are all < '('. */
+			if ((swar_has_less(w, '(') | swar_has_byte(w, '>') |
+			     swar_has_byte(w, '\\') | swar_has_byte(w, '|')) != 0)
+				break;
+		}
+	} else if (quote == '"') {
+		mask = TOKEN_SPECIAL_DOUBLE_QUOTE;
+		for (; end - pos >= 8; pos += 8) {
+			memcpy(&w, pos, sizeof(w));
+			if ((swar_has_byte(w, '"') | swar_has_byte(w, '\\') |
+			     swar_has_byte(w, '$')) != 0)
+				break;
+		}
+	} else {
+		assert(quote == '\'');
+		mask = TOKEN_SPECIAL_SINGLE_QUOTE;
+		for (; end - pos >= 8; pos += 8) {
+			memcpy(&w, pos, sizeof(w));
+			if (swar_has_byte(w, '\'') != 0)
+				break;
+		}
+	}
+	while (pos < end && (token_special[(uint8_t)*pos] & mask) == 0)
+		++pos;
+	return pos;
+}
+
+/**
+ * Find the ')' closing a command substitution which content starts at
+ * @a pos. Quotes and escapes inside are skipped, nested parentheses are
+ * counted.
+ *
+ * @retval not NULL Position of the closing ')'.
+ * @retval NULL It is not fed yet.
+ */
+static const char *
+subst_find_end(const char *pos, const char *end)
+{
+	int depth = 1;
+	char quote = 0;
+	for (; pos < end; ++pos) {
+		char c = *pos;
+		if (quote == '\'') {
+			if (c == '\'')
+				quote = 0;
+			continue;
+		}
+		if (c == '\\') {
+			if (++pos == end)
+				return NULL;
+			continue;
+		}
+		if (quote == '"') {
+			if (c == '"')
+				quote = 0;
+			continue;
+		}
+		if (c == '\'' || c == '"')
+			quote = c;
+		else if (c == '(')
+			++depth;
+		else if (c == ')' && --depth == 0)
+			return pos;
+	}
+	return NULL;
+}
+
+static inline bool
+is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+/**
+ * Parse $NAME, ${NAME}, $? or $(command) at @a pos and append its value to
+ * the token. In the scan mode the expansion is appended as is.
+ *
+ * @return Number of parsed bytes, 0 if the expansion is not complete yet.
+ */
+static uint32_t
+parse_expansion(const char *pos, const char *end, struct token *out)
+{
+	assert(*pos == '$' && out->expand_mode != EXPAND_MODE_NONE);
+	const struct parser_expander *exp = out->expander;
+	const char *begin = pos++;
+	if (pos == end)
+		return 0;
+	const char *name = pos;
+	const char *name_end;
+	if (*pos == '(') {
+		const char *close = subst_find_end(pos + 1, end);
+		if (close == NULL)
+			return 0;
+		out->has_expansion = true;
+		if (out->expand_mode == EXPAND_MODE_SCAN) {
+			token_append_run(out, begin, close + 1 - begin);
+			return close + 1 - begin;
+		}
+		char *script = strndup(pos + 1, close - pos - 1);
+		char *res = NULL;
+		size_t size = 0;
+		exp->substitute(script, &res, &size, exp->ctx);
+		/* Trailing new lines are dropped, like in other shells. */
+		while (size > 0 && res[size - 1] == '\n')
+			--size;
+		if (size > 0)
+			token_append_run(out, res, size);
+		free(res);
+		free(script);
+		return close + 1 - begin;
+	}
+	if (*pos == '{') {
+		name = ++pos;
+		while (pos < end && *pos != '}' && *pos != '\n')
+			++pos;
+		if (pos == end)
+			return 0;
+		if (*pos == '\n') {
+			token_append(out, '$');
+			return 1;
+		}
+		name_end = pos++;
+	} else if (*pos == '?' || isdigit((unsigned char)*pos)) {
+		/* $? and positional parameters have one character names. */
+		name_end = ++pos;
+	} else {
+		while (pos < end && is_name_char(*pos))
+			++pos;
+		/* The name might continue in the next feed. */
+		if (pos == end)
+			return 0;
+		name_end = pos;
+		if (name == name_end) {
+			token_append(out, '$');
+			return 1;
+		}
+	}
+	out->has_expansion = true;
+	if (out->expand_mode == EXPAND_MODE_SCAN) {
+		token_append_run(out, begin, pos - begin);
+		return pos - begin;
+	}
+	char *name_str = strndup(name, name_end - name);
+	const char *value = exp->get_var(name_str, exp->ctx);
+	if (value != NULL)
+		token_append_run(out, value, strlen(value));
+	free(name_str);
+	return pos - begin;
 }
 
 static uint32_t
@@ -151,6 +431,14 @@ parse_token(const char *pos, const char *end, struct token *out)
 	}
 	char quote = 0;
 	while (pos < end) {
+		/* Copy ordinary characters in bulk, the switch is for others. */
+		const char *run_end = token_skip_ordinary(pos, end, quote);
+		if (run_end != pos) {
+			token_append_run(out, pos, run_end - pos);
+			pos = run_end;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -178,6 +466,10 @@ parse_token(const char *pos, const char *end, struct token *out)
 				{
 				case '\\':
 					goto append_and_next;
+				case '$':
+					if (out->expand_mode != EXPAND_MODE_NONE)
+						goto append_and_next;
+					break;
 				case '\n':
 					++pos;
 					continue;
@@ -250,15 +542,31 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			/* Whitespaces after an escaped new line. */
+			if (out->size == 0) {
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
+		case '$': {
+			if (quote == '\'' || out->expand_mode == EXPAND_MODE_NONE)
+				goto append_and_next;
+			uint32_t used = parse_expansion(pos, end, out);
+			if (used == 0)
+				return 0;
+			pos += used;
+			continue;
+		}
 		case '#':
 			if (quote != 0)
 				goto append_and_next;
@@ -285,32 +593,132 @@ parse_token(const char *pos, const char *end, struct token *out)
 	return 0;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+/**
+ * Copy the source text of words with expansions. A new line is appended
+ * to terminate the last word when it is parsed again.
+ */
+static char *
+source_dup(const char *begin, const char *end)
+{
+	size_t len = end - begin;
+	char *res = malloc(len + 2);
+	memcpy(res, begin, len);
+	res[len] = '\n';
+	res[len + 1] = 0;
+	return res;
+}
+
+/**
+ * Parse the words of @a source with the expansions done by @a exp. The
+ * first one is stored as the exe of @a out, others as the arguments.
+ */
+static void
+source_expand(const char *source, const struct parser_expander *exp,
+	      struct command *out)
+{
+	const char *pos = source;
+	const char *end = source + strlen(source);
+	struct token token = {0};
+	token.expand_mode = EXPAND_MODE_EXPAND;
+	token.expander = exp;
+	while (pos < end) {
+		uint32_t used = parse_token(pos, end, &token);
+		assert(used > 0);
+		pos += used;
+		if (token.type != TOKEN_TYPE_STR) {
+			assert(token.type == TOKEN_TYPE_NEW_LINE);
+			break;
+		}
+		if (out->exe == NULL)
+			out->exe = token_strdup(&token);
+		else
+			command_append_arg(out, token_strdup(&token));
+	}
+	free(token.data);
+}
+
+bool
+command_expand(struct command *cmd, const struct parser_expander *exp)
+{
+	if (cmd->source == NULL)
+		return true;
+	struct command res = {0};
+	source_expand(cmd->source, exp, &res);
+	command_destroy(cmd);
+	*cmd = res;
+	if (cmd->exe != NULL)
+		return true;
+	cmd->exe = strdup("");
+	return false;
+}
+
+bool
+command_line_expand_out_file(struct command_line *line,
+			     const struct parser_expander *exp)
+{
+	if (line->out_file_source == NULL)
+		return true;
+	struct command res = {0};
+	source_expand(line->out_file_source, exp, &res);
+	/* It is one word, and the values are not split. */
+	assert(res.arg_count == 0);
+	free(line->out_file_source);
+	line->out_file_source = NULL;
+	if (res.exe == NULL)
+		return false;
+	free(line->out_file);
+	line->out_file = res.exe;
+	free(res.args);
+	return true;
+}
+
+/**
+ * Parse the next line. Its size is returned in @a line_size when it is
+ * complete, or 0 otherwise.
+ */
+static enum parser_error
+parser_parse_line(struct parser *p, struct command_line **out,
+		  size_t *line_size)
 {
 	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
+	const char *pos = p->data + p->pos;
 	const char *begin = pos;
-	char *end = pos + p->size;
+	const char *end = p->data + p->size;
 	struct token token = {0};
+	token.expand_mode = p->is_expanding ? EXPAND_MODE_SCAN :
+			    EXPAND_MODE_NONE;
 	enum parser_error res = PARSER_ERR_NONE;
+	/* Source of the last command, if it has expansions. */
+	const char *cmd_begin = NULL;
+	bool cmd_has_expansion = false;
+	*line_size = 0;
 
 	while (pos < end) {
+		const char *token_begin = pos;
 		uint32_t used = parse_token(pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
+		if (token.type != TOKEN_TYPE_STR && cmd_has_expansion) {
+			line->tail->cmd.source = source_dup(cmd_begin,
+							    token_begin);
+			cmd_has_expansion = false;
+		}
 		struct expr *e;
 		switch(token.type) {
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
 				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				if (token.has_expansion)
+					cmd_has_expansion = true;
 				continue;
 			}
 			e = calloc(1, sizeof(*e));
 			e->type = EXPR_TYPE_COMMAND;
 			e->cmd.exe = token_strdup(&token);
 			command_line_append(line, e);
+			cmd_begin = token_begin;
+			cmd_has_expansion = token.has_expansion;
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
 			/* Skip new lines. */
@@ -367,12 +775,18 @@ parser_pop_next(struct parser *p, struct command_line **out)
 	goto return_no_line;
 
 close_and_return:
+	if (line->tail == NULL) {
+		/* Like '> file' or '&' without a command. */
+		res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		goto return_error;
+	}
 	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
 	{
 		if (token.type == TOKEN_TYPE_OUT_NEW)
 			line->out_type = OUTPUT_TYPE_FILE_NEW;
 		else
 			line->out_type = OUTPUT_TYPE_FILE_APPEND;
+		const char *file_begin = pos;
 		uint32_t used = parse_token(pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
@@ -382,6 +796,8 @@ close_and_return:
 			goto return_error;
 		}
 		line->out_file = token_strdup(&token);
+		if (token.has_expansion)
+			line->out_file_source = source_dup(file_begin, pos);
 		used = parse_token(pos, end, &token);
 		if (used == 0)
 			goto return_no_line;
@@ -396,7 +812,7 @@ close_and_return:
 	}
 	if (token.type == TOKEN_TYPE_NEW_LINE) {
 		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
+		*line_size = pos - begin;
 		if (line->tail->type != EXPR_TYPE_COMMAND) {
 			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
 			goto return_no_line;
@@ -411,15 +827,20 @@ close_and_return:
 return_error:
 	/*
 	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
+	 * just crash here because of that. The failed token itself might
+	 * be the line end already.
 	 */
+	if (token.type == TOKEN_TYPE_NEW_LINE) {
+		*line_size = pos - begin;
+		goto return_no_line;
+	}
 	while (pos < end) {
 		uint32_t used = parse_token(pos, end, &token);
 		if (used == 0)
 			break;
 		pos += used;
 		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
+			*line_size = pos - begin;
 			goto return_no_line;
 		}
 	}
@@ -435,6 +856,29 @@ return_final:
 	return res;
 }
 
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	size_t used;
+	enum parser_error res = parser_parse_line(p, out, &used);
+	parser_consume(p, used);
+	return res;
+}
+
+void
+parser_reset(struct parser *p)
+{
+	p->data = p->buffer;
+	p->pos = 0;
+	p->size = 0;
+}
+
+void
+parser_enable_expansions(struct parser *p)
+{
+	p->is_expanding = true;
+}
+
 void
 parser_delete(struct parser *p)
 {
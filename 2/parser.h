@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct parser;
@@ -23,6 +24,11 @@ struct command {
 	char** args;
 	uint32_t arg_count;
 	uint32_t arg_capacity;
+	/**
+	 * Source text of the command if it has expansions, NULL otherwise.
+	 * Until command_expand() the words keep the expansions as is.
+	 */
+	char *source;
 };
 
 enum expr_type {
@@ -51,6 +57,8 @@ struct command_line {
 	enum output_type out_type;
 	/** Valid if the out type is FILE. */
 	char *out_file;
+	/** Source text of the out file if it has expansions. */
+	char *out_file_source;
 	bool is_background;
 };
 
@@ -63,8 +71,65 @@ parser_new(void);
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Parse @a str in place, without copying it into the parser. Allowed only
+ * when all the previously fed data is parsed. The memory must stay valid
+ * until the next parser_feed() or the parser deletion. A next parser_feed()
+ * copies the not parsed rest of @a str, so it can be continued.
+ */
+void
+parser_attach(struct parser *p, const char *str, size_t len);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
+/** Drop all the not parsed data. The allocated buffer is kept. */
+void
+parser_reset(struct parser *p);
+
+/**
+ * Find $NAME, ${NAME}, $? and $(command) in unquoted and double quoted
+ * words. They are expanded later by command_expand(). Without it '$' is an
+ * ordinary character.
+ */
+void
+parser_enable_expansions(struct parser *p);
+
+/** Hooks to get the values of the expansions. */
+struct parser_expander {
+	/** Value of the variable @a name, NULL if it is not set. */
+	const char *(*get_var)(const char *name, void *ctx);
+	/**
+	 * Execute @a script and return its output in @a out, @a out_size.
+	 * The output is allocated by malloc().
+	 */
+	void (*substitute)(const char *script, char **out, size_t *out_size,
+			   void *ctx);
+	void *ctx;
+};
+
+/**
+ * Replace the expansions in the words of @a cmd with their values. It is
+ * called right before the command is executed, so as the substitutions of
+ * skipped commands are not run and the variables set by the previous ones
+ * are seen. The values are not split into words, empty unquoted words are
+ * dropped. Commands without expansions are not changed.
+ *
+ * @retval true Success.
+ * @retval false The command is expanded to nothing.
+ */
+bool
+command_expand(struct command *cmd, const struct parser_expander *exp);
+
+/**
+ * The same for the out file of @a line.
+ *
+ * @retval true Success.
+ * @retval false The file name is expanded to nothing, it is left as is.
+ */
+bool
+command_line_expand_out_file(struct command_line *line,
+			     const struct parser_expander *exp);
+
 void
 parser_delete(struct parser *p);
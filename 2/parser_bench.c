@@ -0,0 +1,154 @@
+/**
+ * Throughput benchmark of the parser. Each corpus is a synthetic script fed
+ * to parser_feed() by chunks, with all the lines popped by parser_pop_next()
+ * after each chunk, like the shell does. Usage:
+ *
+ *     ./parser_bench [corpus size in MB]
+ */
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct corpus {
+	const char *name;
+	/** Lines to repeat until the corpus is big enough. */
+	const char **lines;
+	int line_count;
+	/** Size of parts the corpus is fed by, 0 to attach it at once. */
+	uint32_t chunk_size;
+};
+
+static const char *short_lines[] = {
+	"ls\n",
+	"cd dir\n",
+	"pwd\n",
+	"echo 123\n",
+	"cat file.txt\n",
+	"mkdir -p a/b\n",
+	"true && echo ok\n",
+	"rm -f out\n",
+};
+
+static const char *quoted_lines[] = {
+	"echo \"a long string with whitespaces, \\\"escaped\\\" quotes and "
+	"'single' quotes inside, which is repeated several times to be long "
+	"enough; a long string with whitespaces, \\\"escaped\\\" quotes and "
+	"'single' quotes inside\" > out.txt\n",
+	"printf '%s\\n' 'single quoted text without any escapes at all, just "
+	"plain words separated by spaces and some punctuation: commas, dots.'\n",
+};
+
+static const char *pipeline_lines[] = {
+	"cat input.txt | grep -v '^#' | sed 's/a/b/g' | tr a-z A-Z | sort | "
+	"uniq -c | sort -rn | head -n 100 | awk '{print $2}' | tail -n 10 | "
+	"wc -l | tr -d ' ' | xargs echo | cat | cat | cat >> result.txt\n",
+};
+
+static const char *plain_lines[] = {
+	"gcc -Wextra -Werror -Wall -O2 -c src/some_module/implementation.c "
+	"-o build/objects/implementation.o\n",
+	"ls -la /usr/local/lib/x86_64-linux-gnu/pkgconfig\n",
+};
+
+#define CORPUS(name, lines, chunk) \
+	{name, lines, sizeof(lines) / sizeof(lines[0]), chunk}
+
+static const struct corpus corpora[] = {
+	CORPUS("short commands", short_lines, 1024),
+	CORPUS("long quoted strings", quoted_lines, 1024),
+	CORPUS("deep pipelines", pipeline_lines, 1024),
+	CORPUS("plain words", plain_lines, 1024),
+	CORPUS("plain words, 64KB feed", plain_lines, 64 * 1024),
+	CORPUS("plain words, attached", plain_lines, 0),
+	CORPUS("chunked by 16 bytes", plain_lines, 16),
+	CORPUS("chunked by 1 byte", short_lines, 1),
+};
+
+static char *
+corpus_build(const struct corpus *c, size_t size, size_t *out_size,
+	     size_t *out_lines)
+{
+	char *data = malloc(size + 1024);
+	size_t pos = 0;
+	size_t lines = 0;
+	while (pos < size) {
+		const char *line = c->lines[lines % c->line_count];
+		size_t len = strlen(line);
+		memcpy(data + pos, line, len);
+		pos += len;
+		++lines;
+	}
+	*out_size = pos;
+	*out_lines = lines;
+	return data;
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+corpus_run(const struct corpus *c, size_t size)
+{
+	/* Byte by byte feed is quadratic in line length, keep it small. */
+	if (c->chunk_size == 1)
+		size /= 16;
+	size_t lines;
+	char *data = corpus_build(c, size, &size, &lines);
+	struct parser *p = parser_new();
+	size_t popped = 0;
+	double start = now_sec();
+	uint32_t chunk_size = c->chunk_size;
+	if (chunk_size == 0) {
+		parser_attach(p, data, size);
+		chunk_size = size;
+	}
+	for (size_t pos = 0; pos < size; pos += chunk_size) {
+		if (c->chunk_size != 0) {
+			uint32_t len = chunk_size;
+			if (size - pos < len)
+				len = size - pos;
+			parser_feed(p, data + pos, len);
+		}
+		struct command_line *line;
+		while (true) {
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			if (err != PARSER_ERR_NONE) {
+				fprintf(stderr, "Unexpected error %d\n", err);
+				exit(1);
+			}
+			++popped;
+			command_line_delete(line);
+		}
+	}
+	double duration = now_sec() - start;
+	parser_delete(p);
+	free(data);
+	if (popped != lines) {
+		fprintf(stderr, "Expected %zu lines, got %zu\n", lines, popped);
+		exit(1);
+	}
+	printf("%-24s %10.1f MB/s %12.0f lines/s\n", c->name,
+	       size / duration / 1000000, lines / duration);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = 16;
+	if (argc > 1)
+		size = atoi(argv[1]);
+	size *= 1024 * 1024;
+	for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); ++i)
+		corpus_run(&corpora[i], size);
+	return 0;
+}
@@ -0,0 +1,276 @@
+/**
+ * Fuzzing harness for the parser. Each input is parsed three times: attached
+ * at once, fed byte by byte, and fed by chunks of pseudo-random sizes. All the
+ * ways must give the same command lines and errors, otherwise the harness
+ * aborts.
+ *
+ * libFuzzer: see 'make fuzz'. AFL and manual runs: build with
+ * -DPARSER_FUZZ_MAIN (see 'make fuzz_standalone'), then the inputs are read
+ * from the files given in the command line, or from stdin. '-n <count>' runs
+ * on randomly generated inputs instead.
+ */
+#include "parser.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct dump {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+dump_append(struct dump *d, const char *str, size_t len)
+{
+	if (d->capacity - d->size < len + 1) {
+		d->capacity = (d->capacity + len + 1) * 2;
+		d->data = realloc(d->data, d->capacity);
+	}
+	memcpy(d->data + d->size, str, len);
+	d->size += len;
+	d->data[d->size] = 0;
+}
+
+static void
+dump_append_str(struct dump *d, const char *str)
+{
+	/* Length first, so as different splits into args can't collide. */
+	char len[16];
+	int size = snprintf(len, sizeof(len), "%zu:", strlen(str));
+	dump_append(d, len, size);
+	dump_append(d, str, strlen(str));
+}
+
+static void
+dump_line(struct dump *d, const struct command_line *line)
+{
+	char head[64];
+	int size = snprintf(head, sizeof(head), "line bg=%d out=%d ",
+			    (int)line->is_background, (int)line->out_type);
+	dump_append(d, head, size);
+	if (line->out_file != NULL)
+		dump_append_str(d, line->out_file);
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		size = snprintf(head, sizeof(head), " (%d", (int)e->type);
+		dump_append(d, head, size);
+		if (e->type == EXPR_TYPE_COMMAND) {
+			dump_append(d, " ", 1);
+			dump_append_str(d, e->cmd.exe);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+				dump_append(d, " ", 1);
+				dump_append_str(d, e->cmd.args[i]);
+			}
+		}
+		dump_append(d, ")", 1);
+	}
+	dump_append(d, "\n", 1);
+}
+
+static bool
+dump_is_equal(const struct dump *a, const struct dump *b)
+{
+	return a->size == b->size &&
+	       (a->size == 0 || memcmp(a->data, b->data, a->size) == 0);
+}
+
+static void
+parser_drain(struct parser *p, const struct parser_expander *exp,
+	     struct dump *d)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			char str[32];
+			int size = snprintf(str, sizeof(str), "error %d\n",
+					    (int)err);
+			dump_append(d, str, size);
+			continue;
+		}
+		if (line == NULL)
+			return;
+		for (struct expr *e = line->head; e != NULL; e = e->next) {
+			if (e->type == EXPR_TYPE_COMMAND)
+				command_expand(&e->cmd, exp);
+		}
+		command_line_expand_out_file(line, exp);
+		dump_line(d, line);
+		command_line_delete(line);
+	}
+}
+
+static const char *
+fuzz_get_var(const char *name, void *ctx)
+{
+	(void)ctx;
+	/* Empty and not set variables are treated differently in words. */
+	if (name[0] == 'E')
+		return "";
+	if (name[0] == 'U')
+		return NULL;
+	return "v a l";
+}
+
+static void
+fuzz_substitute(const char *script, char **out, size_t *out_size, void *ctx)
+{
+	/* Substitutions are logged to check they are done once. */
+	dump_append(ctx, "subst ", 6);
+	dump_append_str(ctx, script);
+	dump_append(ctx, "\n", 1);
+	*out = strdup(script);
+	*out_size = strlen(script);
+}
+
+/**
+ * Parse @a data fed by chunks. Chunk sizes are generated from @a seed, 0
+ * means the whole data attached at once, 1 means byte by byte.
+ */
+static void
+parse_by_chunks(const char *data, size_t size, uint32_t seed,
+		struct dump *d)
+{
+	struct parser *p = parser_new();
+	struct parser_expander exp = {
+		.get_var = fuzz_get_var,
+		.substitute = fuzz_substitute,
+		.ctx = d,
+	};
+	parser_enable_expansions(p);
+	if (seed == 0) {
+		parser_attach(p, data, size);
+		parser_drain(p, &exp, d);
+		parser_delete(p);
+		return;
+	}
+	size_t pos = 0;
+	while (pos < size) {
+		size_t chunk = size - pos;
+		if (seed == 1) {
+			chunk = 1;
+		} else {
+			seed = seed * 1103515245 + 12345;
+			size_t len = (seed >> 16) % 64 + 1;
+			if (len < chunk)
+				chunk = len;
+		}
+		parser_feed(p, data + pos, chunk);
+		parser_drain(p, &exp, d);
+		pos += chunk;
+	}
+	parser_delete(p);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const char *str = (const char *)data;
+	uint32_t seed = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+		seed = (seed ^ data[i]) * 16777619u;
+	seed |= 2;
+	struct dump whole = {0};
+	struct dump bytes = {0};
+	struct dump chunks = {0};
+	parse_by_chunks(str, size, 0, &whole);
+	parse_by_chunks(str, size, 1, &bytes);
+	parse_by_chunks(str, size, seed, &chunks);
+	const char *fail = NULL;
+	const struct dump *other = NULL;
+	if (!dump_is_equal(&whole, &bytes)) {
+		fail = "byte by byte";
+		other = &bytes;
+	} else if (!dump_is_equal(&whole, &chunks)) {
+		fail = "by chunks";
+		other = &chunks;
+	}
+	if (fail != NULL) {
+		fprintf(stderr, "Parsing %s differs from at once.\n"
+			"Input:\n%.*s\nAt once:\n%.*s\nThe other:\n%.*s\n",
+			fail, (int)size, str, (int)whole.size, whole.data,
+			(int)other->size, other->data);
+		abort();
+	}
+	free(whole.data);
+	free(bytes.data);
+	free(chunks.data);
+	return 0;
+}
+
+#ifdef PARSER_FUZZ_MAIN
+
+static void
+run_file(FILE *f)
+{
+	struct dump input = {0};
+	char buf[4096];
+	size_t rc;
+	while ((rc = fread(buf, 1, sizeof(buf), f)) > 0)
+		dump_append(&input, buf, rc);
+	LLVMFuzzerTestOneInput((const uint8_t *)input.data, input.size);
+	free(input.data);
+}
+
+/** Random inputs made of parser's special characters and short words. */
+static void
+run_random(long count)
+{
+	static const char *parts[] = {
+		" ", "  ", "\t", "\n", "\\\n", "\\", "'", "\"", "|", "||", "&",
+		"&&", ">", ">>", "#", "echo", "ls", "a", "long_argument_word",
+		"x y", "\\\"", "\\'", "\\\\", "\r",
+		"$", "$X", "$E", "$U", "${X}", "${E", "$?", "$1", "$(", ")",
+		"(",
+	};
+	const size_t part_count = sizeof(parts) / sizeof(parts[0]);
+	uint32_t seed = 1;
+	char input[512];
+	for (long i = 0; i < count; ++i) {
+		size_t size = 0;
+		seed = seed * 1103515245 + 12345;
+		int n = (seed >> 16) % 40;
+		for (int j = 0; j < n; ++j) {
+			seed = seed * 1103515245 + 12345;
+			const char *part = parts[(seed >> 16) % part_count];
+			size_t len = strlen(part);
+			if (size + len >= sizeof(input) - 1)
+				break;
+			memcpy(input + size, part, len);
+			size += len;
+		}
+		input[size++] = '\n';
+		LLVMFuzzerTestOneInput((const uint8_t *)input, size);
+	}
+	printf("%ld random inputs are parsed the same way\n", count);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+		run_random(atol(argv[2]));
+		return 0;
+	}
+	if (argc == 1) {
+		run_file(stdin);
+		return 0;
+	}
+	for (int i = 1; i < argc; ++i) {
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		run_file(f);
+		fclose(f);
+	}
+	return 0;
+}
+
+#endif
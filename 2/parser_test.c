@@ -773,6 +773,113 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_long_words(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	char word[128];
+	char str[512];
+
+	unit_msg("Special byte at each offset of a long word");
+	const char *specials = " |&>'\"\\#\t";
+	for (int len = 1; len < 40; ++len) {
+		memset(word, 'a' + len % 26, len);
+		word[len] = 0;
+		for (const char *c = specials; *c != 0; ++c) {
+			int size;
+			switch (*c) {
+			case '\'':
+				size = sprintf(str, "%s'x y'%s\n", word, word);
+				break;
+			case '"':
+				size = sprintf(str, "%s\"x\\\"y\"%s\n", word, word);
+				break;
+			case '\\':
+				size = sprintf(str, "%s\\ %s\n", word, word);
+				break;
+			case '#':
+				size = sprintf(str, "%s #%s\n", word, word);
+				break;
+			case '&':
+				size = sprintf(str, "%s&&%s\n", word, word);
+				break;
+			default:
+				size = sprintf(str, "%s%c%s\n", word, *c, word);
+				break;
+			}
+			parser_feed(p, str, size);
+			unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+			unit_fail_if(line == NULL);
+			struct expr *e = line->head;
+			unit_fail_if(e->type != EXPR_TYPE_COMMAND);
+			unit_fail_if(strncmp(e->cmd.exe, word, len) != 0);
+			switch (*c) {
+			case '\'':
+			case '"':
+				/* A closing quote ends the token. */
+				unit_fail_if(e->cmd.arg_count != 1);
+				unit_fail_if(strcmp(e->cmd.exe + len,
+						    *c == '"' ? "x\"y" : "x y") != 0);
+				unit_fail_if(strcmp(e->cmd.args[0], word) != 0);
+				break;
+			case '\\':
+				unit_fail_if(e->cmd.arg_count != 0);
+				unit_fail_if(e->cmd.exe[len] != ' ' ||
+					     strcmp(e->cmd.exe + len + 1, word) != 0);
+				break;
+			case '#':
+				unit_fail_if(e->cmd.arg_count != 0);
+				unit_fail_if(e->cmd.exe[len] != 0);
+				break;
+			case ' ':
+			case '\t':
+				unit_fail_if(e->cmd.arg_count != 1);
+				unit_fail_if(strcmp(e->cmd.args[0], word) != 0);
+				break;
+			case '>':
+				unit_fail_if(e->cmd.exe[len] != 0);
+				unit_fail_if(strcmp(line->out_file, word) != 0);
+				break;
+			default:
+				unit_fail_if(e->cmd.exe[len] != 0);
+				unit_fail_if(e->next == NULL);
+				e = e->next->next;
+				unit_fail_if(strcmp(e->cmd.exe, word) != 0);
+				break;
+			}
+			command_line_delete(line);
+		}
+	}
+	unit_check(true, "all offsets");
+
+	unit_msg("Long quoted string fed by parts");
+	const char *quoted = "echo \"one two three four five six seven eight "
+			     "nine ten eleven twelve\" 'and a single-quoted "
+			     "one with \"inner\" quotes' last\n";
+	uint32_t len = strlen(quoted);
+	for (uint32_t i = 0; i < len; i += 7) {
+		parser_feed(p, quoted + i, len - i < 7 ? len - i : 7);
+		if (i + 7 < len) {
+			unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+			unit_fail_if(line != NULL);
+		}
+	}
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "one two three four five six seven "
+			  "eight nine ten eleven twelve") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "and a single-quoted one with "
+			  "\"inner\" quotes") == 0, "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "last") == 0, "arg[2]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -789,6 +896,139 @@ test_error_one(struct parser *p, const char *expr, enum parser_error err)
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse none");
 }
 
+struct test_expander {
+	int subst_count;
+	/** Value of $Y, changed by the test. */
+	const char *y;
+};
+
+static const char *
+test_get_var(const char *name, void *ctx)
+{
+	struct test_expander *te = ctx;
+	if (strcmp(name, "X") == 0)
+		return "x value";
+	if (strcmp(name, "Y") == 0)
+		return te->y;
+	if (strcmp(name, "?") == 0)
+		return "3";
+	return NULL;
+}
+
+static void
+test_substitute(const char *script, char **out, size_t *out_size, void *ctx)
+{
+	struct test_expander *te = ctx;
+	++te->subst_count;
+	/* The output is the script itself, with a trailing new line. */
+	*out_size = strlen(script) + 1;
+	*out = malloc(*out_size);
+	memcpy(*out, script, *out_size - 1);
+	(*out)[*out_size - 1] = '\n';
+}
+
+static void
+test_expansion(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	struct test_expander te = {0};
+	struct parser_expander exp = {
+		.get_var = test_get_var,
+		.substitute = test_substitute,
+		.ctx = &te,
+	};
+	parser_enable_expansions(p);
+
+	const char *str = "echo $X \"[$X]\" '$X' \\$X ${X}s $? $UNSET | "
+			  "cat $(a (b) \")\"\nc) \"$(d)\"";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(te.subst_count == 0, "nothing is expanded by the parser");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.args[0], "$X") == 0, "words are kept as is");
+	unit_check(command_expand(&e->cmd, &exp), "expand");
+	unit_check(e->cmd.source == NULL, "the source is dropped");
+	unit_check(e->cmd.arg_count == 6, "empty variable is dropped");
+	unit_check(strcmp(e->cmd.args[0], "x value") == 0, "variable");
+	unit_check(strcmp(e->cmd.args[1], "[x value]") == 0, "in quotes");
+	unit_check(strcmp(e->cmd.args[2], "$X") == 0, "in single quotes");
+	unit_check(strcmp(e->cmd.args[3], "$X") == 0, "escaped");
+	unit_check(strcmp(e->cmd.args[4], "x values") == 0, "braces");
+	unit_check(strcmp(e->cmd.args[5], "3") == 0, "exit code");
+	e = e->next->next;
+	unit_check(te.subst_count == 0, "commands are expanded one by one");
+	unit_check(command_expand(&e->cmd, &exp), "expand");
+	unit_check(te.subst_count == 2, "each substitution is done once");
+	unit_check(strcmp(e->cmd.exe, "cat") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "a (b) \")\"\nc") == 0,
+		   "substitution");
+	unit_check(strcmp(e->cmd.args[1], "d") == 0, "quoted substitution");
+	command_line_delete(line);
+
+	unit_msg("Commands without expansions are not changed");
+	parser_feed(p, "echo '$X' \"\"\n", 13);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(e->cmd.source == NULL, "no source");
+	unit_check(command_expand(&e->cmd, &exp), "expand");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "$X") == 0, "arg");
+	command_line_delete(line);
+
+	unit_msg("Skipped commands are not expanded");
+	parser_feed(p, "false && echo $(touch x)\n", 25);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.source == NULL, "no source");
+	unit_check(line->tail->cmd.source != NULL, "source");
+	unit_check(te.subst_count == 2, "no substitution");
+	command_line_delete(line);
+
+	unit_msg("Variables set by the previous commands are seen");
+	te.y = "old";
+	parser_feed(p, "Y=1 && echo $Y\n", 15);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	te.y = "1";
+	e = line->tail;
+	unit_check(command_expand(&e->cmd, &exp), "expand");
+	unit_check(strcmp(e->cmd.args[0], "1") == 0, "new value");
+	command_line_delete(line);
+
+	unit_msg("Command expanded to nothing");
+	parser_feed(p, "$UNSET ${UNSET} > $X\n", 21);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->out_file, "$X") == 0, "out file as is");
+	unit_check(!command_expand(&line->head->cmd, &exp), "no words");
+	unit_check(strcmp(line->head->cmd.exe, "") == 0, "empty exe");
+	unit_check(command_line_expand_out_file(line, &exp), "expand file");
+	unit_check(strcmp(line->out_file, "x value") == 0, "out file");
+	command_line_delete(line);
+	parser_feed(p, "echo >> $UNSET\n", 15);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(!command_line_expand_out_file(line, &exp), "no file");
+	command_line_delete(line);
+	parser_feed(p, "echo >> \"$UNSET\"\n", 17);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(command_line_expand_out_file(line, &exp), "quoted");
+	unit_check(strcmp(line->out_file, "") == 0, "empty file name");
+	command_line_delete(line);
+
+	unit_msg("Expansions are not done in lines with errors");
+	test_error_one(p, "| $(a)", PARSER_ERR_PIPE_WITH_NO_LEFT_ARG);
+	unit_check(te.subst_count == 2, "no substitution");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_errors(void)
 {
@@ -808,6 +1048,48 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "> test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+
+	unit_msg("Redirect without a file doesn't take the next line");
+	parser_feed(p, "exe >\necho\n", 11);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
+		   "parse error");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "exe");
+	command_line_delete(line);
+
+	unit_msg("Empty quoted argument");
+	parser_feed(p, "echo '' \"\"\n", 11);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(line->head->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(line->head->cmd.args[0], "") == 0, "arg 1");
+	unit_check(strcmp(line->head->cmd.args[1], "") == 0, "arg 2");
+	command_line_delete(line);
+
+	unit_msg("Attached data");
+	const char *script = "echo 1\necho 2\necho 3";
+	parser_attach(p, script, strlen(script));
+	for (int i = 0; i < 2; ++i) {
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+		unit_check(strcmp(line->head->cmd.args[0], i == 0 ? "1" : "2") == 0,
+			   "arg");
+		command_line_delete(line);
+	}
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(line == NULL, "the last line is not complete");
+	parser_feed(p, "3\n", 2);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(strcmp(line->head->cmd.args[0], "33") == 0, "the rest is copied");
+	command_line_delete(line);
+
+	unit_msg("Escaped line end between words");
+	parser_feed(p, "a \\\n b\n", 7);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(strcmp(line->head->cmd.exe, "a") == 0, "exe");
+	unit_check(line->head->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(line->head->cmd.args[0], "b") == 0, "arg");
+	command_line_delete(line);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -833,6 +1115,8 @@ main(void)
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_long_words();
 	test_errors();
+	test_expansion();
 	return 0;
 }
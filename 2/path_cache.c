@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+
+#include "path_cache.h"
+#include "str_table.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Resolved path of a command, stored in the table by the command name. */
+struct path_entry {
+	/** Full path found in $PATH. */
+	char *path;
+	/** How many times the command was looked up. */
+	uint32_t hits;
+};
+
+struct path_cache {
+	/** Command names as they are typed mapped to their entries. */
+	struct str_table *entries;
+	/** $PATH for which the entries were resolved. */
+	char *env_path;
+	/** Buffer to build candidate paths. */
+	char *buf;
+	size_t buf_capacity;
+};
+
+struct path_cache *
+path_cache_new(void)
+{
+	struct path_cache *cache = calloc(1, sizeof(*cache));
+	cache->entries = str_table_new();
+	return cache;
+}
+
+static void
+path_entry_delete(void *ptr)
+{
+	struct path_entry *e = ptr;
+	if (e == NULL)
+		return;
+	free(e->path);
+	free(e);
+}
+
+void
+path_cache_clear(struct path_cache *cache)
+{
+	str_table_clear(cache->entries, path_entry_delete);
+}
+
+void
+path_cache_delete(struct path_cache *cache)
+{
+	path_cache_clear(cache);
+	str_table_delete(cache->entries);
+	free(cache->env_path);
+	free(cache->buf);
+	free(cache);
+}
+
+/** Drop the entries if $PATH was changed since they were resolved. */
+static void
+path_cache_check_env(struct path_cache *cache, const char *env_path)
+{
+	if (env_path == NULL)
+		env_path = "/bin:/usr/bin";
+	if (cache->env_path != NULL && strcmp(cache->env_path, env_path) == 0)
+		return;
+	path_cache_clear(cache);
+	free(cache->env_path);
+	cache->env_path = strdup(env_path);
+}
+
+static bool
+is_executable(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+	       access(path, X_OK) == 0;
+}
+
+/** Search $PATH the same way as execvp() does. */
+static char *
+path_cache_resolve(struct path_cache *cache, const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *dir = cache->env_path;
+	while (true) {
+		const char *dir_end = strchrnul(dir, ':');
+		size_t dir_len = dir_end - dir;
+		size_t need = dir_len + name_len + 2;
+		if (need > cache->buf_capacity) {
+			cache->buf_capacity = need * 2;
+			cache->buf = realloc(cache->buf, cache->buf_capacity);
+		}
+		char *pos = cache->buf;
+		/* Empty directory means the current one. */
+		if (dir_len == 0) {
+			*pos++ = '.';
+		} else {
+			memcpy(pos, dir, dir_len);
+			pos += dir_len;
+		}
+		*pos++ = '/';
+		memcpy(pos, name, name_len + 1);
+		if (is_executable(cache->buf))
+			return strdup(cache->buf);
+		if (*dir_end == 0)
+			return NULL;
+		dir = dir_end + 1;
+	}
+}
+
+const char *
+path_cache_lookup(struct path_cache *cache, const char *name,
+		  const char *env_path)
+{
+	if (strchr(name, '/') != NULL)
+		return name;
+	path_cache_check_env(cache, env_path);
+	struct path_entry *e = str_table_get(cache->entries, name);
+	if (e != NULL) {
+		++e->hits;
+		return e->path;
+	}
+	char *path = path_cache_resolve(cache, name);
+	if (path == NULL)
+		return NULL;
+	e = malloc(sizeof(*e));
+	e->path = path;
+	e->hits = 1;
+	str_table_set(cache->entries, name, e);
+	return e->path;
+}
+
+void
+path_cache_forget(struct path_cache *cache, const char *name)
+{
+	path_entry_delete(str_table_remove(cache->entries, name));
+}
+
+struct path_cache_visit {
+	path_cache_visit_f cb;
+	void *arg;
+};
+
+static void
+path_cache_visit_entry(const char *name, void *value, void *arg)
+{
+	struct path_cache_visit *visit = arg;
+	struct path_entry *e = value;
+	visit->cb(name, e->path, e->hits, visit->arg);
+}
+
+void
+path_cache_foreach(struct path_cache *cache, const char *env_path,
+		   path_cache_visit_f cb, void *arg)
+{
+	path_cache_check_env(cache, env_path);
+	struct path_cache_visit visit = {cb, arg};
+	str_table_foreach(cache->entries, path_cache_visit_entry, &visit);
+}
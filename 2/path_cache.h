@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Cache of resolved command paths. A command name is looked up in $PATH only
+ * the first time, then the found full path is remembered. The cache drops
+ * itself when $PATH changes. $PATH is given by the caller, NULL means the
+ * default one.
+ */
+struct path_cache;
+
+struct path_cache *
+path_cache_new(void);
+
+void
+path_cache_delete(struct path_cache *cache);
+
+/**
+ * Find full path of the executable @a name. Names with '/' are returned as
+ * is. Other names are searched in the directories of $PATH.
+ *
+ * @retval not NULL Path to execute. Valid until the next call.
+ * @retval NULL The command is not found.
+ */
+const char *
+path_cache_lookup(struct path_cache *cache, const char *name,
+		  const char *env_path);
+
+/** Forget all the resolved paths. */
+void
+path_cache_clear(struct path_cache *cache);
+
+/** Forget the resolved path of one command. */
+void
+path_cache_forget(struct path_cache *cache, const char *name);
+
+typedef void (*path_cache_visit_f)(const char *name, const char *path,
+				   uint32_t hits, void *arg);
+
+/** Call @a cb for each cached command. */
+void
+path_cache_foreach(struct path_cache *cache, const char *env_path,
+		   path_cache_visit_f cb, void *arg);
@@ -1,170 +1,2230 @@
+#define _GNU_SOURCE
+
 #include "parser.h"
+#include "path_cache.h"
+#include "vars.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	/** Pipes fed from a file by the shell are grown up to this size. */
+	PIPE_FILE_MAX_SIZE = 1024 * 1024,
+	/**
+	 * New parallel tasks aren't started while the output buffered by the
+	 * finished ones, waiting for the previous lines, is above this size.
+	 */
+	TASK_OUTPUT_MAX_SIZE = 64 * 1024 * 1024,
+};
+
+enum job_state {
+	JOB_STATE_RUNNING,
+	JOB_STATE_DONE,
+};
+
+/** A command line started with '&'. */
+struct job {
+	/** Number shown in 'jobs' and accepted by 'wait %N'. */
+	int id;
+	/** Subshell process executing the whole command line. */
+	pid_t pid;
+	enum job_state state;
+	/** Valid if the state is DONE. */
+	int exit_code;
+	/** Printable command line. */
+	char *title;
+	/** Jobs are stored in a list ordered by id. */
+	struct job *next;
+};
+
+/**
+ * A command line executed concurrently with other lines in '-j N' mode. Its
+ * stdout goes into a pipe and is buffered until all the previous lines are
+ * printed, so the output order is the same as without parallelism.
+ */
+struct line_task {
+	/** Subshell process executing the command line. */
+	pid_t pid;
+	/** Read end of the pipe with the task's stdout. -1 after EOF. */
+	int out_fd;
+	/** Output not printed yet. */
+	char *buf;
+	size_t size;
+	size_t capacity;
+	bool is_finished;
+	/** Valid if the task is finished. */
+	int exit_code;
+	/** Tasks are stored in a list in the order of their command lines. */
+	struct line_task *next;
+};
+
+/**
+ * Whole state of the terminal. Passed everywhere explicitly instead of having
+ * global variables.
+ */
+struct shell {
+	/** Background jobs, both running and finished but not reported yet. */
+	struct job *jobs;
+	/**
+	 * SIGCHLD is blocked and delivered via this descriptor. The main loop
+	 * polls it together with stdin to reap finished jobs even when no
+	 * commands arrive. -1 if the platform couldn't provide it.
+	 */
+	int sigchld_fd;
+	/** Signal mask to restore in the children before exec. */
+	sigset_t orig_sigmask;
+	/** How many command lines can be executed at once. */
+	int max_tasks;
+	/** Command lines being executed concurrently, in their order. */
+	struct line_task *tasks;
+	struct line_task *last_task;
+	/** Tasks in the list, including the finished but not printed ones. */
+	int task_count;
+	/** Tasks which subshells haven't exited yet. */
+	int running_task_count;
+	/** Memory taken by the output buffers of the tasks. */
+	size_t task_output_size;
+	/** Full paths of the commands found in $PATH. */
+	struct path_cache *paths;
+	/** Shell variables set by 'NAME=value'. */
+	struct vars *vars;
+	/** Values of $NAME and $(command) in the commands to execute. */
+	struct parser_expander expander;
+	/** Text of the exit code, for $?. */
+	char exit_code_str[16];
+	/**
+	 * Log with resource usage of each executed pipeline, opened from
+	 * $SHELL_TRACE. -1 if tracing is off.
+	 */
+	int trace_fd;
+	/**
+	 * Whether 'cat FILE' stages are done by moving the file data inside
+	 * the kernel instead of executing cat.
+	 */
+	bool is_zero_copy;
+	/**
+	 * The shell executes scripts of clients and ignores SIGPIPE, which
+	 * must be restored in the children.
+	 */
+	bool is_server;
+	/** Exit code of the last executed command line. */
+	int exit_code;
+	bool is_exit_called;
+};
+
+/** Resources consumed by a pipeline. Times are in seconds. */
+struct exec_stats {
+	struct timespec start;
+	double real;
+	double user;
+	double sys;
+	/** Maximal RSS among the processes, in kilobytes. */
+	long maxrss;
+	/** Voluntary and involuntary context switches. */
+	long nvcsw;
+	long nivcsw;
+};
 
 static int
-execute_command_line(const struct command_line *line, int* exit_called)
+execute_command_line(struct shell *sh, struct command_line *line);
+
+static const char *
+shell_get_var(const char *name, void *ctx);
+
+static void
+shell_substitute(const char *script, char **out, size_t *out_size,
+		 void *ctx);
+
+static double
+timeval_to_sec(const struct timeval *tv)
 {
-	assert(line != NULL);
-    FILE* file_out_descriptor = NULL;
-	if (line->out_type == OUTPUT_TYPE_STDOUT) {
-	} else if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-        file_out_descriptor = fopen(line->out_file, "w");
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static void
+exec_stats_add(struct exec_stats *stats, const struct rusage *ru)
+{
+	stats->user += timeval_to_sec(&ru->ru_utime);
+	stats->sys += timeval_to_sec(&ru->ru_stime);
+	if (ru->ru_maxrss > stats->maxrss)
+		stats->maxrss = ru->ru_maxrss;
+	stats->nvcsw += ru->ru_nvcsw;
+	stats->nivcsw += ru->ru_nivcsw;
+}
+
+static int
+status_to_exit_code(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 1;
+}
+
+static void
+title_append(char **title, size_t *size, const char *str)
+{
+	size_t len = strlen(str);
+	*title = realloc(*title, *size + len + 2);
+	if (*size != 0)
+		(*title)[(*size)++] = ' ';
+	memcpy(*title + *size, str, len + 1);
+	*size += len;
+}
+
+static void
+title_append_exprs(char **title, size_t *size, const struct expr *begin,
+		   const struct expr *end)
+{
+	for (const struct expr *e = begin; e != end; e = e->next) {
+		switch (e->type) {
+		case EXPR_TYPE_COMMAND:
+			title_append(title, size, e->cmd.exe);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+				title_append(title, size, e->cmd.args[i]);
+			break;
+		case EXPR_TYPE_PIPE:
+			title_append(title, size, "|");
+			break;
+		case EXPR_TYPE_AND:
+			title_append(title, size, "&&");
+			break;
+		case EXPR_TYPE_OR:
+			title_append(title, size, "||");
+			break;
+		default:
+			assert(false);
+		}
+	}
+}
+
+static char *
+command_line_title(const struct command_line *line)
+{
+	char *title = NULL;
+	size_t size = 0;
+	title_append_exprs(&title, &size, line->head, NULL);
+	if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
+		title_append(&title, &size, ">");
+		title_append(&title, &size, line->out_file);
 	} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-        file_out_descriptor = fopen(line->out_file, "a+");
+		title_append(&title, &size, ">>");
+		title_append(&title, &size, line->out_file);
+	}
+	return title;
+}
+
+static struct job *
+shell_add_job(struct shell *sh, pid_t pid, char *title)
+{
+	struct job *job = calloc(1, sizeof(*job));
+	job->pid = pid;
+	job->state = JOB_STATE_RUNNING;
+	job->title = title;
+	job->id = 1;
+	struct job **pos = &sh->jobs;
+	for (; *pos != NULL; pos = &(*pos)->next)
+		job->id = (*pos)->id + 1;
+	*pos = job;
+	return job;
+}
+
+static void
+shell_delete_job(struct shell *sh, struct job *job)
+{
+	struct job **pos = &sh->jobs;
+	while (*pos != job)
+		pos = &(*pos)->next;
+	*pos = job->next;
+	free(job->title);
+	free(job);
+}
+
+static void
+job_set_status(struct job *job, int status)
+{
+	job->state = JOB_STATE_DONE;
+	job->exit_code = status_to_exit_code(status);
+}
+
+/**
+ * Collect all the finished background jobs and parallel tasks without
+ * blocking. Jobs stay in the table as DONE until 'jobs' or 'wait' reports
+ * them.
+ */
+static void
+shell_reap_children(struct shell *sh)
+{
+	if (sh->sigchld_fd >= 0) {
+		struct signalfd_siginfo info[8];
+		while (read(sh->sigchld_fd, info, sizeof(info)) > 0)
+			;
+	}
+	for (struct job *job = sh->jobs; job != NULL; job = job->next) {
+		if (job->state != JOB_STATE_RUNNING)
+			continue;
+		int status;
+		if (waitpid(job->pid, &status, WNOHANG) == job->pid)
+			job_set_status(job, status);
+	}
+	for (struct line_task *t = sh->tasks; t != NULL; t = t->next) {
+		if (t->is_finished)
+			continue;
+		int status;
+		if (waitpid(t->pid, &status, WNOHANG) == t->pid) {
+			t->is_finished = true;
+			t->exit_code = status_to_exit_code(status);
+			--sh->running_task_count;
+		}
+	}
+}
+
+static void
+shell_delete_first_task(struct shell *sh)
+{
+	struct line_task *t = sh->tasks;
+	sh->tasks = t->next;
+	if (sh->tasks == NULL)
+		sh->last_task = NULL;
+	--sh->task_count;
+	if (!t->is_finished)
+		--sh->running_task_count;
+	sh->task_output_size -= t->capacity;
+	if (t->out_fd >= 0)
+		close(t->out_fd);
+	free(t->buf);
+	free(t);
+}
+
+static void
+shell_create(struct shell *sh)
+{
+	memset(sh, 0, sizeof(*sh));
+	sh->max_tasks = 1;
+	sh->is_zero_copy = true;
+	sh->paths = path_cache_new();
+	sh->vars = vars_new();
+	vars_import(sh->vars, environ);
+	sh->expander.get_var = shell_get_var;
+	sh->expander.substitute = shell_substitute;
+	sh->expander.ctx = sh;
+	sh->trace_fd = -1;
+	const char *trace_path = getenv("SHELL_TRACE");
+	if (trace_path != NULL && *trace_path != 0) {
+		sh->trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND |
+				    O_CLOEXEC, 0644);
+		if (sh->trace_fd < 0) {
+			fprintf(stderr, "SHELL_TRACE: %s: %s\n", trace_path,
+				strerror(errno));
+		}
+	}
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &sh->orig_sigmask);
+	sh->sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sh->sigchld_fd < 0)
+		sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL);
+}
+
+static void
+shell_destroy(struct shell *sh)
+{
+	assert(sh->tasks == NULL);
+	while (sh->jobs != NULL)
+		shell_delete_job(sh, sh->jobs);
+	path_cache_delete(sh->paths);
+	vars_delete(sh->vars);
+	if (sh->trace_fd >= 0)
+		close(sh->trace_fd);
+	if (sh->sigchld_fd >= 0) {
+		close(sh->sigchld_fd);
+		sh->sigchld_fd = -1;
+		sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL);
+	}
+}
+
+static int
+builtin_exit(struct shell *sh, const struct command *cmd)
+{
+	sh->is_exit_called = true;
+	if (cmd->arg_count == 0)
+		return sh->exit_code;
+	return atoi(cmd->args[0]) & 0xff;
+}
+
+static int
+builtin_cd(struct shell *sh, const struct command *cmd)
+{
+	(void)sh;
+	if (cmd->arg_count == 0) {
+		fprintf(stderr, "cd: have to provide directory\n");
+		return 1;
+	}
+	if (chdir(cmd->args[0]) != 0) {
+		fprintf(stderr, "cd: %s: %s\n", cmd->args[0], strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int
+builtin_jobs(struct shell *sh, const struct command *cmd)
+{
+	(void)cmd;
+	shell_reap_children(sh);
+	struct job *job = sh->jobs;
+	while (job != NULL) {
+		struct job *next = job->next;
+		if (job->state == JOB_STATE_RUNNING) {
+			printf("[%d]  Running  %s &\n", job->id, job->title);
+		} else {
+			printf("[%d]  Done(%d)  %s\n", job->id, job->exit_code,
+			       job->title);
+			shell_delete_job(sh, job);
+		}
+		job = next;
+	}
+	fflush(stdout);
+	return 0;
+}
+
+static struct job *
+shell_find_job(struct shell *sh, const char *spec)
+{
+	bool is_id = spec[0] == '%';
+	int key = atoi(is_id ? spec + 1 : spec);
+	for (struct job *job = sh->jobs; job != NULL; job = job->next) {
+		if ((is_id && job->id == key) || (!is_id && job->pid == key))
+			return job;
+	}
+	return NULL;
+}
+
+static int
+job_wait(struct job *job)
+{
+	if (job->state == JOB_STATE_RUNNING) {
+		int status;
+		while (waitpid(job->pid, &status, 0) < 0) {
+			if (errno != EINTR)
+				return 127;
+		}
+		job_set_status(job, status);
+	}
+	return job->exit_code;
+}
+
+/**
+ * 'wait' without arguments waits for all the jobs and returns 0. With
+ * arguments ('%<id>' or '<pid>') it waits for the given jobs and returns the
+ * exit code of the last one, 127 if it is unknown.
+ */
+static int
+builtin_wait(struct shell *sh, const struct command *cmd)
+{
+	if (cmd->arg_count == 0) {
+		while (sh->jobs != NULL) {
+			job_wait(sh->jobs);
+			shell_delete_job(sh, sh->jobs);
+		}
+		return 0;
+	}
+	int res = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		struct job *job = shell_find_job(sh, cmd->args[i]);
+		if (job == NULL) {
+			fprintf(stderr, "wait: %s: no such job\n", cmd->args[i]);
+			res = 127;
+			continue;
+		}
+		res = job_wait(job);
+		shell_delete_job(sh, job);
+	}
+	return res;
+}
+
+static void
+print_hash_entry(const char *name, const char *path, uint32_t hits, void *arg)
+{
+	(void)name;
+	bool *is_empty = arg;
+	if (*is_empty)
+		printf("hits\tcommand\n");
+	*is_empty = false;
+	printf("%4u\t%s\n", hits, path);
+}
+
+/**
+ * 'hash' prints the remembered command paths, 'hash -r' forgets them, and
+ * 'hash name ...' resolves the names again and remembers them.
+ */
+static int
+builtin_hash(struct shell *sh, const struct command *cmd)
+{
+	if (cmd->arg_count == 0) {
+		bool is_empty = true;
+		path_cache_foreach(sh->paths, vars_get(sh->vars, "PATH"),
+				   print_hash_entry, &is_empty);
+		if (is_empty)
+			printf("hash: hash table empty\n");
+		fflush(stdout);
+		return 0;
+	}
+	int res = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *name = cmd->args[i];
+		if (strcmp(name, "-r") == 0) {
+			path_cache_clear(sh->paths);
+			continue;
+		}
+		path_cache_forget(sh->paths, name);
+		if (path_cache_lookup(sh->paths, name,
+				      vars_get(sh->vars, "PATH")) == NULL) {
+			fprintf(stderr, "hash: %s: not found\n", name);
+			res = 1;
+		}
+	}
+	return res;
+}
+
+/**
+ * Length of the name in an assignment like 'NAME=value', or of the whole
+ * @a word if it is just a name. 0 if it is neither.
+ */
+static size_t
+var_name_len(const char *word)
+{
+	if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+		return 0;
+	size_t len = 1;
+	while (isalnum((unsigned char)word[len]) || word[len] == '_')
+		++len;
+	if (word[len] != '=' && word[len] != 0)
+		return 0;
+	return len;
+}
+
+static bool
+is_assignment(const char *word)
+{
+	size_t len = var_name_len(word);
+	return len > 0 && word[len] == '=';
+}
+
+/** Set a variable. An exported one goes to the executed commands. */
+static void
+shell_assign(struct shell *sh, const char *word, bool is_export)
+{
+	size_t len = var_name_len(word);
+	assert(len > 0 && word[len] == '=');
+	char *name = strndup(word, len);
+	vars_set(sh->vars, name, word + len + 1);
+	if (is_export)
+		vars_export(sh->vars, name);
+	free(name);
+}
+
+/**
+ * 'NAME=value ...' sets shell variables. Such prefixes of other commands
+ * are not supported.
+ */
+static int
+builtin_assign(struct shell *sh, const struct command *cmd)
+{
+	shell_assign(sh, cmd->exe, false);
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		if (!is_assignment(cmd->args[i])) {
+			fprintf(stderr, "%s: variables for a command are not "
+				"supported\n", cmd->args[i]);
+			return 1;
+		}
+		shell_assign(sh, cmd->args[i], false);
+	}
+	return 0;
+}
+
+/** 'export NAME[=value] ...' passes the variables to executed commands. */
+static int
+builtin_export(struct shell *sh, const struct command *cmd)
+{
+	int res = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (var_name_len(arg) == 0) {
+			fprintf(stderr, "export: '%s': not a valid identifier\n",
+				arg);
+			res = 1;
+			continue;
+		}
+		if (is_assignment(arg)) {
+			shell_assign(sh, arg, true);
+			continue;
+		}
+		vars_export(sh->vars, arg);
+	}
+	return res;
+}
+
+static int
+builtin_unset(struct shell *sh, const struct command *cmd)
+{
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+		vars_unset(sh->vars, cmd->args[i]);
+	return 0;
+}
+
+static int
+builtin_true(struct shell *sh, const struct command *cmd)
+{
+	(void)sh;
+	(void)cmd;
+	return 0;
+}
+
+static int
+builtin_false(struct shell *sh, const struct command *cmd)
+{
+	(void)sh;
+	(void)cmd;
+	return 1;
+}
+
+static int
+builtin_pwd(struct shell *sh, const struct command *cmd)
+{
+	(void)sh;
+	(void)cmd;
+	char *dir = getcwd(NULL, 0);
+	if (dir == NULL) {
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	printf("%s\n", dir);
+	free(dir);
+	return 0;
+}
+
+/**
+ * Print one backslash escape sequence starting at @a pos, which points right
+ * after the backslash. echo takes octal codes as '\0nnn', printf as '\nnn'.
+ * '\c' sets @a is_stop, meaning that no more output should be produced.
+ * Returns position after the sequence.
+ */
+static const char *
+print_escape(const char *pos, bool is_echo, bool *is_stop)
+{
+	char c = *pos++;
+	switch (c) {
+	case 'a': putchar('\a'); return pos;
+	case 'b': putchar('\b'); return pos;
+	case 'e': putchar('\033'); return pos;
+	case 'f': putchar('\f'); return pos;
+	case 'n': putchar('\n'); return pos;
+	case 'r': putchar('\r'); return pos;
+	case 't': putchar('\t'); return pos;
+	case 'v': putchar('\v'); return pos;
+	case '\\': putchar('\\'); return pos;
+	case 'c':
+		*is_stop = true;
+		return pos;
+	case 'x': {
+		int code = 0;
+		int digits = 0;
+		for (; digits < 2 && isxdigit((unsigned char)*pos); ++digits) {
+			char d = *pos++;
+			code = code * 16 + (isdigit((unsigned char)d) ?
+					    d - '0' : (d | 0x20) - 'a' + 10);
+		}
+		if (digits == 0) {
+			putchar('\\');
+			putchar('x');
+		} else {
+			putchar(code);
+		}
+		return pos;
+	}
+	default:
+		break;
+	}
+	if (c < '0' || c > '7' || (is_echo && c != '0')) {
+		putchar('\\');
+		if (c != 0)
+			putchar(c);
+		else
+			--pos;
+		return pos;
+	}
+	int code = is_echo ? 0 : c - '0';
+	for (int i = is_echo ? 0 : 1; i < 3 && *pos >= '0' && *pos <= '7'; ++i)
+		code = code * 8 + *pos++ - '0';
+	putchar(code);
+	return pos;
+}
+
+/**
+ * Print @a str interpreting backslash escapes. Returns false if '\c' was met
+ * and the output has to stop.
+ */
+static bool
+print_escaped(const char *str, bool is_echo)
+{
+	bool is_stop = false;
+	while (*str != 0 && !is_stop) {
+		if (*str == '\\')
+			str = print_escape(str + 1, is_echo, &is_stop);
+		else
+			putchar(*str++);
+	}
+	return !is_stop;
+}
+
+/** echo [-neE] [arg ...], like the bash builtin. */
+static int
+builtin_echo(struct shell *sh, const struct command *cmd)
+{
+	(void)sh;
+	bool is_newline = true;
+	bool is_escaped = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 ||
+		    strspn(arg + 1, "neE") != strlen(arg + 1))
+			break;
+		for (++arg; *arg != 0; ++arg) {
+			if (*arg == 'n')
+				is_newline = false;
+			else
+				is_escaped = *arg == 'e';
+		}
+	}
+	for (uint32_t first = i; i < cmd->arg_count; ++i) {
+		if (i != first)
+			putchar(' ');
+		if (!is_escaped) {
+			fputs(cmd->args[i], stdout);
+		} else if (!print_escaped(cmd->args[i], true)) {
+			return 0;
+		}
+	}
+	if (is_newline)
+		putchar('\n');
+	return 0;
+}
+
+/**
+ * Print one printf conversion @a spec with a value taken from @a arg. The
+ * spec is complete, like '%-10.3f'. Returns false if the output has to stop.
+ */
+static bool
+printf_conversion(const char *spec, size_t len, const char *arg, int *res)
+{
+	char conv = spec[len - 1];
+	char fmt[64];
+	if (len + 2 >= sizeof(fmt)) {
+		fwrite(spec, 1, len, stdout);
+		return true;
+	}
+	memcpy(fmt, spec, len - 1);
+	char *end = NULL;
+	errno = 0;
+	switch (conv) {
+	case 'd':
+	case 'i': {
+		long long v = strtoll(arg, &end, 0);
+		memcpy(fmt + len - 1, "ll", 2);
+		fmt[len + 1] = conv;
+		fmt[len + 2] = 0;
+		printf(fmt, v);
+		break;
+	}
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X': {
+		unsigned long long v = strtoull(arg, &end, 0);
+		memcpy(fmt + len - 1, "ll", 2);
+		fmt[len + 1] = conv;
+		fmt[len + 2] = 0;
+		printf(fmt, v);
+		break;
+	}
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A': {
+		double v = strtod(arg, &end);
+		memcpy(fmt, spec, len);
+		fmt[len] = 0;
+		printf(fmt, v);
+		break;
+	}
+	case 'c':
+		memcpy(fmt, spec, len);
+		fmt[len] = 0;
+		if (*arg != 0)
+			printf(fmt, *arg);
+		return true;
+	case 's':
+		memcpy(fmt, spec, len);
+		fmt[len] = 0;
+		printf(fmt, arg);
+		return true;
+	case 'b':
+		return print_escaped(arg, true);
+	default:
+		fprintf(stderr, "printf: %c: invalid format character\n", conv);
+		*res = 1;
+		return false;
+	}
+	if (*arg != 0 && (*end != 0 || errno != 0)) {
+		fprintf(stderr, "printf: %s: invalid number\n", arg);
+		*res = 1;
+	}
+	return true;
+}
+
+/**
+ * printf format [arg ...], like the bash builtin. The format is reused while
+ * there are arguments left.
+ */
+static int
+builtin_printf(struct shell *sh, const struct command *cmd)
+{
+	(void)sh;
+	if (cmd->arg_count == 0) {
+		fprintf(stderr, "printf: usage: printf format [arguments]\n");
+		return 2;
+	}
+	const char *format = cmd->args[0];
+	uint32_t next_arg = 1;
+	int res = 0;
+	do {
+		uint32_t first_arg = next_arg;
+		const char *pos = format;
+		while (*pos != 0) {
+			if (*pos == '\\') {
+				bool is_stop = false;
+				pos = print_escape(pos + 1, false, &is_stop);
+				if (is_stop)
+					return res;
+				continue;
+			}
+			if (*pos != '%') {
+				putchar(*pos++);
+				continue;
+			}
+			if (pos[1] == '%') {
+				putchar('%');
+				pos += 2;
+				continue;
+			}
+			size_t len = 1 + strspn(pos + 1, "-+ #0");
+			len += strspn(pos + len, "0123456789");
+			if (pos[len] == '.')
+				len += 1 + strspn(pos + len + 1, "0123456789");
+			if (pos[len] == 0) {
+				fputs(pos, stdout);
+				break;
+			}
+			++len;
+			const char *arg = "";
+			if (next_arg < cmd->arg_count)
+				arg = cmd->args[next_arg++];
+			if (!printf_conversion(pos, len, arg, &res))
+				return res;
+			pos += len;
+		}
+		if (next_arg == first_arg)
+			break;
+	} while (next_arg < cmd->arg_count);
+	return res;
+}
+
+typedef int (*builtin_f)(struct shell *sh, const struct command *cmd);
+
+/** A command executed by the terminal itself, without exec. */
+struct builtin {
+	const char *name;
+	builtin_f func;
+	/**
+	 * The builtin changes the terminal itself, so it must be executed in
+	 * the terminal process and can't overlap with other command lines.
+	 */
+	bool is_shell_state;
+};
+
+static const struct builtin builtins[] = {
+	{"cd", builtin_cd, true},
+	{"exit", builtin_exit, true},
+	{"export", builtin_export, true},
+	{"hash", builtin_hash, true},
+	{"jobs", builtin_jobs, true},
+	{"unset", builtin_unset, true},
+	{"wait", builtin_wait, true},
+	{"echo", builtin_echo, false},
+	{"false", builtin_false, false},
+	{"printf", builtin_printf, false},
+	{"pwd", builtin_pwd, false},
+	{"true", builtin_true, false},
+};
+
+static const struct builtin assign_builtin = {
+	"NAME=value", builtin_assign, true,
+};
+
+static const struct builtin *
+find_builtin(const char *name)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+		if (strcmp(builtins[i].name, name) == 0)
+			return &builtins[i];
+	}
+	if (is_assignment(name))
+		return &assign_builtin;
+	return NULL;
+}
+
+/**
+ * Prepare a freshly forked child to work on its own: it must not touch the
+ * parent's jobs and must see signals the usual way.
+ */
+static void
+shell_enter_child(struct shell *sh)
+{
+	while (sh->tasks != NULL)
+		shell_delete_first_task(sh);
+	sh->max_tasks = 1;
+	while (sh->jobs != NULL)
+		shell_delete_job(sh, sh->jobs);
+	if (sh->sigchld_fd >= 0) {
+		close(sh->sigchld_fd);
+		sh->sigchld_fd = -1;
+	}
+	sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL);
+	if (sh->is_server)
+		signal(SIGPIPE, SIG_DFL);
+}
+
+/**
+ * Write the whole @a data, retrying on interrupts and partial writes.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+static int
+write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static int
+open_output(enum output_type type, const char *path)
+{
+	int flags = O_WRONLY | O_CREAT;
+	if (type == OUTPUT_TYPE_FILE_NEW)
+		flags |= O_TRUNC;
+	else
+		flags |= O_APPEND;
+	return open(path, flags, 0644);
+}
+
+/**
+ * Execute a builtin in the terminal process. The output redirection is done
+ * by temporarily replacing stdout descriptor of the terminal.
+ */
+static int
+execute_builtin_in_shell(struct shell *sh, const struct builtin *b,
+			 const struct command *cmd, enum output_type out_type,
+			 const char *out_file, struct exec_stats *stats)
+{
+	struct rusage ru_before;
+	getrusage(RUSAGE_SELF, &ru_before);
+	int saved_fd = -1;
+	if (out_file != NULL) {
+		int fd = open_output(out_type, out_file);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s\n", out_file, strerror(errno));
+			return 1;
+		}
+		fflush(stdout);
+		saved_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+	int exit_code = b->func(sh, cmd);
+	fflush(stdout);
+	clearerr(stdout);
+	if (saved_fd >= 0) {
+		dup2(saved_fd, STDOUT_FILENO);
+		close(saved_fd);
+	}
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	stats->user += timeval_to_sec(&ru.ru_utime) -
+		       timeval_to_sec(&ru_before.ru_utime);
+	stats->sys += timeval_to_sec(&ru.ru_stime) -
+		      timeval_to_sec(&ru_before.ru_stime);
+	stats->maxrss = ru.ru_maxrss;
+	stats->nvcsw += ru.ru_nvcsw - ru_before.ru_nvcsw;
+	stats->nivcsw += ru.ru_nivcsw - ru_before.ru_nivcsw;
+	return exit_code;
+}
+
+/**
+ * Execute the command in a forked child. @a path is the resolved executable,
+ * NULL if it wasn't found in $PATH.
+ */
+static void __attribute__((noreturn))
+execute_command_in_child(struct shell *sh, const struct command *cmd,
+			 const char *path)
+{
+	const struct builtin *b = find_builtin(cmd->exe);
+	if (b != NULL) {
+		int exit_code = b->func(sh, cmd);
+		fflush(stdout);
+		_exit(exit_code);
+	}
+	if (path == NULL) {
+		fprintf(stderr, "%s: command not found\n", cmd->exe);
+		_exit(127);
+	}
+	char **argv = malloc(sizeof(*argv) * (cmd->arg_count + 2));
+	argv[0] = cmd->exe;
+	memcpy(argv + 1, cmd->args, sizeof(*argv) * cmd->arg_count);
+	argv[cmd->arg_count + 1] = NULL;
+	char **envp = vars_environ(sh->vars);
+	execve(path, argv, envp);
+	/*
+	 * The cached path might be stale, or the file is a script without
+	 * shebang. Let execvp() sort it out, it takes the environment and
+	 * $PATH from environ.
+	 */
+	environ = envp;
+	execvp(cmd->exe, argv);
+	fprintf(stderr, "%s: %s\n", cmd->exe, strerror(errno));
+	free(envp);
+	free(argv);
+	_exit(errno == ENOENT ? 127 : 126);
+}
+
+/**
+ * Open the file of a 'cat FILE' command, if it can be done without running
+ * cat: no options and a single not empty regular file. Empty ones are left
+ * to cat, because files in /proc look empty but aren't.
+ *
+ * @retval >= 0 Descriptor of the file, its stat is in @a st.
+ * @retval -1 The command is something else.
+ */
+static int
+cat_open_file(const struct command *cmd, struct stat *st)
+{
+	if (strcmp(cmd->exe, "cat") != 0 || cmd->arg_count != 1 ||
+	    cmd->args[0][0] == '-')
+		return -1;
+	/*
+	 * Opening a FIFO would block the terminal itself, so the type is
+	 * checked before. O_NONBLOCK covers the file being replaced in
+	 * between, it means nothing for regular files.
+	 */
+	if (stat(cmd->args[0], st) != 0 || !S_ISREG(st->st_mode) ||
+	    st->st_size == 0)
+		return -1;
+	int fd = open(cmd->args[0], O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode) || st->st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+enum copy_method {
+	COPY_METHOD_SPLICE,
+	COPY_METHOD_COPY_FILE_RANGE,
+	COPY_METHOD_SENDFILE,
+	COPY_METHOD_READ_WRITE,
+};
+
+/**
+ * Copy up to @a size bytes from the current offset of @a in_fd to @a out_fd.
+ * The data is moved inside the kernel when the descriptors allow that:
+ * spliced into pipes, copied by copy_file_range() between regular files,
+ * sent by sendfile() elsewhere. With @a is_nonblock a full pipe stops the
+ * copying instead of waiting.
+ *
+ * @return Number of copied bytes, or -1 on an error.
+ */
+static ssize_t
+copy_fd(int in_fd, int out_fd, size_t size, bool is_nonblock)
+{
+	struct stat st;
+	enum copy_method method = COPY_METHOD_SENDFILE;
+	if (fstat(out_fd, &st) == 0) {
+		if (S_ISFIFO(st.st_mode))
+			method = COPY_METHOD_SPLICE;
+		else if (S_ISREG(st.st_mode))
+			method = COPY_METHOD_COPY_FILE_RANGE;
+	}
+	char *buf = NULL;
+	const size_t buf_size = 64 * 1024;
+	size_t done = 0;
+	while (done < size) {
+		size_t len = size - done;
+		if (len > (1 << 30))
+			len = 1 << 30;
+		ssize_t rc;
+		switch (method) {
+		case COPY_METHOD_SPLICE:
+			rc = splice(in_fd, NULL, out_fd, NULL, len,
+				    SPLICE_F_MOVE | (is_nonblock ?
+				    SPLICE_F_NONBLOCK : 0));
+			break;
+		case COPY_METHOD_COPY_FILE_RANGE:
+			rc = copy_file_range(in_fd, NULL, out_fd, NULL, len, 0);
+			break;
+		case COPY_METHOD_SENDFILE:
+			rc = sendfile(out_fd, in_fd, NULL, len);
+			break;
+		default:
+			if (buf == NULL)
+				buf = malloc(buf_size);
+			rc = read(in_fd, buf, len < buf_size ? len : buf_size);
+			if (rc > 0 && write_all(out_fd, buf, rc) != 0)
+				rc = -1;
+			break;
+		}
+		if (rc > 0) {
+			done += rc;
+			continue;
+		}
+		if (rc == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN && is_nonblock)
+			break;
+		/*
+		 * Not supported for these descriptors, like O_APPEND files for
+		 * copy_file_range() or terminals for sendfile(). Nothing is
+		 * copied then, so can switch to the next method.
+		 */
+		if (method != COPY_METHOD_READ_WRITE &&
+		    (errno == EINVAL || errno == EXDEV || errno == EBADF ||
+		     errno == ENOSYS || errno == EOPNOTSUPP)) {
+			method = method == COPY_METHOD_COPY_FILE_RANGE ?
+				 COPY_METHOD_SENDFILE : COPY_METHOD_READ_WRITE;
+			continue;
+		}
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return done;
+}
+
+/**
+ * Execute 'cat FILE' in the terminal process, moving the data right to the
+ * output file or stdout.
+ */
+static int
+execute_cat_in_shell(int file_fd, const struct stat *st,
+		     enum output_type out_type, const char *out_file)
+{
+	int out_fd = STDOUT_FILENO;
+	if (out_file != NULL) {
+		out_fd = open_output(out_type, out_file);
+		if (out_fd < 0) {
+			fprintf(stderr, "%s: %s\n", out_file, strerror(errno));
+			close(file_fd);
+			return 1;
+		}
 	} else {
-		assert(false);
+		fflush(stdout);
+	}
+	int exit_code = 0;
+	if (copy_fd(file_fd, out_fd, st->st_size, false) < 0) {
+		fprintf(stderr, "cat: write error: %s\n", strerror(errno));
+		exit_code = 1;
+	}
+	if (out_fd != STDOUT_FILENO)
+		close(out_fd);
+	close(file_fd);
+	return exit_code;
+}
+
+/**
+ * Make a pipe filled with the content of @a file_fd, to replace a leading
+ * 'cat FILE |' stage. The pipe is grown to fit the file when possible, then
+ * the file is spliced into it right here. Only if it doesn't fit a helper
+ * process is forked to splice the rest, still without executing cat.
+ *
+ * @retval >= 0 Read end of the pipe. The helper pid is in @a helper_pid,
+ *         -1 if it wasn't needed.
+ * @retval -1 Error, the stage should be executed as usual.
+ */
+static int
+pipe_from_file(struct shell *sh, int file_fd, const struct stat *st,
+	       pid_t *helper_pid)
+{
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+		return -1;
+	*helper_pid = -1;
+	size_t size = st->st_size;
+	int pipe_size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+	if (pipe_size > 0 && (size_t)pipe_size < size) {
+		/* Fails when above the limits, the default size is fine. */
+		int new_size = size < PIPE_FILE_MAX_SIZE ? size :
+			       PIPE_FILE_MAX_SIZE;
+		fcntl(pipe_fds[1], F_SETPIPE_SZ, new_size);
+	}
+	ssize_t done = copy_fd(file_fd, pipe_fds[1], size, true);
+	if (done < 0)
+		done = 0;
+	if ((size_t)done < size) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			shell_enter_child(sh);
+			close(pipe_fds[0]);
+			int exit_code = 0;
+			if (copy_fd(file_fd, pipe_fds[1], size - done, false) < 0)
+				exit_code = 1;
+			_exit(exit_code);
+		}
+		if (pid < 0) {
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+			return -1;
+		}
+		*helper_pid = pid;
+	}
+	close(pipe_fds[1]);
+	return pipe_fds[0];
+}
+
+/**
+ * Execute a pipeline of commands starting with @a begin and ending right
+ * before @a end. The first command is @a first instead of the one in
+ * @a begin, so as prefixes like 'time' could be stripped. The output of the
+ * last command goes to @a out_file if it is not NULL. Consumed resources are
+ * added to @a stats.
+ */
+static int
+execute_pipeline(struct shell *sh, const struct command *first,
+		 const struct expr *begin, const struct expr *end,
+		 enum output_type out_type, const char *out_file,
+		 struct exec_stats *stats)
+{
+	assert(begin != end && begin->type == EXPR_TYPE_COMMAND);
+	/* Builtins alone in a pipeline don't need a new process. */
+	if (begin->next == end) {
+		const struct builtin *b = find_builtin(first->exe);
+		if (b != NULL) {
+			return execute_builtin_in_shell(sh, b, first, out_type,
+							out_file, stats);
+		}
+	}
+	int cmd_count = 0;
+	for (const struct expr *e = begin; e != end; e = e->next)
+		cmd_count += e->type == EXPR_TYPE_COMMAND;
+	pid_t *pids = malloc(sizeof(*pids) * cmd_count);
+	int pid_count = 0;
+	int in_fd = -1;
+	/* Neither 'cat FILE' nor 'cat FILE | ...' need to execute cat. */
+	struct stat st;
+	int file_fd = sh->is_zero_copy ? cat_open_file(first, &st) : -1;
+	if (file_fd >= 0 && begin->next == end) {
+		free(pids);
+		return execute_cat_in_shell(file_fd, &st, out_type, out_file);
+	}
+	if (file_fd >= 0) {
+		pid_t helper_pid;
+		in_fd = pipe_from_file(sh, file_fd, &st, &helper_pid);
+		close(file_fd);
+		if (in_fd >= 0) {
+			if (helper_pid > 0)
+				pids[pid_count++] = helper_pid;
+			assert(begin->next->type == EXPR_TYPE_PIPE);
+			begin = begin->next->next;
+			first = &begin->cmd;
+		}
+	}
+	pid_t last_pid = -1;
+	fflush(stdout);
+	for (const struct expr *e = begin; e != end; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		const struct command *cmd = e == begin ? first : &e->cmd;
+		bool is_last = e->next == end;
+		const char *path = NULL;
+		if (find_builtin(cmd->exe) == NULL)
+			path = path_cache_lookup(sh->paths, cmd->exe,
+						 vars_get(sh->vars, "PATH"));
+		int pipe_fds[2] = {-1, -1};
+		if (!is_last && pipe(pipe_fds) != 0) {
+			fprintf(stderr, "pipe: %s\n", strerror(errno));
+			break;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			shell_enter_child(sh);
+			if (in_fd >= 0) {
+				dup2(in_fd, STDIN_FILENO);
+				close(in_fd);
+			}
+			if (!is_last) {
+				dup2(pipe_fds[1], STDOUT_FILENO);
+				close(pipe_fds[0]);
+				close(pipe_fds[1]);
+			} else if (out_file != NULL) {
+				int fd = open_output(out_type, out_file);
+				if (fd < 0) {
+					fprintf(stderr, "%s: %s\n", out_file,
+						strerror(errno));
+					_exit(1);
+				}
+				dup2(fd, STDOUT_FILENO);
+				close(fd);
+			}
+			execute_command_in_child(sh, cmd, path);
+		}
+		if (in_fd >= 0)
+			close(in_fd);
+		in_fd = pipe_fds[0];
+		if (pipe_fds[1] >= 0)
+			close(pipe_fds[1]);
+		if (pid < 0) {
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+			break;
+		}
+		pids[pid_count++] = pid;
+		if (is_last)
+			last_pid = pid;
 	}
-    int is_first = 1;
-    int global_exit_code = 0;
+	if (in_fd >= 0)
+		close(in_fd);
+	int exit_code = 1;
+	for (int i = 0; i < pid_count; ++i) {
+		int status;
+		struct rusage ru;
+		pid_t rc;
+		do {
+			rc = wait4(pids[i], &status, 0, &ru);
+		} while (rc < 0 && errno == EINTR);
+		if (rc < 0) {
+			fprintf(stderr, "wait: %s\n", strerror(errno));
+			continue;
+		}
+		exec_stats_add(stats, &ru);
+		if (pids[i] == last_pid)
+			exit_code = status_to_exit_code(status);
+	}
+	free(pids);
+	return exit_code;
+}
+
+static void
+print_time(const char *name, double sec)
+{
+	fprintf(stderr, "%s\t%dm%.3fs\n", name, (int)(sec / 60),
+		sec - (int)(sec / 60) * 60);
+}
+
+static void
+shell_trace(struct shell *sh, const struct expr *begin, const struct expr *end,
+	    int exit_code, const struct exec_stats *stats)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	char *title = NULL;
+	size_t size = 0;
+	title_append_exprs(&title, &size, begin, end);
+	char *line = NULL;
+	int len = asprintf(&line, "%lld.%03ld pid=%d code=%d real=%.6f "
+			   "user=%.6f sys=%.6f maxrss=%ldK vcsw=%ld ivcsw=%ld "
+			   "cmd=%s\n", (long long)now.tv_sec,
+			   now.tv_nsec / 1000000, (int)getpid(), exit_code,
+			   stats->real, stats->user, stats->sys, stats->maxrss,
+			   stats->nvcsw, stats->nivcsw, title);
+	/* One write per line, so as concurrent subshells don't mix lines. */
+	if (len > 0 && write(sh->trace_fd, line, len) < 0)
+		fprintf(stderr, "SHELL_TRACE: %s\n", strerror(errno));
+	free(line);
+	free(title);
+}
+
+/**
+ * Execute a pipeline and account its resources. A pipeline prefixed with
+ * 'time' prints them to stderr, and with $SHELL_TRACE they are logged.
+ */
+static int
+execute_measured_pipeline(struct shell *sh, const struct expr *begin,
+			  const struct expr *end, enum output_type out_type,
+			  const char *out_file)
+{
+	struct exec_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	const struct command *first = &begin->cmd;
+	struct command timed;
+	bool is_timed = strcmp(first->exe, "time") == 0;
+	int exit_code = 0;
+	if (is_timed && first->arg_count > 0) {
+		timed.exe = first->args[0];
+		timed.args = first->args + 1;
+		timed.arg_count = first->arg_count - 1;
+		timed.arg_capacity = timed.arg_count;
+		first = &timed;
+	}
+	if (!is_timed || first == &timed) {
+		exit_code = execute_pipeline(sh, first, begin, end, out_type,
+					     out_file, &stats);
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats.real = (now.tv_sec - stats.start.tv_sec) +
+		     (now.tv_nsec - stats.start.tv_nsec) / 1000000000.0;
+	if (is_timed) {
+		fflush(stdout);
+		fprintf(stderr, "\n");
+		print_time("real", stats.real);
+		print_time("user", stats.user);
+		print_time("sys", stats.sys);
+		fprintf(stderr, "maxrss\t%ldK\n", stats.maxrss);
+		fprintf(stderr, "csw\t%ld voluntary, %ld involuntary\n",
+			stats.nvcsw, stats.nivcsw);
+	}
+	if (sh->trace_fd >= 0)
+		shell_trace(sh, begin, end, exit_code, &stats);
+	return exit_code;
+}
+
+/**
+ * Expand the commands of a pipeline right before it is executed. Returns
+ * false if any of them is expanded to nothing.
+ */
+static bool
+shell_expand_pipeline(struct shell *sh, struct expr *begin,
+		      const struct expr *end)
+{
+	bool res = true;
+	for (struct expr *e = begin; e != end; e = e->next) {
+		if (e->type == EXPR_TYPE_COMMAND &&
+		    !command_expand(&e->cmd, &sh->expander))
+			res = false;
+	}
+	return res;
+}
+
+/**
+ * Execute pipelines joined with && and || one by one. The output redirection
+ * belongs to the last pipeline only, like in bash. Each pipeline is expanded
+ * only when it is executed, and sees $? of the previous one. A pipeline
+ * expanded to nothing is skipped and keeps $?.
+ */
+static int
+execute_sequence(struct shell *sh, struct command_line *line)
+{
+	int exit_code = sh->exit_code;
+	bool skip = false;
+	struct expr *e = line->head;
+	while (e != NULL && !sh->is_exit_called) {
+		struct expr *end = e;
+		while (end != NULL && end->type != EXPR_TYPE_AND &&
+		       end->type != EXPR_TYPE_OR)
+			end = end->next;
+		if (!skip) {
+			if (!shell_expand_pipeline(sh, e, end)) {
+				exit_code = sh->exit_code;
+			} else if (end != NULL) {
+				exit_code = execute_measured_pipeline(
+					sh, e, end, OUTPUT_TYPE_STDOUT, NULL);
+			} else if (!command_line_expand_out_file(
+					line, &sh->expander)) {
+				fprintf(stderr, "%s: ambiguous redirect\n",
+					line->out_file);
+				exit_code = 1;
+			} else {
+				exit_code = execute_measured_pipeline(
+					sh, e, end, line->out_type,
+					line->out_file);
+			}
+			sh->exit_code = exit_code;
+		}
+		if (end == NULL)
+			break;
+		if (end->type == EXPR_TYPE_AND)
+			skip = exit_code != 0;
+		else
+			skip = exit_code == 0;
+		e = end->next;
+	}
+	return exit_code;
+}
+
+/**
+ * A background command line is executed by a subshell so as its && and ||
+ * still work sequentially. The terminal doesn't wait for it.
+ */
+static int
+execute_in_background(struct shell *sh, struct command_line *line)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		return 1;
+	}
+	if (pid == 0) {
+		shell_enter_child(sh);
+		int exit_code = execute_sequence(sh, line);
+		fflush(stdout);
+		_exit(exit_code);
+	}
+	shell_add_job(sh, pid, command_line_title(line));
+	return 0;
+}
+
+static int
+execute_command_line(struct shell *sh, struct command_line *line)
+{
+	assert(line != NULL);
+	shell_reap_children(sh);
+	if (line->is_background)
+		return execute_in_background(sh, line);
+	return execute_sequence(sh, line);
+}
+
+/**
+ * A command line can run concurrently with its neighbours unless it changes
+ * the terminal itself, i.e. has a builtin executed in the shell process.
+ */
+static bool
+command_line_is_independent(const struct command_line *line)
+{
 	const struct expr *e = line->head;
-    int next_expr_pipe = 0;
-    int next_pipe_descriptors[2];
-    int pre_expr_pipe = 0;
-    int pre_pipe_descriptors[2];
 	while (e != NULL) {
-        if (is_first == 1 && strcmp(e->cmd.exe, "exit") == 0 && e->next == NULL) {
-            if (e->cmd.arg_count >= 1) {
-                int exit_code;
-                sscanf(e->cmd.args[0], "%d", &exit_code);
-                *exit_called = 1;
-                return exit_code;
-            } else {
-                *exit_called = 1;
-                return 0;
-            }
-        }
-
-		if (e->type == EXPR_TYPE_COMMAND) {
-            if (e->next != NULL && e->next->type == EXPR_TYPE_PIPE) {
-                next_expr_pipe = 1;
-                if (pipe(next_pipe_descriptors) == -1) {
-                    printf("Error while created pipe\n");
-                    return 1;
-                }
-            }
-            if (strcmp(e->cmd.exe, "cd") == 0) {
-                if (e->cmd.arg_count == 0) {
-                    printf("Have to provide directory.\n");
-                } else {
-                    chdir(e->cmd.args[0]);
-                }
-            } else {
-                int pid = fork();
-                if (pid == -1) {
-                    printf("Error while create fork\n");
-                    return 1;
-                }
-                if (pid == 0) {
-                    // Child process
-                    if (file_out_descriptor != NULL && e->next == NULL) {
-                        dup2(fileno(file_out_descriptor), STDOUT_FILENO);
-                        fclose(file_out_descriptor);
-                    }
-                    if (pre_expr_pipe == 1) {
-                        dup2(pre_pipe_descriptors[0], STDIN_FILENO);
-                        close(pre_pipe_descriptors[0]);
-                        close(pre_pipe_descriptors[1]);
-                    }
-                    if (next_expr_pipe == 1) {
-                        dup2(next_pipe_descriptors[1], STDOUT_FILENO);
-                        close(next_pipe_descriptors[0]);
-                        close(next_pipe_descriptors[1]);
-                    }
-                    char** exec_args = (char**)malloc(sizeof(char*) * (e->cmd.arg_count + 2));
-                    exec_args[0] = e->cmd.exe;
-                    for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
-                        exec_args[i + 1] = e->cmd.args[i];
-                    }
-                    exec_args[e->cmd.arg_count + 1] = NULL;
-
-                    if (strcmp(e->cmd.exe, "exit") == 0) {
-                        if (e->cmd.arg_count >= 1) {
-                            int exit_code;
-                            sscanf(e->cmd.args[0], "%d", &exit_code);
-                            free(exec_args);
-                            *exit_called = 1;
-                            return exit_code;
-                        } else {
-                            free(exec_args);
-                            *exit_called = 1;
-                            return 0;
-                        }
-                    }
-                    int exec_res = execvp(e->cmd.exe, exec_args);
-                    if (exec_res < 0) {
-                        printf("Error with code %d while execv %s in child fork %d\n", exec_res, e->cmd.exe, getpid());
-                    }
-                    free(exec_args);
-                    return 1;
-                } else {
-                    // Parent process
-                    if (pre_expr_pipe == 1) {
-                        close(pre_pipe_descriptors[0]);
-                        close(pre_pipe_descriptors[1]);
-                    }
-                    if (next_expr_pipe == 1) {
-                        pre_expr_pipe = 1;
-                        next_expr_pipe = 0;
-                        pre_pipe_descriptors[0] = next_pipe_descriptors[0];
-                        pre_pipe_descriptors[1] = next_pipe_descriptors[1];
-                    }
-
-                    if (strcmp(e->cmd.exe, "yes") != 0 && strcmp(e->cmd.exe, "head") != 0) {
-                        waitpid(pid, &global_exit_code, 0);
-                    }
-
-                    if (e->next == NULL) {
-                        fclose(file_out_descriptor);
-                    }
-                }
-            }
-		} else if (e->type == EXPR_TYPE_PIPE) {
-            // We have already created pipe, so just skip
-		} else if (e->type == EXPR_TYPE_AND) {
-			printf("\tAND\n");
-		} else if (e->type == EXPR_TYPE_OR) {
-			printf("\tOR\n");
-		} else {
-			assert(false);
+		bool is_alone = e->next == NULL || e->next->type != EXPR_TYPE_PIPE;
+		/* The 'time' prefix is stripped when executed. */
+		const char *exe = e->cmd.exe;
+		if (strcmp(exe, "time") == 0 && e->cmd.arg_count > 0)
+			exe = e->cmd.args[0];
+		const struct builtin *b = find_builtin(exe);
+		if (is_alone && b != NULL && b->is_shell_state)
+			return false;
+		/* The command isn't known until it is expanded. */
+		if (is_alone && e->cmd.source != NULL &&
+		    strchr(exe, '$') != NULL)
+			return false;
+		while (e != NULL && e->type != EXPR_TYPE_AND &&
+		       e->type != EXPR_TYPE_OR)
+			e = e->next;
+		if (e != NULL)
+			e = e->next;
+	}
+	return true;
+}
+
+/**
+ * Print the output of the first tasks and remove the finished ones. A task's
+ * output is printed only when all the tasks before it are done.
+ */
+static void
+shell_flush_tasks(struct shell *sh)
+{
+	fflush(stdout);
+	while (sh->tasks != NULL) {
+		struct line_task *t = sh->tasks;
+		write_all(STDOUT_FILENO, t->buf, t->size);
+		t->size = 0;
+		if (t->out_fd >= 0 || !t->is_finished)
+			return;
+		sh->exit_code = t->exit_code;
+		shell_delete_first_task(sh);
+	}
+}
+
+static void
+task_read_output(struct shell *sh, struct line_task *t)
+{
+	if (t->capacity - t->size < 4096) {
+		sh->task_output_size -= t->capacity;
+		t->capacity = t->capacity * 2 + 4096;
+		t->buf = realloc(t->buf, t->capacity);
+		sh->task_output_size += t->capacity;
+	}
+	ssize_t rc = read(t->out_fd, t->buf + t->size, t->capacity - t->size);
+	if (rc < 0 && errno == EINTR)
+		return;
+	if (rc <= 0) {
+		close(t->out_fd);
+		t->out_fd = -1;
+		return;
+	}
+	t->size += rc;
+}
+
+/**
+ * Wait for output of the parallel tasks, for SIGCHLD, and for @a in_fd to
+ * become readable if it is not negative. Collect whatever has happened.
+ * Returns true if @a in_fd is readable.
+ */
+static bool
+shell_poll(struct shell *sh, int in_fd, int timeout)
+{
+	struct pollfd *fds = malloc(sizeof(*fds) * (sh->task_count + 2));
+	int count = 0;
+	for (struct line_task *t = sh->tasks; t != NULL; t = t->next) {
+		if (t->out_fd < 0)
+			continue;
+		fds[count].fd = t->out_fd;
+		fds[count].events = POLLIN;
+		++count;
+	}
+	fds[count].fd = sh->sigchld_fd;
+	fds[count].events = POLLIN;
+	fds[count + 1].fd = in_fd;
+	fds[count + 1].events = POLLIN;
+	fds[count + 1].revents = 0;
+	if (poll(fds, count + 2, timeout) > 0) {
+		int i = 0;
+		for (struct line_task *t = sh->tasks; t != NULL; t = t->next) {
+			if (t->out_fd < 0)
+				continue;
+			assert(fds[i].fd == t->out_fd);
+			if (fds[i++].revents != 0)
+				task_read_output(sh, t);
 		}
-		e = e->next;
-        is_first = 0;
 	}
-    return global_exit_code / 256;
+	bool is_ready = fds[count + 1].revents != 0;
+	free(fds);
+	shell_reap_children(sh);
+	shell_flush_tasks(sh);
+	return is_ready;
 }
 
-int
-main(void)
+/**
+ * Collect output and exit codes of the parallel tasks. With @a is_blocking
+ * the call waits until at least something happens.
+ */
+static void
+shell_update_tasks(struct shell *sh, bool is_blocking)
+{
+	int timeout = 0;
+	if (is_blocking)
+		timeout = sh->sigchld_fd >= 0 ? -1 : 10;
+	shell_poll(sh, -1, timeout);
+}
+
+static void
+shell_drain_tasks(struct shell *sh)
+{
+	while (sh->tasks != NULL)
+		shell_update_tasks(sh, true);
+}
+
+/**
+ * Start a command line in a subshell with stdout redirected into a pipe
+ * read by the terminal. Blocks while too many tasks are running already.
+ * The finished ones waiting to be printed don't count, unless their output
+ * takes too much memory.
+ */
+static void
+shell_start_task(struct shell *sh, struct command_line *line)
+{
+	while (sh->running_task_count >= sh->max_tasks ||
+	       sh->task_output_size > TASK_OUTPUT_MAX_SIZE)
+		shell_update_tasks(sh, true);
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		sh->exit_code = 1;
+		return;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		sh->exit_code = 1;
+		return;
+	}
+	if (pid == 0) {
+		shell_enter_child(sh);
+		close(pipe_fds[0]);
+		dup2(pipe_fds[1], STDOUT_FILENO);
+		close(pipe_fds[1]);
+		int exit_code = execute_sequence(sh, line);
+		fflush(stdout);
+		_exit(exit_code);
+	}
+	close(pipe_fds[1]);
+	struct line_task *t = calloc(1, sizeof(*t));
+	t->pid = pid;
+	t->out_fd = pipe_fds[0];
+	if (sh->last_task == NULL)
+		sh->tasks = t;
+	else
+		sh->last_task->next = t;
+	sh->last_task = t;
+	++sh->task_count;
+	++sh->running_task_count;
+	shell_update_tasks(sh, false);
+}
+
+/**
+ * Execute a command line either right away or, in parallel mode, as a task
+ * overlapping with the neighbour lines. Lines changing the terminal itself
+ * wait for all the previous tasks first.
+ */
+static void
+shell_run_line(struct shell *sh, struct command_line *line)
+{
+	if (sh->max_tasks > 1 && !line->is_background) {
+		if (command_line_is_independent(line)) {
+			shell_start_task(sh, line);
+			return;
+		}
+		shell_drain_tasks(sh);
+	}
+	sh->exit_code = execute_command_line(sh, line);
+}
+
+/** Execute all the complete lines the parser has. */
+static void
+shell_run_parsed(struct shell *sh, struct parser *p)
+{
+	struct command_line *line = NULL;
+	while (!sh->is_exit_called) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (err != PARSER_ERR_NONE) {
+			printf("Error: %d\n", (int)err);
+			continue;
+		}
+		shell_run_line(sh, line);
+		command_line_delete(line);
+	}
+}
+
+static const char *
+shell_get_var(const char *name, void *ctx)
+{
+	struct shell *sh = ctx;
+	if (strcmp(name, "?") == 0) {
+		snprintf(sh->exit_code_str, sizeof(sh->exit_code_str), "%d",
+			 sh->exit_code);
+		return sh->exit_code_str;
+	}
+	return vars_get(sh->vars, name);
+}
+
+/** A parser finding expansions of variables and commands. */
+static struct parser *
+shell_parser_new(void)
 {
-	const size_t buf_size = 1024;
-	char buf[buf_size];
-	int rc;
-    int global_exit_code = 0;
-    int exit_called = 0;
 	struct parser *p = parser_new();
-	while (exit_called == 0 && (rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
+	parser_enable_expansions(p);
+	return p;
+}
+
+/**
+ * Execute $(script) in a forked copy of the shell, without exec, and
+ * collect its stdout from a pipe.
+ */
+static void
+shell_substitute(const char *script, char **out, size_t *out_size, void *ctx)
+{
+	struct shell *sh = ctx;
+	*out = NULL;
+	*out_size = 0;
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		return;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return;
+	}
+	if (pid == 0) {
+		shell_enter_child(sh);
+		close(pipe_fds[0]);
+		dup2(pipe_fds[1], STDOUT_FILENO);
+		close(pipe_fds[1]);
+		struct parser *p = shell_parser_new();
+		parser_feed(p, script, strlen(script));
+		parser_feed(p, "\n", 1);
+		shell_run_parsed(sh, p);
+		fflush(stdout);
+		_exit(sh->exit_code);
+	}
+	close(pipe_fds[1]);
+	size_t capacity = 0;
+	while (true) {
+		if (capacity - *out_size < 4096) {
+			capacity = capacity * 2 + 4096;
+			*out = realloc(*out, capacity);
+		}
+		ssize_t rc = read(pipe_fds[0], *out + *out_size,
+				  capacity - *out_size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		*out_size += rc;
+	}
+	close(pipe_fds[0]);
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return;
+	}
+	sh->exit_code = status_to_exit_code(status);
+}
+
+/**
+ * Execute commands from a regular file. It is mapped into memory and parsed
+ * right from the mapping, without copying into the parser.
+ *
+ * @retval 0 Success.
+ * @retval -1 The file can't be mapped, should be read instead.
+ */
+static int
+shell_run_mapped(struct shell *sh, struct parser *p, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;
+	/* Stdin might be already read partially. */
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset > st.st_size)
+		return -1;
+	size_t size = st.st_size - offset;
+	if (size == 0)
+		return 0;
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	/* The children must not read the script as their input. */
+	lseek(fd, 0, SEEK_END);
+	parser_attach(p, data + offset, size);
+	shell_run_parsed(sh, p);
+	/*
+	 * The last line might be not terminated. The feed copies it from the
+	 * mapping, so it can be unmapped after.
+	 */
+	if (!sh->is_exit_called) {
+		parser_feed(p, "\n", 1);
+		shell_run_parsed(sh, p);
+	}
+	munmap(data, st.st_size);
+	return 0;
+}
+
+/**
+ * Execute commands read from @a fd until its end or 'exit'. The read size
+ * starts small for interactive input and grows while the reads fill it
+ * entirely, like for piped scripts. A read error stops the execution with
+ * a non-zero exit code.
+ */
+static void
+shell_run_stream(struct shell *sh, struct parser *p, int fd)
+{
+	const size_t min_size = 1024;
+	const size_t max_size = 256 * 1024;
+	size_t buf_size = min_size;
+	char *buf = malloc(max_size);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		sh->exit_code = 1;
+		return;
+	}
+	while (!sh->is_exit_called) {
+		if (!shell_poll(sh, fd, -1))
+			continue;
+		ssize_t rc = read(fd, buf, buf_size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			/* Like a directory given as the script. */
+			fprintf(stderr, "read: %s\n", strerror(errno));
+			sh->exit_code = errno == EISDIR ? 126 : 1;
+			break;
+		}
+		if (rc == 0) {
+			/* The last line might be not terminated. */
+			parser_feed(p, "\n", 1);
+			shell_run_parsed(sh, p);
+			break;
+		}
+		if ((size_t)rc == buf_size && buf_size < max_size)
+			buf_size *= 2;
+		else if ((size_t)rc < buf_size / 4 && buf_size > min_size)
+			buf_size /= 2;
 		parser_feed(p, buf, rc);
-		struct command_line *line = NULL;
-		while (true) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
-				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
+		shell_run_parsed(sh, p);
+	}
+	free(buf);
+}
+
+/**
+ * Receive the first part of a script together with the client's stdin,
+ * stdout and stderr passed as SCM_RIGHTS. The descriptors are stored in
+ * @a fds, -1 for the ones not passed.
+ *
+ * @return Size of the received data, 0 on EOF, -1 on error.
+ */
+static ssize_t
+server_recv_first(int fd, char *buf, size_t size, int fds[3])
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {buf, size};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t rc;
+	do {
+		rc = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (rc < 0 && errno == EINTR);
+	fds[0] = fds[1] = fds[2] = -1;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+	     c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *received = (int *)CMSG_DATA(c);
+		for (int i = 0; i < count; ++i) {
+			if (i < 3)
+				fds[i] = received[i];
+			else
+				close(received[i]);
+		}
+	}
+	return rc;
+}
+
+/**
+ * Execute one script of a client. The client's descriptors become stdin,
+ * stdout and stderr of the script, so its output goes right to the client
+ * without passing through the server. If they are not passed, the output
+ * is written into the connection. The exit code is sent back as a text
+ * line in the end, when the output is not in the connection.
+ */
+static void
+shell_serve_client(struct shell *sh, struct parser *p, int fd)
+{
+	char buf[4096];
+	int fds[3];
+	ssize_t rc = server_recv_first(fd, buf, sizeof(buf), fds);
+	if (rc <= 0)
+		goto close_fds;
+	bool is_output_passed = fds[1] >= 0;
+	int saved_fds[3];
+	fflush(stdout);
+	fflush(stderr);
+	for (int i = 0; i < 3; ++i) {
+		saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 0);
+		int new_fd = fds[i];
+		if (new_fd < 0)
+			new_fd = i == STDIN_FILENO ? -1 : fd;
+		if (new_fd >= 0)
+			dup2(new_fd, i);
+	}
+	int cwd_fd = open(".", O_PATH | O_CLOEXEC);
+	sh->exit_code = 0;
+	parser_feed(p, buf, rc);
+	shell_run_parsed(sh, p);
+	shell_run_stream(sh, p, fd);
+	shell_drain_tasks(sh);
+	fflush(stdout);
+	fflush(stderr);
+	clearerr(stdout);
+	clearerr(stderr);
+	for (int i = 0; i < 3; ++i) {
+		if (saved_fds[i] >= 0) {
+			dup2(saved_fds[i], i);
+			close(saved_fds[i]);
+		}
+	}
+	/* The next script starts from scratch, except for the caches. */
+	parser_reset(p);
+	sh->is_exit_called = false;
+	vars_delete(sh->vars);
+	sh->vars = vars_new();
+	vars_import(sh->vars, environ);
+	if (cwd_fd >= 0) {
+		if (fchdir(cwd_fd) != 0)
+			fprintf(stderr, "chdir: %s\n", strerror(errno));
+		close(cwd_fd);
+	}
+	if (is_output_passed) {
+		int len = snprintf(buf, sizeof(buf), "%d\n", sh->exit_code);
+		write_all(fd, buf, len);
+	}
+	/*
+	 * After 'exit' the rest of the script is skipped. Closing with not
+	 * read data would reset the connection and lose the exit code.
+	 */
+	shutdown(fd, SHUT_WR);
+	while ((rc = read(fd, buf, sizeof(buf))) != 0) {
+		if (rc < 0 && errno != EINTR)
+			break;
+	}
+close_fds:
+	for (int i = 0; i < 3; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+}
+
+/**
+ * Listen on a Unix socket at @a path and execute the scripts sent by
+ * clients one by one, reusing the same process with its path cache and
+ * parser.
+ */
+static int
+shell_serve(struct shell *sh, const char *path)
+{
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: the socket path is too long\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		return 1;
+	}
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(listen_fd, 128) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(listen_fd);
+		return 1;
+	}
+	/* A client gone away must not kill the server. */
+	signal(SIGPIPE, SIG_IGN);
+	sh->is_server = true;
+	struct parser *p = shell_parser_new();
+	while (true) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
 				continue;
-			}
-			global_exit_code = execute_command_line(line, &exit_called);
-            command_line_delete(line);
-            if (exit_called != 0) {
-                break;
-            }
+			fprintf(stderr, "accept: %s\n", strerror(errno));
+			break;
+		}
+		shell_serve_client(sh, p, fd);
+		close(fd);
+		/* Let the finished background jobs go. */
+		shell_reap_children(sh);
+	}
+	parser_delete(p);
+	close(listen_fd);
+	return 1;
+}
+
+/**
+ * Send a script from @a script_fd to the server at @a path and return the
+ * exit code. The client's stdin, stdout and stderr are passed to the
+ * server together with the first part of the script.
+ */
+static int
+client_run(const char *path, int script_fd)
+{
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: the socket path is too long\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr,
+			      sizeof(addr)) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	char buf[16 * 1024];
+	ssize_t rc;
+	do {
+		rc = read(script_fd, buf, sizeof(buf));
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0) {
+		/* The descriptors need at least one byte to be sent with. */
+		buf[0] = '\n';
+		rc = 1;
+	}
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {buf, rc};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+	int std_fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	memcpy(CMSG_DATA(c), std_fds, sizeof(std_fds));
+	ssize_t sent = sendmsg(fd, &msg, 0);
+	if (sent < 0)
+		goto error;
+	if (sent < rc && write_all(fd, buf + sent, rc - sent) != 0)
+		goto error;
+	while ((rc = read(script_fd, buf, sizeof(buf))) != 0) {
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 || write_all(fd, buf, rc) != 0)
+			goto error;
+	}
+	shutdown(fd, SHUT_WR);
+	size_t size = 0;
+	while (size < sizeof(buf) - 1) {
+		rc = read(fd, buf + size, sizeof(buf) - 1 - size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		size += rc;
+	}
+	close(fd);
+	buf[size] = 0;
+	if (size == 0) {
+		fprintf(stderr, "%s: no exit code from the server\n", path);
+		return 1;
+	}
+	return atoi(buf);
+
+error:
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	close(fd);
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct shell sh;
+	shell_create(&sh);
+	int opt;
+	const char *server_path = NULL;
+	const char *client_path = NULL;
+	while ((opt = getopt(argc, argv, "j:zs:c:")) != -1) {
+		if (opt == 'j' && atoi(optarg) > 0) {
+			sh.max_tasks = atoi(optarg);
+			continue;
+		}
+		if (opt == 'z') {
+			sh.is_zero_copy = false;
+			continue;
+		}
+		if (opt == 's') {
+			server_path = optarg;
+			continue;
 		}
+		if (opt == 'c') {
+			client_path = optarg;
+			continue;
+		}
+		goto usage;
+	}
+	if (argc - optind > 1 || (server_path != NULL && optind < argc))
+		goto usage;
+	if (server_path != NULL) {
+		int rc = shell_serve(&sh, server_path);
+		shell_destroy(&sh);
+		return rc;
+	}
+	int fd = STDIN_FILENO;
+	if (optind < argc) {
+		fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+			shell_destroy(&sh);
+			return 127;
+		}
+	}
+	if (client_path != NULL) {
+		int rc = client_run(client_path, fd);
+		if (fd != STDIN_FILENO)
+			close(fd);
+		shell_destroy(&sh);
+		return rc;
 	}
-    parser_delete(p);
-	return global_exit_code;
+	struct parser *p = shell_parser_new();
+	if (shell_run_mapped(&sh, p, fd) != 0)
+		shell_run_stream(&sh, p, fd);
+	shell_drain_tasks(&sh);
+	parser_delete(p);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	shell_destroy(&sh);
+	return sh.exit_code;
+
+usage:
+	fprintf(stderr, "Usage: %s [-j max_parallel_lines] [-z] "
+		"[-s server_socket | -c server_socket] [script]\n", argv[0]);
+	shell_destroy(&sh);
+	return 1;
 }
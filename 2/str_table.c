@@ -0,0 +1,160 @@
+#include "str_table.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct str_entry {
+	char *key;
+	void *value;
+	uint32_t hash;
+	/** Entries with the same bucket are stored in a list. */
+	struct str_entry *next;
+};
+
+struct str_table {
+	/** Hash table with chaining. Size is a power of 2. */
+	struct str_entry **buckets;
+	uint32_t bucket_count;
+	uint32_t size;
+};
+
+static uint32_t
+str_hash(const char *str)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *str != 0; ++str) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct str_table *
+str_table_new(void)
+{
+	struct str_table *t = calloc(1, sizeof(*t));
+	t->bucket_count = 16;
+	t->buckets = calloc(t->bucket_count, sizeof(*t->buckets));
+	return t;
+}
+
+void
+str_table_delete(struct str_table *t)
+{
+	str_table_clear(t, NULL);
+	free(t->buckets);
+	free(t);
+}
+
+static struct str_entry **
+str_table_find(const struct str_table *t, const char *key, uint32_t hash)
+{
+	uint32_t i = hash & (t->bucket_count - 1);
+	struct str_entry **pos = &t->buckets[i];
+	for (; *pos != NULL; pos = &(*pos)->next) {
+		if ((*pos)->hash == hash && strcmp((*pos)->key, key) == 0)
+			break;
+	}
+	return pos;
+}
+
+static void
+str_table_grow(struct str_table *t)
+{
+	uint32_t new_count = t->bucket_count * 2;
+	struct str_entry **new_buckets =
+		calloc(new_count, sizeof(*new_buckets));
+	for (uint32_t i = 0; i < t->bucket_count; ++i) {
+		struct str_entry *e = t->buckets[i];
+		while (e != NULL) {
+			struct str_entry *next = e->next;
+			uint32_t pos = e->hash & (new_count - 1);
+			e->next = new_buckets[pos];
+			new_buckets[pos] = e;
+			e = next;
+		}
+	}
+	free(t->buckets);
+	t->buckets = new_buckets;
+	t->bucket_count = new_count;
+}
+
+uint32_t
+str_table_size(const struct str_table *t)
+{
+	return t->size;
+}
+
+void *
+str_table_get(const struct str_table *t, const char *key)
+{
+	struct str_entry *e = *str_table_find(t, key, str_hash(key));
+	return e != NULL ? e->value : NULL;
+}
+
+void *
+str_table_set(struct str_table *t, const char *key, void *value)
+{
+	uint32_t hash = str_hash(key);
+	struct str_entry **pos = str_table_find(t, key, hash);
+	if (*pos != NULL) {
+		void *old = (*pos)->value;
+		(*pos)->value = value;
+		return old;
+	}
+	struct str_entry *e = malloc(sizeof(*e));
+	e->key = strdup(key);
+	e->value = value;
+	e->hash = hash;
+	e->next = NULL;
+	*pos = e;
+	if (++t->size > t->bucket_count)
+		str_table_grow(t);
+	return NULL;
+}
+
+void *
+str_table_remove(struct str_table *t, const char *key)
+{
+	struct str_entry **pos = str_table_find(t, key, str_hash(key));
+	struct str_entry *e = *pos;
+	if (e == NULL)
+		return NULL;
+	*pos = e->next;
+	void *value = e->value;
+	free(e->key);
+	free(e);
+	assert(t->size > 0);
+	--t->size;
+	return value;
+}
+
+void
+str_table_foreach(const struct str_table *t, str_table_visit_f cb, void *arg)
+{
+	for (uint32_t i = 0; i < t->bucket_count; ++i) {
+		for (struct str_entry *e = t->buckets[i]; e != NULL;
+		     e = e->next)
+			cb(e->key, e->value, arg);
+	}
+}
+
+void
+str_table_clear(struct str_table *t, void (*free_value)(void *))
+{
+	for (uint32_t i = 0; i < t->bucket_count; ++i) {
+		struct str_entry *e = t->buckets[i];
+		while (e != NULL) {
+			struct str_entry *next = e->next;
+			if (free_value != NULL)
+				free_value(e->value);
+			free(e->key);
+			free(e);
+			e = next;
+		}
+		t->buckets[i] = NULL;
+	}
+	t->size = 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Hash table with string keys and pointer values. The keys are copied into
+ * the table, the values are owned by the user.
+ */
+struct str_table;
+
+struct str_table *
+str_table_new(void);
+
+/** Delete the table. The values must be freed by the user before. */
+void
+str_table_delete(struct str_table *t);
+
+/** Number of the keys in the table. */
+uint32_t
+str_table_size(const struct str_table *t);
+
+/** Value of @a key, NULL if it is not in the table. */
+void *
+str_table_get(const struct str_table *t, const char *key);
+
+/**
+ * Set the value of @a key, adding the key if it is new. Returns the old
+ * value, NULL if there was none.
+ */
+void *
+str_table_set(struct str_table *t, const char *key, void *value);
+
+/** Remove @a key. Returns its value, NULL if there was no such key. */
+void *
+str_table_remove(struct str_table *t, const char *key);
+
+typedef void (*str_table_visit_f)(const char *key, void *value, void *arg);
+
+/** Call @a cb for each key. */
+void
+str_table_foreach(const struct str_table *t, str_table_visit_f cb, void *arg);
+
+/** Remove all the keys. @a free_value is called for each value if set. */
+void
+str_table_clear(struct str_table *t, void (*free_value)(void *));
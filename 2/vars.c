@@ -0,0 +1,128 @@
+#include "vars.h"
+#include "str_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct var {
+	/** "NAME=value", so as it can be passed to the commands as is. */
+	char *entry;
+	/** Points into the entry, after '='. */
+	const char *value;
+	bool is_exported;
+};
+
+struct vars {
+	/** Names mapped to the variables. */
+	struct str_table *table;
+};
+
+static struct var *
+var_new(const char *name, const char *value, bool is_exported)
+{
+	size_t name_len = strlen(name);
+	size_t value_len = strlen(value);
+	struct var *v = malloc(sizeof(*v));
+	v->entry = malloc(name_len + value_len + 2);
+	memcpy(v->entry, name, name_len);
+	v->entry[name_len] = '=';
+	memcpy(v->entry + name_len + 1, value, value_len + 1);
+	v->value = v->entry + name_len + 1;
+	v->is_exported = is_exported;
+	return v;
+}
+
+static void
+var_delete(void *ptr)
+{
+	struct var *v = ptr;
+	if (v == NULL)
+		return;
+	free(v->entry);
+	free(v);
+}
+
+struct vars *
+vars_new(void)
+{
+	struct vars *vars = malloc(sizeof(*vars));
+	vars->table = str_table_new();
+	return vars;
+}
+
+void
+vars_delete(struct vars *vars)
+{
+	str_table_clear(vars->table, var_delete);
+	str_table_delete(vars->table);
+	free(vars);
+}
+
+void
+vars_import(struct vars *vars, char **env)
+{
+	for (; *env != NULL; ++env) {
+		const char *eq = strchr(*env, '=');
+		if (eq == NULL)
+			continue;
+		char *name = strndup(*env, eq - *env);
+		struct var *v = var_new(name, eq + 1, true);
+		var_delete(str_table_set(vars->table, name, v));
+		free(name);
+	}
+}
+
+const char *
+vars_get(const struct vars *vars, const char *name)
+{
+	struct var *v = str_table_get(vars->table, name);
+	return v != NULL ? v->value : NULL;
+}
+
+void
+vars_set(struct vars *vars, const char *name, const char *value)
+{
+	struct var *old = str_table_get(vars->table, name);
+	struct var *v = var_new(name, value, old != NULL && old->is_exported);
+	var_delete(str_table_set(vars->table, name, v));
+}
+
+void
+vars_export(struct vars *vars, const char *name)
+{
+	struct var *v = str_table_get(vars->table, name);
+	if (v != NULL)
+		v->is_exported = true;
+}
+
+void
+vars_unset(struct vars *vars, const char *name)
+{
+	var_delete(str_table_remove(vars->table, name));
+}
+
+struct vars_environ_ctx {
+	char **env;
+	size_t count;
+};
+
+static void
+vars_environ_add(const char *name, void *value, void *arg)
+{
+	(void)name;
+	struct var *v = value;
+	struct vars_environ_ctx *ctx = arg;
+	if (v->is_exported)
+		ctx->env[ctx->count++] = v->entry;
+}
+
+char **
+vars_environ(const struct vars *vars)
+{
+	struct vars_environ_ctx ctx;
+	ctx.env = malloc(sizeof(*ctx.env) * (str_table_size(vars->table) + 1));
+	ctx.count = 0;
+	str_table_foreach(vars->table, vars_environ_add, &ctx);
+	ctx.env[ctx.count] = NULL;
+	return ctx.env;
+}
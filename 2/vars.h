@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Shell variables, stored in a hash table. The exported ones make the
+ * environment of the executed commands. The process environment itself is
+ * only imported and never changed.
+ */
+struct vars;
+
+struct vars *
+vars_new(void);
+
+void
+vars_delete(struct vars *vars);
+
+/** Set the variables from "NAME=value" strings of @a env as exported. */
+void
+vars_import(struct vars *vars, char **env);
+
+/** Value of the variable @a name, NULL if it is not set. */
+const char *
+vars_get(const struct vars *vars, const char *name);
+
+/**
+ * Set the variable @a name, replacing the old value if any. An exported
+ * variable stays exported.
+ */
+void
+vars_set(struct vars *vars, const char *name, const char *value);
+
+/** Pass the variable @a name to the executed commands, if it is set. */
+void
+vars_export(struct vars *vars, const char *name);
+
+void
+vars_unset(struct vars *vars, const char *name);
+
+/**
+ * Environment for execve(): "NAME=value" of each exported variable, ended
+ * with NULL. The array is allocated by malloc(), the strings belong to
+ * @a vars and are valid until it is changed.
+ */
+char **
+vars_environ(const struct vars *vars);
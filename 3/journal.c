@@ -0,0 +1,386 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	JOURNAL_MAGIC = 0x4c4e524a,
+	/** Parts of a record which fit into the stack buffer for writev(). */
+	JOURNAL_SMALL_IOV = 8,
+	/** Parts written by one call, IOV_MAX of Linux. */
+	JOURNAL_MAX_IOV = 1024,
+};
+
+/** On-disk header of a record, the payload follows it. */
+struct journal_header {
+	/** Size of the payload. */
+	uint64_t data_size;
+	uint64_t lsn;
+	uint64_t id;
+	uint64_t arg;
+	uint32_t type;
+	uint32_t magic;
+	/** Checksum of the payload and of the header with this field zeroed. */
+	uint32_t checksum;
+	uint32_t padding;
+};
+
+struct journal {
+	/** Protects all the fields, and orders the appends. */
+	pthread_mutex_t lock;
+	int fd;
+	char *path;
+	/** Size of the file, the next record goes at this offset. */
+	size_t size;
+	uint64_t lsn;
+	bool is_broken;
+};
+
+/**
+ * Checksum state, mixing 8 bytes per step - the byte-wise hashes would be
+ * slower than the write itself. The result doesn't depend on how the data
+ * is split into the updates.
+ */
+struct checksum {
+	uint64_t hash;
+	uint64_t size;
+	unsigned char tail[8];
+};
+
+static void
+checksum_init(struct checksum *c, uint32_t seed)
+{
+	c->hash = seed ^ 0x9e3779b97f4a7c15ull;
+	c->size = 0;
+}
+
+static void
+checksum_word(struct checksum *c, uint64_t word)
+{
+	c->hash = (c->hash ^ word) * 0xff51afd7ed558ccdull;
+	c->hash ^= c->hash >> 32;
+}
+
+static void
+checksum_update(struct checksum *c, const void *data, size_t size)
+{
+	const unsigned char *pos = data;
+	size_t tail = c->size % 8;
+	uint64_t word;
+	if (size == 0)
+		return;
+	c->size += size;
+	if (tail != 0) {
+		size_t len = 8 - tail < size ? 8 - tail : size;
+		memcpy(c->tail + tail, pos, len);
+		pos += len;
+		size -= len;
+		if (tail + len < 8)
+			return;
+		memcpy(&word, c->tail, 8);
+		checksum_word(c, word);
+	}
+	for (; size >= 8; pos += 8, size -= 8) {
+		memcpy(&word, pos, 8);
+		checksum_word(c, word);
+	}
+	memcpy(c->tail, pos, size);
+}
+
+static uint32_t
+checksum_final(struct checksum *c)
+{
+	uint64_t word = 0;
+	memcpy(&word, c->tail, c->size % 8);
+	checksum_word(c, word);
+	checksum_word(c, c->size);
+	return (uint32_t)(c->hash ^ (c->hash >> 32));
+}
+
+uint32_t
+journal_checksum(uint32_t seed, const void *data, size_t size)
+{
+	struct checksum c;
+	checksum_init(&c, seed);
+	checksum_update(&c, data, size);
+	return checksum_final(&c);
+}
+
+/**
+ * Parse the record at the start of @a mem.
+ * @retval 0 There is no intact record, the journal ends here.
+ * @retval >0 Size of the record.
+ */
+static size_t
+record_parse(const char *mem, size_t size, struct journal_record *record)
+{
+	struct journal_header h;
+	if (size < sizeof(h))
+		return 0;
+	memcpy(&h, mem, sizeof(h));
+	if (h.magic != JOURNAL_MAGIC || h.data_size > size - sizeof(h))
+		return 0;
+	uint32_t checksum = h.checksum;
+	h.checksum = 0;
+	uint32_t data_checksum = journal_checksum(0, mem + sizeof(h),
+						  h.data_size);
+	if (journal_checksum(data_checksum, &h, sizeof(h)) != checksum)
+		return 0;
+	record->lsn = h.lsn;
+	record->type = h.type;
+	record->id = h.id;
+	record->arg = h.arg;
+	record->data = mem + sizeof(h);
+	record->data_size = h.data_size;
+	return sizeof(h) + h.data_size;
+}
+
+/** Write all the parts at the offset, continuing after partial writes. */
+static int
+write_all(int fd, struct iovec *iov, int count, off_t offset)
+{
+	while (true) {
+		while (count > 0 && iov->iov_len == 0) {
+			++iov;
+			--count;
+		}
+		if (count == 0)
+			return 0;
+		ssize_t rc = pwritev(fd, iov, count < JOURNAL_MAX_IOV ? count : JOURNAL_MAX_IOV,
+				     offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = EIO;
+			return -1;
+		}
+		offset += rc;
+		for (; count > 0 && (size_t)rc >= iov->iov_len; ++iov, --count)
+			rc -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+}
+
+struct journal *
+journal_open(const char *path, uint64_t min_lsn, journal_replay_f replay,
+	     void *ctx)
+{
+	struct journal *j = calloc(1, sizeof(*j));
+	if (j == NULL)
+		return NULL;
+	j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	j->path = strdup(path);
+	j->lsn = min_lsn;
+	struct stat st;
+	if (j->fd < 0 || j->path == NULL || fstat(j->fd, &st) != 0)
+		goto error;
+	size_t size = st.st_size;
+	if (size > 0) {
+		char *mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+		if (mem == MAP_FAILED)
+			goto error;
+		struct journal_record record;
+		uint64_t last_lsn = 0;
+		size_t record_size;
+		while ((record_size = record_parse(mem + j->size, size - j->size,
+						   &record)) != 0) {
+			/* A stale record after a torn one, the journal ends. */
+			if (record.lsn <= last_lsn)
+				break;
+			last_lsn = record.lsn;
+			j->size += record_size;
+			if (record.lsn <= min_lsn)
+				continue;
+			replay(&record, ctx);
+			j->lsn = record.lsn;
+		}
+		munmap(mem, size);
+		if (j->size < size && ftruncate(j->fd, j->size) != 0)
+			goto error;
+	}
+	pthread_mutex_init(&j->lock, NULL);
+	return j;
+error:
+	if (j->fd >= 0)
+		close(j->fd);
+	free(j->path);
+	free(j);
+	return NULL;
+}
+
+void
+journal_close(struct journal *j)
+{
+	close(j->fd);
+	pthread_mutex_destroy(&j->lock);
+	free(j->path);
+	free(j);
+}
+
+int
+journal_append(struct journal *j, uint32_t type, uint64_t id, uint64_t arg,
+	       const struct iovec *data, int count)
+{
+	struct journal_header h = {
+		.id = id,
+		.arg = arg,
+		.type = type,
+		.magic = JOURNAL_MAGIC,
+	};
+	if (count < 0)
+		return -1;
+	struct iovec small_iov[JOURNAL_SMALL_IOV];
+	struct iovec *iov = small_iov;
+	if (count >= JOURNAL_SMALL_IOV &&
+	    (iov = malloc((count + 1) * sizeof(*iov))) == NULL)
+		return -1;
+	/* The payload is hashed before the lock, only the header is after. */
+	struct checksum c;
+	checksum_init(&c, 0);
+	for (int i = 0; i < count; ++i) {
+		checksum_update(&c, data[i].iov_base, data[i].iov_len);
+		h.data_size += data[i].iov_len;
+		iov[i + 1] = data[i];
+	}
+	uint32_t data_checksum = checksum_final(&c);
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+
+	int rc = -1;
+	pthread_mutex_lock(&j->lock);
+	if (j->is_broken)
+		goto out;
+	h.lsn = j->lsn + 1;
+	h.checksum = journal_checksum(data_checksum, &h, sizeof(h));
+	if (write_all(j->fd, iov, count + 1, j->size) != 0) {
+		/*
+		 * A part of the record could be written. The next records
+		 * would go after it and be lost on replay, so stop here.
+		 */
+		j->is_broken = true;
+		goto out;
+	}
+	j->size += sizeof(h) + h.data_size;
+	j->lsn = h.lsn;
+	rc = 0;
+out:
+	pthread_mutex_unlock(&j->lock);
+	if (iov != small_iov)
+		free(iov);
+	return rc;
+}
+
+uint64_t
+journal_lsn(struct journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	uint64_t lsn = j->lsn;
+	pthread_mutex_unlock(&j->lock);
+	return lsn;
+}
+
+size_t
+journal_size(struct journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	size_t size = j->size;
+	pthread_mutex_unlock(&j->lock);
+	return size;
+}
+
+int
+journal_sync(struct journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	int rc = j->is_broken || fdatasync(j->fd) != 0 ? -1 : 0;
+	pthread_mutex_unlock(&j->lock);
+	return rc;
+}
+
+int
+journal_compact(struct journal *j, uint64_t lsn)
+{
+	int rc = -1;
+	int fd = -1;
+	char *tmp_path = NULL;
+	char *mem = MAP_FAILED;
+	size_t mem_size = 0;
+	pthread_mutex_lock(&j->lock);
+	if (j->is_broken)
+		goto out;
+	if (j->size == 0) {
+		rc = 0;
+		goto out;
+	}
+	mem_size = j->size;
+	mem = mmap(NULL, mem_size, PROT_READ, MAP_SHARED, j->fd, 0);
+	if (mem == MAP_FAILED)
+		goto out;
+	size_t start = 0;
+	size_t record_size;
+	struct journal_record record;
+	while ((record_size = record_parse(mem + start, j->size - start,
+					   &record)) != 0 && record.lsn <= lsn)
+		start += record_size;
+	if (start == 0) {
+		rc = 0;
+		goto out;
+	}
+	size_t path_len = strlen(j->path);
+	if ((tmp_path = malloc(path_len + sizeof(".tmp"))) == NULL)
+		goto out;
+	memcpy(tmp_path, j->path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto out;
+	struct iovec iov = {mem + start, j->size - start};
+	if (write_all(fd, &iov, 1, 0) != 0 || fdatasync(fd) != 0 ||
+	    rename(tmp_path, j->path) != 0) {
+		unlink(tmp_path);
+		goto out;
+	}
+	journal_sync_dir(j->path);
+	close(j->fd);
+	j->fd = fd;
+	fd = -1;
+	j->size -= start;
+	rc = 0;
+out:
+	if (mem != MAP_FAILED)
+		munmap(mem, mem_size);
+	pthread_mutex_unlock(&j->lock);
+	if (fd >= 0)
+		close(fd);
+	free(tmp_path);
+	return rc;
+}
+
+int
+journal_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = slash == NULL ? strdup(".") :
+				    strndup(path, slash - path + 1);
+	if (dir == NULL)
+		return -1;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+	if (fd < 0)
+		return -1;
+	int rc = fsync(fd);
+	close(fd);
+	return rc;
+}
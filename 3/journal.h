@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct journal;
+
+/**
+ * One change saved in the journal. The meaning of the fields except the LSN
+ * is up to the user.
+ */
+struct journal_record {
+	/** Log sequence number, grows by 1 with each record. */
+	uint64_t lsn;
+	uint32_t type;
+	uint64_t id;
+	uint64_t arg;
+	/** Payload, valid only during the replay callback. */
+	const char *data;
+	size_t data_size;
+};
+
+typedef void
+(*journal_replay_f)(const struct journal_record *record, void *ctx);
+
+/**
+ * Append-only log of changes, a write-ahead journal. Each record has a
+ * checksum, so a record torn by a crash is found on the next open and cut off
+ * with everything after it.
+ *
+ * The records are written with one writev() per record under a lock, so they
+ * survive a crash of the process right away, and a crash of the system after
+ * journal_sync(). A failed write breaks the journal: the next appends fail
+ * too, not to leave a gap in the history.
+ */
+
+/**
+ * Open the journal file, create if there is none. All the intact records
+ * with LSN bigger than @a min_lsn are passed to @a replay in their order.
+ * @a min_lsn is also the smallest last LSN of the opened journal, so the new
+ * records go after it even when the journal is empty.
+ * @retval NULL Error, see errno.
+ */
+struct journal *
+journal_open(const char *path, uint64_t min_lsn, journal_replay_f replay,
+	     void *ctx);
+
+/** Close the file and free the journal. The records are not synced. */
+void
+journal_close(struct journal *j);
+
+/**
+ * Append a record, its payload is gathered from @a data.
+ * @retval 0 Success.
+ * @retval -1 Negative @a count, write error, or the journal is broken by
+ *     an earlier one.
+ */
+int
+journal_append(struct journal *j, uint32_t type, uint64_t id, uint64_t arg,
+	       const struct iovec *data, int count);
+
+/** LSN of the last appended record. */
+uint64_t
+journal_lsn(struct journal *j);
+
+/** Size of the journal file in bytes. */
+size_t
+journal_size(struct journal *j);
+
+/**
+ * Flush the records to the disk.
+ * @retval -1 Sync error, or the journal is broken.
+ */
+int
+journal_sync(struct journal *j);
+
+/**
+ * Drop the records with LSN up to @a lsn, when they are saved elsewhere. The
+ * rest is copied into a new file, which atomically replaces the old one, so
+ * the appends wait only for the copy of the records newer than @a lsn.
+ * @retval -1 Error, the journal stays as it was.
+ */
+int
+journal_compact(struct journal *j, uint64_t lsn);
+
+/** Sync the directory containing @a path, to make a rename durable. */
+int
+journal_sync_dir(const char *path);
+
+/** Checksum used for the records, continuing from @a seed. */
+uint32_t
+journal_checksum(uint32_t seed, const void *data, size_t size);
@@ -0,0 +1,289 @@
+#include "slab.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/**
+ * Header of a chunk. It takes the first blocks of the chunk, the rest are given
+ * to the users. Because the chunks are aligned by their size, the chunk of any
+ * block is found by clearing the lower bits of its address.
+ */
+struct slab_chunk {
+	/** Link in the partial or full list of the slab. */
+	struct slab_chunk *prev;
+	struct slab_chunk *next;
+	/** Freed blocks, each keeps a pointer to the next one. */
+	void *free_list;
+	/** Start of the blocks which were never allocated. */
+	char *unused;
+	/** How many blocks are allocated. */
+	size_t used;
+	/** Log2 of the block size, to find the index of a block. */
+	int block_shift;
+	/**
+	 * Reference counts of the blocks, shifted by REFS_SHIFT. The lowest
+	 * bit is the mark, see slab_mark().
+	 */
+	atomic_uint refs[];
+};
+
+enum {
+	REFS_SHIFT = 1,
+	REFS_ONE = 1 << REFS_SHIFT,
+	REFS_MARK = 1,
+};
+
+static struct slab_chunk *
+chunk_of(const void *block)
+{
+	return (struct slab_chunk *)((uintptr_t)block &
+				     ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+}
+
+static size_t
+header_size(const struct slab *slab, size_t capacity)
+{
+	size_t size = sizeof(struct slab_chunk) + capacity * sizeof(atomic_uint);
+	return (size + slab->block_size - 1) & ~(slab->block_size - 1);
+}
+
+/** How many blocks fit into a chunk after the header. */
+static size_t
+slab_capacity(struct slab *slab)
+{
+	if (slab->capacity != 0)
+		return slab->capacity;
+	size_t capacity = SLAB_CHUNK_SIZE / slab->block_size;
+	while (header_size(slab, capacity) + capacity * slab->block_size >
+	       SLAB_CHUNK_SIZE)
+		--capacity;
+	slab->capacity = capacity;
+	return capacity;
+}
+
+static atomic_uint *
+block_refs(const void *block)
+{
+	struct slab_chunk *chunk = chunk_of(block);
+	size_t offset = (const char *)block - (const char *)chunk;
+	size_t index = (SLAB_CHUNK_SIZE - offset - 1) >> chunk->block_shift;
+	return &chunk->refs[index];
+}
+
+static void
+list_remove(struct slab_chunk **head, struct slab_chunk *chunk)
+{
+	if (chunk->prev != NULL)
+		chunk->prev->next = chunk->next;
+	else
+		*head = chunk->next;
+	if (chunk->next != NULL)
+		chunk->next->prev = chunk->prev;
+}
+
+static void
+list_add(struct slab_chunk **head, struct slab_chunk *chunk)
+{
+	chunk->prev = NULL;
+	chunk->next = *head;
+	if (*head != NULL)
+		(*head)->prev = chunk;
+	*head = chunk;
+}
+
+static struct slab_chunk *
+chunk_map(struct slab *slab)
+{
+	/* Map twice the size to cut an aligned part out of it. */
+	size_t size = 2 * (size_t)SLAB_CHUNK_SIZE;
+	char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	char *start = (char *)chunk_of(mem + SLAB_CHUNK_SIZE - 1);
+	char *end = start + SLAB_CHUNK_SIZE;
+	if (start > mem)
+		munmap(mem, start - mem);
+	if (mem + size > end)
+		munmap(end, mem + size - end);
+	struct slab_chunk *chunk = (struct slab_chunk *)start;
+	chunk->free_list = NULL;
+	chunk->unused = end - slab_capacity(slab) * slab->block_size;
+	chunk->used = 0;
+	chunk->block_shift = __builtin_ctzl(slab->block_size);
+	++slab->chunk_count;
+	return chunk;
+}
+
+static void
+chunk_unmap(struct slab *slab, struct slab_chunk *chunk)
+{
+	munmap(chunk, SLAB_CHUNK_SIZE);
+	--slab->chunk_count;
+}
+
+void *
+slab_alloc(struct slab *slab)
+{
+	assert(slab->block_size >= sizeof(void *) &&
+	       (slab->block_size & (slab->block_size - 1)) == 0 &&
+	       slab->block_size <= SLAB_CHUNK_SIZE / 2);
+	struct slab_chunk *chunk = slab->partial;
+	if (chunk == NULL) {
+		chunk = slab->spare;
+		if (chunk != NULL)
+			slab->spare = NULL;
+		else if ((chunk = chunk_map(slab)) == NULL)
+			return NULL;
+		list_add(&slab->partial, chunk);
+	}
+	void *block;
+	if (chunk->free_list != NULL) {
+		block = chunk->free_list;
+		chunk->free_list = *(void **)block;
+	} else {
+		block = chunk->unused;
+		chunk->unused += slab->block_size;
+	}
+	if (++chunk->used == slab_capacity(slab)) {
+		list_remove(&slab->partial, chunk);
+		list_add(&slab->full, chunk);
+	}
+	++slab->block_count;
+	atomic_store_explicit(block_refs(block), REFS_ONE, memory_order_relaxed);
+	return block;
+}
+
+void
+slab_free(struct slab *slab, void *block)
+{
+	struct slab_chunk *chunk = chunk_of(block);
+	assert(chunk->used > 0);
+	assert(slab_refs(block) <= 1);
+	atomic_store_explicit(block_refs(block), 0, memory_order_relaxed);
+	if (chunk->used-- == slab_capacity(slab)) {
+		list_remove(&slab->full, chunk);
+		list_add(&slab->partial, chunk);
+	}
+	*(void **)block = chunk->free_list;
+	chunk->free_list = block;
+	--slab->block_count;
+	if (chunk->used > 0)
+		return;
+	list_remove(&slab->partial, chunk);
+	if (slab->spare != NULL) {
+		chunk_unmap(slab, chunk);
+		return;
+	}
+	/* Forget the free blocks, the chunk is going to be cut again. */
+	chunk->free_list = NULL;
+	chunk->unused = (char *)chunk + SLAB_CHUNK_SIZE -
+			slab_capacity(slab) * slab->block_size;
+	slab->spare = chunk;
+}
+
+size_t
+slab_chunk_capacity(struct slab *slab)
+{
+	return slab_capacity(slab);
+}
+
+size_t
+slab_block_offset(struct slab *slab, size_t index)
+{
+	assert(index < slab_capacity(slab));
+	return SLAB_CHUNK_SIZE - (slab_capacity(slab) - index) * slab->block_size;
+}
+
+void
+slab_adopt(struct slab *slab, void *mem, size_t used)
+{
+	assert(chunk_of(mem) == mem);
+	assert(used > 0 && used <= slab_capacity(slab));
+	struct slab_chunk *chunk = mem;
+	chunk->free_list = NULL;
+	chunk->unused = (char *)chunk + slab_block_offset(slab, 0) +
+			used * slab->block_size;
+	chunk->used = used;
+	chunk->block_shift = __builtin_ctzl(slab->block_size);
+	for (size_t i = 0; i < slab_capacity(slab); ++i)
+		atomic_init(&chunk->refs[i], 0);
+	if (used == slab_capacity(slab))
+		list_add(&slab->full, chunk);
+	else
+		list_add(&slab->partial, chunk);
+	++slab->chunk_count;
+	slab->block_count += used;
+}
+
+void
+slab_destroy(struct slab *slab)
+{
+	struct slab_chunk **lists[] = {&slab->partial, &slab->full};
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+		while (*lists[i] != NULL) {
+			struct slab_chunk *chunk = *lists[i];
+			list_remove(lists[i], chunk);
+			chunk_unmap(slab, chunk);
+		}
+	}
+	if (slab->spare != NULL)
+		chunk_unmap(slab, slab->spare);
+	slab->spare = NULL;
+	slab->block_count = 0;
+}
+
+size_t
+slab_ref_total(struct slab *slab)
+{
+	size_t total = 0;
+	struct slab_chunk *lists[] = {slab->partial, slab->full};
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		for (struct slab_chunk *c = lists[i]; c != NULL; c = c->next) {
+			for (size_t j = 0; j < slab_capacity(slab); j++) {
+				total += atomic_load_explicit(&c->refs[j],
+							      memory_order_relaxed) >> REFS_SHIFT;
+			}
+		}
+	}
+	return total;
+}
+
+void
+slab_ref(void *block)
+{
+	atomic_fetch_add_explicit(block_refs(block), REFS_ONE,
+				  memory_order_relaxed);
+}
+
+bool
+slab_unref(void *block)
+{
+	unsigned refs = atomic_fetch_sub_explicit(block_refs(block), REFS_ONE,
+						  memory_order_acq_rel);
+	assert(refs >= REFS_ONE);
+	return refs >> REFS_SHIFT == 1;
+}
+
+unsigned
+slab_refs(const void *block)
+{
+	return atomic_load_explicit(block_refs(block),
+				    memory_order_acquire) >> REFS_SHIFT;
+}
+
+void
+slab_mark(void *block)
+{
+	atomic_fetch_or_explicit(block_refs(block), REFS_MARK,
+				 memory_order_relaxed);
+}
+
+bool
+slab_is_marked(const void *block)
+{
+	return (atomic_load_explicit(block_refs(block), memory_order_relaxed) &
+		REFS_MARK) != 0;
+}
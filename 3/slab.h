@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct slab_chunk;
+
+/**
+ * Allocator of blocks of one size. The memory is mapped from the system by big
+ * aligned chunks, and each chunk is cut into the blocks. So the blocks have no
+ * per-allocation header, and the allocator metadata doesn't grow with the
+ * block count. A chunk is unmapped when all its blocks are freed.
+ *
+ * Each block has a reference count, to be shared by several owners. It is
+ * kept in the chunk header and changed atomically, so the references can be
+ * taken and dropped without the lock which protects the allocations.
+ *
+ * A slab is initialized statically with only the block size set, which is a
+ * power of 2 from 64 to a half of the chunk size:
+ *
+ *     struct slab s = {.block_size = 512};
+ */
+struct slab {
+	/** Size of the blocks, a power of 2. */
+	size_t block_size;
+	/** Chunks having both free and allocated blocks. */
+	struct slab_chunk *partial;
+	/** Chunks without free blocks. */
+	struct slab_chunk *full;
+	/**
+	 * One completely free chunk is kept, so as allocating and freeing a
+	 * block at a chunk border doesn't map and unmap the chunk each time.
+	 */
+	struct slab_chunk *spare;
+	/** How many chunks are mapped. */
+	size_t chunk_count;
+	/** How many blocks are allocated. */
+	size_t block_count;
+	/** How many blocks fit into a chunk, calculated on first use. */
+	size_t capacity;
+};
+
+enum {
+	/** Size and alignment of the chunks. */
+	SLAB_CHUNK_SIZE = 4 * 1024 * 1024,
+};
+
+/**
+ * Allocate a block with one reference. Returns NULL when there is no memory.
+ */
+void *
+slab_alloc(struct slab *slab);
+
+/**
+ * Free a block allocated from the same slab. It should have no other
+ * references.
+ */
+void
+slab_free(struct slab *slab, void *block);
+
+/** How many blocks a chunk of the slab has. */
+size_t
+slab_chunk_capacity(struct slab *slab);
+
+/**
+ * Offset of the block number @a index from the start of its chunk. The blocks
+ * of a new chunk are allocated in the order of their numbers.
+ */
+size_t
+slab_block_offset(struct slab *slab, size_t index);
+
+/**
+ * Make a chunk mapped by the caller a part of the slab, as if its first
+ * @a used blocks were allocated. It lets to load the blocks from a file
+ * mapping. The blocks get no references, the caller should add them with
+ * slab_ref() and free the ones which don't get any. The memory is unmapped
+ * with munmap() like the slab's own chunks.
+ *
+ * @param mem Start of the chunk, aligned by SLAB_CHUNK_SIZE. The header part
+ *        of it (before the first block) is overwritten.
+ */
+void
+slab_adopt(struct slab *slab, void *mem, size_t used);
+
+/** Unmap all the chunks. The allocated blocks become invalid. */
+void
+slab_destroy(struct slab *slab);
+
+/** Add a reference to the block. */
+void
+slab_ref(void *block);
+
+/**
+ * Drop a reference to the block. Returns true if it was the last one, then
+ * the block should be freed with slab_free().
+ */
+bool
+slab_unref(void *block);
+
+/** Reference count of the block. */
+unsigned
+slab_refs(const void *block);
+
+/**
+ * Mark the block. The mark is a flag for the user, kept next to the reference
+ * count, and cleared when the block is freed. It lets the user find the
+ * blocks it tracks elsewhere without a lookup.
+ */
+void
+slab_mark(void *block);
+
+/** Whether the block is marked by slab_mark(). */
+bool
+slab_is_marked(const void *block);
+
+/**
+ * Sum of the reference counts of all the blocks. It walks all the chunks, so
+ * it is for the statistics. The allocations should not run in parallel.
+ */
+size_t
+slab_ref_total(struct slab *slab);
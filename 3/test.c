@@ -2,8 +2,11 @@
 #include "../utils/unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +73,60 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	char name[32];
+	unit_msg("create %d files", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, strlen(name)) !=
+			     (ssize_t)strlen(name));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("delete every second one, keeping some opened");
+	int kept_fd = -1;
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "many%d", i);
+		if (i == count / 2) {
+			kept_fd = ufs_open(name, 0);
+			unit_fail_if(kept_fd == -1);
+		}
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("many0", 0) == -1, "deleted file is not found");
+	unit_msg("recreate the deleted ones and check all the content");
+	char buf[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many%d", i);
+		int fd = ufs_open(name, i % 2 == 0 ? UFS_CREATE : 0);
+		unit_fail_if(fd == -1);
+		ssize_t rc = ufs_read(fd, buf, sizeof(buf));
+		if (i % 2 == 0)
+			unit_fail_if(rc != 0);
+		else
+			unit_fail_if(rc != (ssize_t)strlen(name) ||
+				     memcmp(buf, name, rc) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	sprintf(name, "many%d", count / 2);
+	ssize_t rc = ufs_read(kept_fd, buf, sizeof(buf));
+	unit_check(rc == (ssize_t)strlen(name) && memcmp(buf, name, rc) == 0,
+		   "deleted file is still readable via opened descriptor");
+	unit_fail_if(ufs_close(kept_fd) != 0);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -269,6 +326,1227 @@ test_delete(void)
 	unit_test_finish();
 }
 
+static void
+test_random_access(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_seek(fd, 0, 100) == -1, "seek with invalid whence");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_SET) == -1,
+		   "seek before the file start");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(-1, 0, UFS_SEEK_SET) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int size = 5000;
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, size) != size);
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == size,
+		   "position is after the written data");
+	unit_check(ufs_seek(fd, -10, UFS_SEEK_END) == size - 10,
+		   "seek from the end");
+	char tmp[32];
+	unit_check(ufs_read(fd, tmp, sizeof(tmp)) == 10, "read the tail");
+	unit_check(memcmp(tmp, buf + size - 10, 10) == 0, "data is correct");
+	unit_check(ufs_seek(fd, 1030, UFS_SEEK_SET) == 1030,
+		   "seek into the middle of a block");
+	unit_check(ufs_read(fd, tmp, 20) == 20, "read across blocks");
+	unit_check(memcmp(tmp, buf + 1030, 20) == 0, "data is correct");
+
+	unit_check(ufs_pread(fd, tmp, 4, 2046) == 4, "pread");
+	unit_check(memcmp(tmp, buf + 2046, 4) == 0, "data is correct");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 1050,
+		   "pread doesn't move the position");
+	unit_check(ufs_pwrite(fd, "XYZ", 3, 511) == 3, "pwrite");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 1050,
+		   "pwrite doesn't move the position");
+	unit_check(ufs_pread(fd, tmp, 5, 510) == 5 &&
+		   memcmp(tmp, "qXYZu", 5) == 0, "pwrite overwrote the data");
+	unit_check(ufs_pread(fd, tmp, 5, size) == 0, "pread at the end");
+	unit_check(ufs_pread(fd, tmp, 5, size * 2) == 0,
+		   "pread beyond the end");
+
+	unit_check(ufs_seek(fd, 1000, UFS_SEEK_END) == size + 1000,
+		   "seek beyond the end");
+	unit_check(ufs_write(fd, "end", 3) == 3, "write there");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == size + 1003,
+		   "file grew");
+	bool is_zero = true;
+	for (int i = size; i < size + 1000 && is_zero; ++i)
+		is_zero = ufs_pread(fd, tmp, 1, i) == 1 && tmp[0] == 0;
+	unit_check(is_zero, "the gap is zeros");
+	unit_check(ufs_pwrite(fd, "a", 1, 100 * 1024 * 1024) == -1,
+		   "pwrite beyond the max file size");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_pwrite(fd, "b", 1, 20) != 1);
+	unit_check(ufs_pread(fd, tmp, sizeof(tmp), 0) == 21, "size is new");
+	unit_check(memcmp(tmp, buf, 10) == 0 &&
+		   memcmp(tmp + 10, "\0\0\0\0\0\0\0\0\0\0b", 11) == 0,
+		   "old data after shrink is not visible");
+	free(buf);
+
+	int ro = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(ro == -1);
+	unit_check(ufs_pwrite(ro, "a", 1, 0) == -1, "no pwrite in read only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(ro) != 0);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_block_size_change(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int size = 200 * 1024;
+	char *buf = malloc(size);
+	char *buf2 = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_msg("grow a small file into a big one by parts");
+	int pos = 0;
+	while (pos < size) {
+		int part = pos % 1000 + 1;
+		if (part > size - pos)
+			part = size - pos;
+		unit_fail_if(ufs_write(fd, buf + pos, part) != part);
+		pos += part;
+	}
+	unit_check(ufs_pread(fd, buf2, size, 0) == size &&
+		   memcmp(buf, buf2, size) == 0, "data is correct");
+
+	unit_fail_if(ufs_resize(fd, 70000) != 0);
+	unit_check(ufs_pread(fd, buf2, size, 0) == 70000 &&
+		   memcmp(buf, buf2, 70000) == 0, "shrink a bit");
+	unit_fail_if(ufs_resize(fd, 3000) != 0);
+	unit_check(ufs_pread(fd, buf2, size, 0) == 3000 &&
+		   memcmp(buf, buf2, 3000) == 0, "shrink to a small file");
+	unit_fail_if(ufs_pwrite(fd, buf, 10, 100000) != 10);
+	unit_check(ufs_pread(fd, buf2, size, 0) == 100010, "grow again");
+	bool ok = memcmp(buf, buf2, 3000) == 0 &&
+		  memcmp(buf, buf2 + 100000, 10) == 0;
+	for (int i = 3000; i < 100000 && ok; ++i)
+		ok = buf2[i] == 0;
+	unit_check(ok, "data is correct and the gap is zeros");
+	free(buf2);
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+struct thread_arg {
+	int id;
+	/** Descriptor of the file shared by all the threads. */
+	int shared_fd;
+	bool ok;
+};
+
+static void *
+test_threads_f(void *data)
+{
+	struct thread_arg *arg = data;
+	char name[32], buf[256], buf2[256];
+	arg->ok = true;
+	for (int iter = 0; iter < 200 && arg->ok; ++iter) {
+		sprintf(name, "thread%d_%d", arg->id, iter % 10);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1) {
+			arg->ok = false;
+			break;
+		}
+		for (int i = 0; i < (int)sizeof(buf); ++i)
+			buf[i] = arg->id + iter + i;
+		arg->ok = ufs_pwrite(fd, buf, sizeof(buf), iter) ==
+			  sizeof(buf) &&
+			  ufs_pread(fd, buf2, sizeof(buf2), iter) ==
+			  sizeof(buf2) &&
+			  memcmp(buf, buf2, sizeof(buf)) == 0;
+		/* Every shared record is written whole, so it is read whole. */
+		size_t offset = (iter % 16) * sizeof(buf);
+		if (iter % 4 == 0) {
+			memset(buf, 'a' + iter % 26, sizeof(buf));
+			arg->ok = arg->ok && ufs_pwrite(arg->shared_fd, buf,
+				sizeof(buf), offset) == sizeof(buf);
+		} else {
+			arg->ok = arg->ok && ufs_pread(arg->shared_fd, buf2,
+				sizeof(buf2), offset) == sizeof(buf2);
+			for (int i = 1; i < (int)sizeof(buf2) && arg->ok; ++i)
+				arg->ok = buf2[i] == buf2[0];
+		}
+		arg->ok = arg->ok && ufs_close(fd) == 0;
+		if (iter % 3 == 0)
+			arg->ok = arg->ok && ufs_delete(name) == 0;
+	}
+	arg->ok = arg->ok && ufs_read(-1, buf, 1) == -1 &&
+		  ufs_errno() == UFS_ERR_NO_FILE;
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[16 * 256];
+	memset(buf, 'z', sizeof(buf));
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+
+	const int count = 8;
+	pthread_t threads[count];
+	struct thread_arg args[count];
+	for (int i = 0; i < count; ++i) {
+		args[i].id = i;
+		args[i].shared_fd = fd;
+		unit_fail_if(pthread_create(&threads[i], NULL, test_threads_f,
+					    &args[i]) != 0);
+	}
+	/* The error code is per thread. */
+	unit_fail_if(ufs_open("not existing", 0) != -1);
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && args[i].ok;
+	}
+	unit_check(ok, "threads work with own and shared files");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE,
+		   "error code is not affected by the other threads");
+
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		for (int j = 0; j < 10; ++j) {
+			sprintf(name, "thread%d_%d", i, j);
+			ufs_delete(name);
+		}
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_iovec(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct iovec in[] = {
+		{(void *)"123", 3},
+		{NULL, 0},
+		{(void *)"4567", 4},
+		{(void *)"89", 2},
+	};
+	unit_check(ufs_writev(fd, in, 4) == 9, "writev");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 9, "position is moved");
+	unit_check(ufs_writev(fd, in, 0) == 0, "writev nothing");
+	unit_check(ufs_writev(fd, in, -1) == -1, "writev negative count");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_writev(fd, in, UFS_IOV_MAX + 1) == -1,
+		   "writev count over UFS_IOV_MAX");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	char a[4], b[2], c[8];
+	struct iovec out[] = {{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+	unit_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_readv(fd, out, 3) == 9, "readv until the end");
+	unit_check(memcmp(a, "1234", 4) == 0 && memcmp(b, "56", 2) == 0 &&
+		   memcmp(c, "789", 3) == 0, "data is split correctly");
+	unit_check(ufs_readv(fd, out, 3) == 0, "readv at the end");
+	unit_check(ufs_readv(fd, out, -1) == -1, "readv negative count");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_readv(fd, out, UFS_IOV_MAX + 1) == -1,
+		   "readv count over UFS_IOV_MAX");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	in[0].iov_len = 100 * 1024 * 1024;
+	unit_check(ufs_writev(fd, in, 2) == -1,
+		   "writev over max file size");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == 9,
+		   "and nothing is written");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", UFS_READ_ONLY);
+	unit_check(ufs_writev(fd, in, 1) == -1, "no writev in read only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_read_view(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int size = 2000;
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, size) != size);
+	unit_fail_if(ufs_seek(fd, 100, UFS_SEEK_SET) != 100);
+
+	struct iovec iov[8];
+	int count = 8;
+	struct ufs_pin *pin;
+	unit_check(ufs_read_view(fd, 1500, iov, &count, &pin) == 1500,
+		   "read view");
+	unit_check(pin != NULL && count > 1, "it consists of several parts");
+	size_t pos = 100;
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		ok = ok && memcmp(iov[i].iov_base, buf + pos,
+				  iov[i].iov_len) == 0;
+		pos += iov[i].iov_len;
+	}
+	unit_check(ok && pos == 1600, "view has the file data");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 1600, "position is moved");
+
+	struct iovec one;
+	int one_count = 1;
+	struct ufs_pin *pin2;
+	unit_fail_if(ufs_seek(fd, 1000, UFS_SEEK_SET) != 1000);
+	ssize_t rc = ufs_read_view(fd, 1000, &one, &one_count, &pin2);
+	unit_check(rc > 0 && rc < 1000 && one_count == 1 &&
+		   one.iov_len == (size_t)rc,
+		   "view is limited by the iovec count");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 1000 + rc,
+		   "position is moved only by the viewed size");
+	ufs_pin_release(pin2);
+
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "new", 3) != 3);
+	pos = 100;
+	ok = true;
+	for (int i = 0; i < count; ++i) {
+		ok = ok && memcmp(iov[i].iov_base, buf + pos,
+				  iov[i].iov_len) == 0;
+		pos += iov[i].iov_len;
+	}
+	unit_check(ok, "view is valid after truncation, close and delete");
+	ufs_pin_release(pin);
+	ufs_pin_release(NULL);
+
+	count = 8;
+	unit_check(ufs_read_view(fd, 10, iov, &count, &pin) == 0 &&
+		   count == 0 && pin == NULL, "view at the end is empty");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(buf);
+
+	unit_test_finish();
+}
+
+static bool
+file_equals(const char *name, const char *data, int size)
+{
+	int fd = ufs_open(name, 0);
+	if (fd == -1)
+		return false;
+	char *buf = malloc(size + 1);
+	bool ok = ufs_read(fd, buf, size + 1) == size &&
+		  memcmp(buf, data, size) == 0;
+	free(buf);
+	ufs_close(fd);
+	return ok;
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("no file", "copy") == -1, "clone of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int size = 200 * 1024;
+	char *data = malloc(size);
+	char *data2 = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+	unit_check(file_equals("copy", data, size), "copy has the data");
+
+	int copy_fd = ufs_open("copy", 0);
+	unit_fail_if(copy_fd == -1);
+	unit_fail_if(ufs_pwrite(copy_fd, "XYZ", 3, 70000) != 3);
+	memcpy(data2, data, size);
+	memcpy(data2 + 70000, "XYZ", 3);
+	unit_check(file_equals("copy", data2, size), "copy is changed");
+	unit_check(file_equals("file", data, size), "original is not");
+	unit_fail_if(ufs_pwrite(fd, "123", 3, 100) != 3);
+	unit_check(file_equals("copy", data2, size), "copy is not affected "
+		   "by changes of the original");
+
+	unit_fail_if(ufs_seek(copy_fd, 0, UFS_SEEK_END) != size);
+	int small_fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(ufs_write(small_fd, "0123456789", 10) != 10);
+	unit_check(ufs_clone("small", "copy") == 0, "clone into existing file");
+	unit_check(ufs_seek(copy_fd, 0, UFS_SEEK_CUR) == 10,
+		   "its descriptors are moved to the new end");
+	unit_fail_if(ufs_resize(copy_fd, 1000) != 0);
+	unit_check(file_equals("small", "0123456789", 10),
+		   "growing the copy doesn't touch the original");
+	unit_fail_if(ufs_close(small_fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_check(ufs_pread(copy_fd, data2, 20, 0) == 20 &&
+		   memcmp(data2, "0123456789\0\0\0\0\0\0\0\0\0\0", 20) == 0,
+		   "copy lives after the original is deleted");
+
+	unit_fail_if(ufs_close(copy_fd) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(data2);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	int fd1 = ufs_open("file1", UFS_CREATE);
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, "first", 5) != 5);
+	unit_fail_if(ufs_write(fd2, "second", 6) != 6);
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	unit_check(snap != NULL, "create snapshot");
+
+	unit_fail_if(ufs_pwrite(fd1, "F", 1, 0) != 1);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	unit_check(ufs_snapshot_clone(snap, "file2", "restored2") == 0,
+		   "clone a deleted file from the snapshot");
+	unit_check(file_equals("restored2", "second", 6), "data is old");
+	unit_check(ufs_snapshot_clone(snap, "file1", "file1") == 0,
+		   "restore a changed file");
+	unit_check(file_equals("file1", "first", 5), "data is old");
+	unit_check(ufs_snapshot_clone(snap, "file3", "file3") == -1,
+		   "no such file in the snapshot");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	ufs_snapshot_delete(snap);
+	unit_check(file_equals("restored2", "second", 6),
+		   "clones live after the snapshot is deleted");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_delete("restored2") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	char path[64];
+	char journal_path[80];
+	snprintf(path, sizeof(path), "/tmp/ufs_test_image_%d", (int)getpid());
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+	unlink(path);
+	unlink(journal_path);
+	unit_check(ufs_checkpoint() == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "no image to checkpoint");
+	unit_check(ufs_image_open(path) == 0, "open a new image");
+	unit_check(ufs_image_open(path) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "only one image");
+
+	int size = 200 * 1024;
+	char *data = malloc(size);
+	char *data2 = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	memcpy(data2, data, size);
+	memcpy(data2 + 70000, "XYZ", 3);
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_clone("big", "copy") != 0);
+	fd = ufs_open("copy", 0);
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 70000) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	unit_fail_if(ufs_resize(fd, 5) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("gone", UFS_CREATE);
+	unit_fail_if(ufs_delete("gone") != 0);
+	unit_fail_if(ufs_write(fd, "lost", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	struct iovec empty = {.iov_base = NULL, .iov_len = 0};
+	fd = ufs_open("vec", UFS_CREATE);
+	unit_fail_if(ufs_writev(fd, &empty, -1) != -1);
+	unit_fail_if(ufs_writev(fd, &empty, 0) != 0);
+	unit_fail_if(ufs_writev(fd, &empty, 1) != 0);
+	unit_fail_if(ufs_write(fd, "after bad writev", 16) != 16);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_check(ufs_image_open(path) == 0, "replay the journal");
+	unit_check(file_equals("big", data, size), "file is restored");
+	unit_check(file_equals("copy", data2, size), "clone is restored");
+	unit_check(file_equals("small", "01234", 5), "resize is restored");
+	unit_check(ufs_open("gone", 0) == -1, "deleted file is not");
+	unit_check(file_equals("vec", "after bad writev", 16),
+		   "write after a bad writev is restored");
+
+	unit_check(ufs_checkpoint() == 0, "checkpoint");
+	struct stat st;
+	unit_check(stat(journal_path, &st) == 0 && st.st_size == 0,
+		   "journal is empty after it");
+	fd = ufs_open("big", 0);
+	unit_fail_if(ufs_pwrite(fd, "after", 5, 10) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	memcpy(data + 10, "after", 5);
+	ufs_destroy();
+
+	unit_check(ufs_image_open(path) == 0, "load the image and the journal");
+	unit_check(file_equals("big", data, size), "file has the new data");
+	unit_check(file_equals("copy", data2, size), "clone is loaded");
+	unit_check(file_equals("small", "01234", 5), "small file is loaded");
+	fd = ufs_open("copy", 0);
+	unit_fail_if(ufs_pwrite(fd, "123", 3, 0) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	memcpy(data2, "123", 3);
+	unit_check(file_equals("big", data, size),
+		   "change of a loaded clone doesn't affect the original");
+	unit_check(ufs_sync() == 0, "sync");
+	ufs_destroy();
+
+	FILE *f = fopen(journal_path, "a");
+	unit_fail_if(f == NULL);
+	fwrite("torn record", 1, 11, f);
+	fclose(f);
+	unit_check(ufs_image_open(path) == 0, "torn journal tail is dropped");
+	unit_check(file_equals("copy", data2, size), "records before it apply");
+	fd = ufs_open("small", 0);
+	unit_fail_if(ufs_write(fd, "ab", 2) != 2);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unit_fail_if(ufs_image_open(path) != 0);
+	unit_check(file_equals("small", "ab234", 5),
+		   "journal goes on after the cut");
+	ufs_destroy();
+
+	f = fopen(path, "r+");
+	unit_fail_if(f == NULL);
+	fwrite("X", 1, 1, f);
+	fclose(f);
+	unit_check(ufs_image_open(path) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "corrupted image is not loaded");
+	unit_check(ufs_open("big", 0) == -1, "nothing is loaded");
+
+	unlink(path);
+	unlink(journal_path);
+	free(data2);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_sparse(void)
+{
+	unit_test_start();
+
+	struct ufs_stats before, stats;
+	ufs_get_stats(&before);
+	int fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int size = 100 * 1024 * 1024;
+	unit_check(ufs_resize(fd, size) == 0, "resize to 100MB");
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count == before.block_count,
+		   "no blocks are allocated");
+	char buf[1000];
+	memset(buf, 'x', sizeof(buf));
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 50 * 1024 * 1024) ==
+		   sizeof(buf), "read from the hole");
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		ok = ok && buf[i] == 0;
+	unit_check(ok, "it is zeros");
+
+	int offset = 50 * 1024 * 1024 + 100;
+	unit_fail_if(ufs_pwrite(fd, "data", 4, offset) != 4);
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count == before.block_count + 1,
+		   "a write allocates one block");
+	unit_fail_if(ufs_pread(fd, buf, 8, offset - 2) != 8);
+	unit_check(memcmp(buf, "\0\0data\0\0", 8) == 0,
+		   "the data is among zeros");
+
+	unit_check(ufs_punch_hole(fd, offset + 1, 2) == 0,
+		   "punch a hole inside a block");
+	unit_fail_if(ufs_pread(fd, buf, 4, offset) != 4);
+	unit_check(memcmp(buf, "d\0\0a", 4) == 0, "only the range is zeroed");
+	unit_check(ufs_punch_hole(fd, offset - 100, 1024 * 1024) == 0,
+		   "punch a hole over the block");
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count == before.block_count,
+		   "the block is freed");
+	unit_fail_if(ufs_pread(fd, buf, 4, offset) != 4);
+	unit_check(memcmp(buf, "\0\0\0\0", 4) == 0, "it reads as zeros");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == size, "size is the same");
+	unit_check(ufs_punch_hole(fd, size, 10) == 0, "hole beyond the end");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == size, "doesn't grow");
+
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_pwrite(fd, "0123456789", 10, 0) != 10);
+	unit_fail_if(ufs_resize(fd, 4) != 0);
+	unit_fail_if(ufs_resize(fd, 8) != 0);
+	unit_check(file_equals("sparse", "0123\0\0\0\0", 8),
+		   "shrink and grow gives zeros");
+	unit_fail_if(ufs_clone("sparse", "sparse_copy") != 0);
+	unit_fail_if(ufs_punch_hole(fd, 0, 2) != 0);
+	unit_check(file_equals("sparse", "\0\0" "23\0\0\0\0", 8),
+		   "punch a hole into a shared block");
+	unit_check(file_equals("sparse_copy", "0123\0\0\0\0", 8),
+		   "the clone keeps the data");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("sparse", UFS_READ_ONLY);
+	unit_check(ufs_punch_hole(fd, 0, 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "read only descriptor");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+	unit_fail_if(ufs_delete("sparse_copy") != 0);
+
+	char path[64];
+	char journal_path[80];
+	snprintf(path, sizeof(path), "/tmp/ufs_test_sparse_%d", (int)getpid());
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+	unlink(path);
+	unlink(journal_path);
+	unit_fail_if(ufs_image_open(path) != 0);
+	fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(ufs_resize(fd, size) != 0);
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, 1000000) != 3);
+	unit_fail_if(ufs_pwrite(fd, "def", 3, 2000000) != 3);
+	unit_fail_if(ufs_punch_hole(fd, 1900000, 200000) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_clone("sparse", "sparse_copy") != 0);
+	fd = ufs_open("short", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "ab", 2) != 2);
+	unit_check(ufs_pwrite(fd, "", 0, 100) == 0,
+		   "empty write beyond the end");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 2,
+		   "it doesn't grow the file");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unit_fail_if(ufs_image_open(path) != 0);
+	unit_check(file_equals("short", "ab", 2),
+		   "the size is the same after the replay");
+	unit_fail_if(ufs_delete("short") != 0);
+	ufs_destroy();
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(ufs_image_open(path) != 0);
+		ufs_get_stats(&stats);
+		unit_check(stats.block_count == 1, i == 0 ?
+			   "journal replay keeps the holes" :
+			   "image keeps the holes");
+		fd = ufs_open("sparse_copy", 0);
+		unit_fail_if(ufs_pread(fd, buf, 4, 999999) != 4);
+		unit_check(memcmp(buf, "\0abc", 4) == 0, "data is restored");
+		unit_fail_if(ufs_pread(fd, buf, 4, 2000000) != 4);
+		unit_check(memcmp(buf, "\0\0\0\0", 4) == 0, "hole is restored");
+		unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == size,
+			   "size is restored");
+		unit_fail_if(ufs_close(fd) != 0);
+		if (i == 0)
+			unit_fail_if(ufs_checkpoint() != 0);
+		ufs_destroy();
+	}
+	unlink(path);
+	unlink(journal_path);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	ufs_dedup_enable(true);
+	struct ufs_stats before, stats;
+	ufs_get_stats(&before);
+	int size = 4 * 64 * 1024;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 23;
+	int fd1 = ufs_open("dedup1", UFS_CREATE);
+	int fd2 = ufs_open("dedup2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, data, size) != size);
+	ufs_get_stats(&stats);
+	size_t count = stats.block_count - before.block_count;
+	unit_fail_if(ufs_write(fd2, data, size) != size);
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count - before.block_count == count,
+		   "equal file takes no new blocks");
+	unit_check(stats.dedup_hit_count - before.dedup_hit_count >= 4,
+		   "its blocks are found");
+	unit_check(stats.shared_memory - before.shared_memory ==
+		   (size_t)size, "shared memory is reported");
+
+	unit_fail_if(ufs_pwrite(fd2, "XYZ", 3, 1000) != 3);
+	memcpy(data + 1000, "XYZ", 3);
+	unit_check(file_equals("dedup2", data, size), "write into a shared block");
+	memcpy(data + 1000, "bcd", 3);
+	unit_fail_if(ufs_pread(fd1, data + 1000, 3, 1000) != 3);
+	unit_check(file_equals("dedup1", data, size), "the other file is intact");
+	unit_fail_if(ufs_pwrite(fd2, data + 1000, 3, 1000) != 3);
+	unit_check(file_equals("dedup2", data, size), "restore the data");
+
+	char *zeros = calloc(1, size);
+	ufs_get_stats(&before);
+	unit_fail_if(ufs_pwrite(fd1, zeros, 64 * 1024, 64 * 1024) != 64 * 1024);
+	ufs_get_stats(&stats);
+	unit_check(stats.dedup_zero_count == before.dedup_zero_count + 1,
+		   "block of zeros is found");
+	memset(data + 64 * 1024, 0, 64 * 1024);
+	unit_check(file_equals("dedup1", data, size), "it reads as zeros");
+
+	int fd3 = ufs_open("dedup3", UFS_CREATE);
+	unit_fail_if(ufs_write(fd3, data, 1000) != 1000);
+	unit_fail_if(ufs_write(fd3, data + 1000, 24) != 24);
+	unit_fail_if(ufs_write(fd3, data, 512) != 512);
+	ufs_get_stats(&stats);
+	unit_check(stats.dedup_hit_count > before.dedup_hit_count,
+		   "small blocks filled by parts are found");
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_delete("dedup3") != 0);
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("dedup1") != 0);
+	unit_fail_if(ufs_delete("dedup2") != 0);
+	ufs_get_stats(&stats);
+	unit_check(stats.dedup_block_count == 0, "deleted blocks are forgotten");
+	ufs_dedup_enable(false);
+	free(zeros);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void *
+test_descriptors_f(void *data)
+{
+	int fd = *(int *)data;
+	char buf[8];
+	for (int i = 0; i < 100000; ++i) {
+		if (ufs_pread(fd, buf, 4, 0) != 4 || memcmp(buf, "data", 4) != 0)
+			return (void *)1;
+	}
+	return NULL;
+}
+
+static void
+test_descriptors(void)
+{
+	unit_test_start();
+
+	const int count = 50000;
+	int *fds = malloc(count * sizeof(*fds));
+	struct ufs_stats stats;
+	int fd = ufs_open("fds", UFS_CREATE);
+	unit_fail_if(fd != 1);
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if((fds[i] = ufs_open("fds", 0)) != i + 2);
+	unit_msg("descriptors are numbered densely");
+	ufs_get_stats(&stats);
+	unit_check(stats.fd_count == (size_t)count + 1 &&
+		   stats.fd_capacity >= stats.fd_count, "table has them all");
+	size_t capacity = stats.fd_capacity;
+
+	unit_fail_if(ufs_close(fds[100]) != 0);
+	unit_fail_if(ufs_close(fds[20000]) != 0);
+	unit_check(ufs_open("fds", 0) == fds[100], "lowest free fd is taken");
+	unit_check(ufs_open("fds", 0) == fds[20000], "then the next one");
+	unit_fail_if(ufs_close(fds[count - 1]) != 0);
+	unit_check(ufs_open("fds", 0) == fds[count - 1], "and the last one");
+
+	unit_msg("storm of opens and closes in the middle");
+	for (int i = 0; i < 100000; ++i) {
+		int j = (i * 7919) % count;
+		unit_fail_if(ufs_close(fds[j]) != 0);
+		unit_fail_if(ufs_open("fds", 0) != fds[j]);
+	}
+	ufs_get_stats(&stats);
+	unit_check(stats.fd_capacity == capacity, "table keeps its size");
+
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, test_descriptors_f, &fd) != 0);
+	for (int i = count - 1; i >= 0; --i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_open("fds", 0) != i + 2);
+	for (int i = count - 1; i >= 0; --i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < 4; ++i) {
+		void *rc;
+		pthread_join(threads[i], &rc);
+		is_ok = is_ok && rc == NULL;
+	}
+	unit_check(is_ok, "lookups in other threads survive the resizes");
+	ufs_get_stats(&stats);
+	unit_check(stats.fd_count == 1 && stats.fd_capacity <= 64,
+		   "table shrinks after mass close");
+	char buf[4];
+	unit_check(ufs_pread(fds[0], buf, 4, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "closed fd is invalid");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("fds") != 0);
+	free(fds);
+
+	unit_test_finish();
+}
+
+static void
+test_inline(void)
+{
+	unit_test_start();
+
+	struct ufs_stats before, stats;
+	ufs_get_stats(&before);
+	const int count = 1000;
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "tiny%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, strlen(name)) !=
+			     (ssize_t)strlen(name));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count == before.block_count,
+		   "small files take no blocks");
+	unit_check(file_equals("tiny7", "tiny7", 5), "their data is there");
+
+	int size = 1000;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("tiny1", 0);
+	unit_fail_if(ufs_pwrite(fd, data + 5, 95, 5) != 95);
+	memcpy(data, "tiny1", 5);
+	unit_check(file_equals("tiny1", data, 100), "write inside");
+	unit_fail_if(ufs_pwrite(fd, data + 100, size - 100, 100) !=
+		     size - 100);
+	unit_check(file_equals("tiny1", data, size), "grow out of inline");
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count > before.block_count,
+		   "big file takes blocks");
+	unit_fail_if(ufs_resize(fd, 50) != 0);
+	unit_check(file_equals("tiny1", data, 50), "shrink back");
+	ufs_get_stats(&stats);
+	unit_check(stats.block_count == before.block_count,
+		   "its blocks are freed");
+
+	struct iovec iov[4];
+	int iovcnt = 4;
+	struct ufs_pin *pin;
+	unit_fail_if(ufs_seek(fd, 10, UFS_SEEK_SET) != 10);
+	unit_check(ufs_read_view(fd, 100, iov, &iovcnt, &pin) == 40 &&
+		   iovcnt == 1 && iov[0].iov_len == 40, "read view");
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 10) != 3);
+	unit_check(memcmp(iov[0].iov_base, data + 10, 40) == 0,
+		   "view is not changed by a write");
+	ufs_pin_release(pin);
+
+	unit_fail_if(ufs_clone("tiny1", "tiny_copy") != 0);
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, 10) != 3);
+	memcpy(data + 10, "XYZ", 3);
+	unit_check(file_equals("tiny_copy", data, 50), "clone has a copy");
+	unit_fail_if(ufs_delete("tiny_copy") != 0);
+
+	unit_fail_if(ufs_resize(fd, 120) != 0);
+	memset(data + 50, 0, 70);
+	memcpy(data + 10, "abc", 3);
+	unit_check(file_equals("tiny1", data, 120), "grow with zeros");
+	unit_fail_if(ufs_punch_hole(fd, 0, 20) != 0);
+	memset(data, 0, 20);
+	unit_check(file_equals("tiny1", data, 120), "punch a hole");
+	unit_fail_if(ufs_pwrite(fd, "end", 3, 126) != 3);
+	memset(data + 120, 0, 6);
+	memcpy(data + 126, "end", 3);
+	unit_check(file_equals("tiny1", data, 129), "cross the border by 1");
+	unit_fail_if(ufs_resize(fd, 128) != 0);
+	unit_check(file_equals("tiny1", data, 128), "and back");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "tiny%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_ring(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_ring_create(0, 0) == NULL &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "ring can't be empty");
+	struct ufs_ring *ring = ufs_ring_create(6, 0);
+	unit_fail_if(ring == NULL);
+	struct ufs_cqe cqes[64];
+	struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+	sqe->op = UFS_OP_OPEN;
+	sqe->name = "ring";
+	sqe->flags = UFS_CREATE;
+	sqe->user_data = 1;
+	unit_check(ufs_ring_submit(ring) == 1, "submit an open");
+	unit_check(ufs_ring_reap(ring, cqes, 64, 1) == 1 &&
+		   cqes[0].user_data == 1 && cqes[0].res > 0, "file is opened");
+	int fd = cqes[0].res;
+
+	char data[4][8] = {"first", "second", "third", "fourth"};
+	char buf[4][8];
+	for (int i = 0; i < 4; ++i) {
+		sqe = ufs_ring_get_sqe(ring);
+		sqe->op = UFS_OP_PWRITE;
+		sqe->fd = fd;
+		sqe->buf = data[i];
+		sqe->size = 8;
+		sqe->offset = i * 8;
+		sqe->user_data = 10 + i;
+	}
+	sqe = ufs_ring_get_sqe(ring);
+	sqe->op = UFS_OP_PREAD;
+	sqe->fd = fd + 100;
+	sqe->buf = buf[0];
+	sqe->size = 8;
+	sqe->user_data = 20;
+	sqe = ufs_ring_get_sqe(ring);
+	sqe->op = 1000;
+	sqe->user_data = 21;
+	unit_check(ufs_ring_get_sqe(ring) != NULL &&
+		   ufs_ring_get_sqe(ring) != NULL, "size is a power of 2");
+	unit_check(ufs_ring_get_sqe(ring) == NULL, "ring is full");
+	unit_check(ufs_ring_submit(ring) == 8, "submit a batch");
+	unit_check(ufs_ring_get_sqe(ring) == NULL,
+		   "it is full until reaped");
+	unit_check(ufs_ring_reap(ring, cqes, 64, 0) == 8 &&
+		   cqes[7].res == 0, "reap it");
+	bool is_ok = true;
+	for (int i = 0; i < 4; ++i)
+		is_ok = is_ok && cqes[i].user_data == 10u + i && cqes[i].res == 8;
+	unit_check(is_ok, "writes are done in order");
+	unit_check(cqes[4].res == -1 && cqes[4].error == UFS_ERR_NO_FILE,
+		   "bad descriptor is reported");
+	unit_check(cqes[5].res == -1 && cqes[5].error == UFS_ERR_INVALID_ARG,
+		   "bad operation is reported");
+	for (int i = 0; i < 4; ++i) {
+		sqe = ufs_ring_get_sqe(ring);
+		sqe->op = UFS_OP_PREAD;
+		sqe->fd = fd;
+		sqe->buf = buf[i];
+		sqe->size = 8;
+		sqe->offset = (3 - i) * 8;
+	}
+	sqe = ufs_ring_get_sqe(ring);
+	sqe->op = UFS_OP_RESIZE;
+	sqe->fd = fd;
+	sqe->offset = 16;
+	ufs_ring_submit(ring);
+	unit_check(ufs_ring_reap(ring, cqes, 64, 5) == 5 && cqes[4].res == 0,
+		   "reads and a resize");
+	is_ok = true;
+	for (int i = 0; i < 4; ++i)
+		is_ok = is_ok && memcmp(buf[i], data[3 - i], 8) == 0;
+	unit_check(is_ok, "the data is read");
+	unit_check(file_equals("ring", (char *)data, 16), "file is resized");
+	ufs_ring_delete(ring);
+
+	unit_msg("ring with workers");
+	ring = ufs_ring_create(64, 4);
+	unit_fail_if(ring == NULL);
+	const int size = 1000;
+	char *src = malloc(size * 64);
+	char *dst = calloc(size, 64);
+	for (int i = 0; i < size * 64; ++i)
+		src[i] = 'a' + i % 26;
+	int done = 0;
+	for (int step = 0; step < 2; ++step) {
+		for (int i = 0; i < size; ) {
+			while (i < size && (sqe = ufs_ring_get_sqe(ring)) != NULL) {
+				sqe->op = step == 0 ? UFS_OP_PWRITE : UFS_OP_PREAD;
+				sqe->fd = fd;
+				sqe->buf = (step == 0 ? src : dst) + i * 64;
+				sqe->size = 64;
+				sqe->offset = i * 64;
+				++i;
+			}
+			ufs_ring_submit(ring);
+			int count = ufs_ring_reap(ring, cqes, 64, 1);
+			for (int j = 0; j < count; ++j)
+				done += cqes[j].res == 64;
+		}
+		int count;
+		while ((count = ufs_ring_reap(ring, cqes, 64, 64)) > 0) {
+			for (int j = 0; j < count; ++j)
+				done += cqes[j].res == 64;
+		}
+	}
+	unit_check(done == 2 * size, "all operations complete");
+	unit_check(memcmp(src, dst, size * 64) == 0, "data is written and read");
+	ufs_ring_delete(ring);
+	free(src);
+	free(dst);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("ring") != 0);
+
+	unit_test_finish();
+}
+
+/**
+ * Names of a directory listing, sorted and joined by spaces. A directory
+ * ends with a slash.
+ */
+static void
+dir_list(const char *path, char *out, size_t size)
+{
+	struct ufs_dir *dir = ufs_opendir(path);
+	if (dir == NULL) {
+		snprintf(out, size, "error %d", (int)ufs_errno());
+		return;
+	}
+	const struct ufs_dirent *entries[64];
+	int count = 0;
+	while (count < 64 && (entries[count] = ufs_readdir(dir)) != NULL)
+		++count;
+	for (int i = 1; i < count; ++i) {
+		for (int j = i; j > 0 && strcmp(entries[j - 1]->name,
+						 entries[j]->name) > 0; --j) {
+			const struct ufs_dirent *tmp = entries[j];
+			entries[j] = entries[j - 1];
+			entries[j - 1] = tmp;
+		}
+	}
+	size_t len = 0;
+	out[0] = 0;
+	for (int i = 0; i < count && len < size; ++i) {
+		len += snprintf(out + len, size - len, "%s%s%s",
+				i == 0 ? "" : " ", entries[i]->name,
+				entries[i]->is_dir ? "/" : "");
+	}
+	ufs_closedir(dir);
+}
+
+static void *
+test_dirs_f(void *data)
+{
+	struct thread_arg *arg = data;
+	char name[32];
+	arg->ok = true;
+	for (int i = 0; i < 300 && arg->ok; ++i) {
+		/* The last ones are f3, f4, f5 and f6. */
+		sprintf(name, "t/%d_f%d", arg->id, i % 7);
+		int fd = ufs_open(name, UFS_CREATE);
+		arg->ok = fd != -1 && ufs_write(fd, name, 4) == 4 &&
+			  ufs_close(fd) == 0;
+		if (i % 7 < 3)
+			arg->ok = arg->ok && ufs_delete(name) == 0;
+	}
+	return NULL;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	char list[256];
+	unit_check(ufs_mkdir("d") == 0, "mkdir");
+	unit_check(ufs_mkdir("d") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir of an existing directory");
+	unit_check(ufs_mkdir("x/y") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "mkdir without a parent");
+	unit_check(ufs_mkdir("d/") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "empty name in a path");
+	unit_check(ufs_mkdir("d/e") == 0, "mkdir in a directory");
+	int fd = ufs_open("d/f", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a directory");
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_check(ufs_open("x/f", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no file without a parent");
+	unit_check(ufs_open("d/e", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "no file with a dir path");
+	unit_check(ufs_mkdir("d/f") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "no dir with a file path");
+	unit_check(ufs_open("d", 0) == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "a directory is not opened as a file");
+
+	dir_list("d", list, sizeof(list));
+	unit_check(strcmp(list, "e/ f") == 0, "readdir");
+	dir_list("d/e", list, sizeof(list));
+	unit_check(strcmp(list, "") == 0, "empty directory");
+	dir_list("d/f", list, sizeof(list));
+	unit_check(strcmp(list, "error 1") == 0, "no listing of a file");
+	unit_fail_if(ufs_open("top", UFS_CREATE) == -1);
+	dir_list("", list, sizeof(list));
+	unit_check(strcmp(list, "d/ top") == 0, "root has the flat names");
+	unit_fail_if(ufs_delete("top") != 0);
+
+	unit_check(ufs_rmdir("d") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "rmdir of a non-empty directory");
+	unit_check(ufs_rmdir("") == -1 && ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "root is not deleted");
+
+	/* File rename keeps the data and the descriptors. */
+	unit_check(ufs_rename("d/f", "d/e/g") == 0, "rename a file");
+	unit_check(ufs_open("d/f", 0) == -1, "old path is free");
+	unit_check(file_equals("d/e/g", "data", 4), "new path has the data");
+	unit_fail_if(ufs_pwrite(fd, "DATA", 4, 0) != 4);
+	unit_check(file_equals("d/e/g", "DATA", 4), "descriptor follows it");
+	int fd2 = ufs_open("d/h", UFS_CREATE);
+	unit_fail_if(ufs_write(fd2, "old", 3) != 3);
+	unit_check(ufs_rename("d/e/g", "d/h") == 0, "rename over a file");
+	unit_check(file_equals("d/h", "DATA", 4), "it is replaced");
+	char buf[8];
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == 3 &&
+		   memcmp(buf, "old", 3) == 0, "replaced file stays opened");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_rename("d/h", "d/e") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "file doesn't replace a dir");
+	unit_check(ufs_rename("nothing", "d/z") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "rename of nothing");
+
+	/* Directory rename moves all its content. */
+	unit_fail_if(ufs_mkdir("d/e/s") != 0);
+	unit_fail_if(ufs_open("d/e/s/deep", UFS_CREATE) == -1);
+	unit_check(ufs_rename("d", "d/e/s/d") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "no move inside itself");
+	unit_fail_if(ufs_mkdir("n") != 0);
+	unit_check(ufs_rename("d", "n/m") == 0, "rename a directory");
+	dir_list("", list, sizeof(list));
+	unit_check(strcmp(list, "n/") == 0, "root has the new one");
+	dir_list("n/m", list, sizeof(list));
+	unit_check(strcmp(list, "e/ h") == 0, "content is moved");
+	unit_check(ufs_open("d/e/s/deep", 0) == -1, "old paths are free");
+	unit_check(ufs_open("n/m/e/s/deep", 0) != -1, "new paths are found");
+	unit_check(file_equals("n/m/h", "DATA", 4), "data is kept");
+	unit_check(ufs_pwrite(fd, "Data", 4, 0) == 4 &&
+		   file_equals("n/m/h", "Data", 4), "descriptor is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_mkdir("d") == 0, "old directory path is free");
+	unit_check(ufs_rename("n/m", "d") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "dir doesn't replace a dir");
+	unit_check(ufs_rmdir("d") == 0, "rmdir");
+	unit_check(ufs_opendir("d") == NULL &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "it is gone");
+
+	/* Creations and deletions in one directory race with renames. */
+	unit_fail_if(ufs_mkdir("t") != 0);
+	const int count = 4;
+	pthread_t threads[count];
+	struct thread_arg args[count];
+	for (int i = 0; i < count; ++i) {
+		args[i].id = i;
+		unit_fail_if(pthread_create(&threads[i], NULL, test_dirs_f,
+					    &args[i]) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < 200; ++i) {
+		ok = ok && ufs_rename(i % 2 == 0 ? "n" : "n2",
+				      i % 2 == 0 ? "n2" : "n") == 0;
+		dir_list("t", list, sizeof(list));
+		ok = ok && strncmp(list, "error", 5) != 0;
+	}
+	for (int i = 0; i < count; ++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && args[i].ok;
+	}
+	unit_check(ok, "threads create files while dirs are renamed");
+	dir_list("t", list, sizeof(list));
+	unit_check(strcmp(list, "0_f3 0_f4 0_f5 0_f6 1_f3 1_f4 1_f5 1_f6 "
+		   "2_f3 2_f4 2_f5 2_f6 3_f3 3_f4 3_f5 3_f6") == 0,
+		   "listing is consistent");
+
+	/* The tree is saved in the journal and in the image. */
+	char path[64];
+	char journal_path[80];
+	snprintf(path, sizeof(path), "/tmp/ufs_test_dirs_%d", (int)getpid());
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+	unlink(path);
+	unlink(journal_path);
+	ufs_destroy();
+	unit_fail_if(ufs_image_open(path) != 0);
+	unit_fail_if(ufs_mkdir("a") != 0 || ufs_mkdir("a/b") != 0 ||
+		     ufs_mkdir("a/empty") != 0 || ufs_mkdir("gone") != 0);
+	fd = ufs_open("a/b/f", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "file", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("a/g", UFS_CREATE);
+	unit_fail_if(ufs_rename("a/b/f", "a/g") != 0);
+	unit_fail_if(ufs_write(fd, "lost", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_rmdir("gone") != 0);
+	unit_fail_if(ufs_rename("a", "c") != 0);
+	ufs_destroy();
+	for (int i = 0; i < 2; ++i) {
+		unit_check(ufs_image_open(path) == 0, i == 0 ?
+			   "replay the tree changes" : "load the tree");
+		dir_list("", list, sizeof(list));
+		unit_check(strcmp(list, "c/") == 0, "root is restored");
+		dir_list("c", list, sizeof(list));
+		unit_check(strcmp(list, "b/ empty/ g") == 0,
+			   "directory is restored");
+		unit_check(file_equals("c/g", "file", 4),
+			   "renamed file is restored");
+		if (i == 0)
+			unit_fail_if(ufs_checkpoint() != 0);
+		ufs_destroy();
+	}
+	unlink(path);
+	unlink(journal_path);
+
+	unit_test_finish();
+}
+
 static void
 test_max_file_size(void)
 {
@@ -451,6 +1729,21 @@ main(void)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_many_files();
+	test_random_access();
+	test_block_size_change();
+	test_iovec();
+	test_read_view();
+	test_clone();
+	test_snapshot();
+	test_image();
+	test_sparse();
+	test_dedup();
+	test_descriptors();
+	test_inline();
+	test_ring();
+	test_dirs();
+	test_threads();
 	test_max_file_size();
 	test_rights();
 	test_resize();
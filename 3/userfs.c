@@ -1,580 +1,4091 @@
 #include "userfs.h"
+#include "journal.h"
+#include "slab.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 enum {
-	BLOCK_SIZE = 512,
+	/** Blocks of the small files, so as they don't waste much memory. */
+	SMALL_BLOCK_SHIFT = 9,
+	/**
+	 * Blocks of the files bigger than one such block. Big files take less
+	 * blocks, and are copied by bigger parts.
+	 */
+	LARGE_BLOCK_SHIFT = 16,
+	LARGE_BLOCK_SIZE = 1 << LARGE_BLOCK_SHIFT,
+	/** Files up to this size keep the data in struct file, without blocks. */
+	FILE_INLINE_SIZE = 128,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
-
-struct block {
-	/** Block memory. */
-	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
-	/* PUT HERE OTHER MEMBERS */
+struct dedup_entry {
+	uint64_t hash;
+	char *block;
 };
 
-static struct block *
-ufs_add_block(struct block *last_block)
-{
-    struct block *new_block = (struct block *) malloc(sizeof(struct block));
-    if (new_block == NULL)
-	{
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return NULL;
-    }
-    new_block->prev = NULL;
-    new_block->next = NULL;
-	new_block->occupied = 0;
-    new_block->memory = (char *) malloc(sizeof(char) * BLOCK_SIZE);
-    if (new_block->memory == NULL)
-	{
-        free(new_block);
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return NULL;
-    }
+/**
+ * Index of the blocks of one size by their content, for the deduplication.
+ * An open addressing hash table with linear probing, empty slots have NULL
+ * blocks. The blocks in it are marked in the allocator and are never
+ * changed: a write into one copies it, like a shared block.
+ *
+ * The index doesn't reference the blocks. The last reference to a marked
+ * block is dropped under the index lock, which removes the block from here,
+ * so a lookup can't find a block being freed.
+ */
+struct dedup_index {
+	pthread_mutex_t lock;
+	struct dedup_entry *entries;
+	size_t capacity;
+	size_t count;
+	/** Written blocks replaced with equal ones from the index. */
+	size_t hit_count;
+	/** Written blocks of zeros replaced with holes. */
+	size_t zero_count;
+};
 
-    if (last_block != NULL)
-	{
-        new_block->prev = last_block;
-        last_block->next = new_block;
-    }
+/** Allocator of the file blocks of one size, shared by all the threads. */
+struct block_allocator {
+	struct slab slab;
+	pthread_mutex_t lock;
+	struct dedup_index dedup;
+};
 
-    return new_block;
-}
+static struct block_allocator small_blocks = {
+	.slab = {.block_size = 1 << SMALL_BLOCK_SHIFT},
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.dedup = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+static struct block_allocator large_blocks = {
+	.slab = {.block_size = LARGE_BLOCK_SIZE},
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.dedup = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
 
-static void
-ufs_delete_blocks(struct block *start_block)
-{
-	struct block *current_block = start_block;
-	struct block *next_block = NULL;
-	while (current_block != NULL)
-	{
-		next_block = current_block->next;
-		free(current_block->memory);
-		free(current_block);
-		current_block = next_block;
-	}
-}
+/** Whether the written blocks are deduplicated, see ufs_dedup_enable(). */
+static atomic_bool dedup_is_enabled;
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Array of the file blocks, the block i keeps the bytes
+	 * [i * block size, (i + 1) * block size). So any offset is found
+	 * without walking the blocks before it. There are exactly as many
+	 * blocks as needed for the file size. The bytes of the last block
+	 * after the file end are garbage.
+	 *
+	 * A NULL block is a hole, its bytes are zeros. The blocks are
+	 * allocated on the first write into them, so a file grown by a
+	 * resize takes no memory until it is written.
+	 *
+	 * The blocks are reference counted, and can be shared with clones of
+	 * the file, snapshots and read views. A shared block is copied on its
+	 * first change.
+	 *
+	 * An inline file has no blocks, see inline_data.
+	 */
+	char **blocks;
+	size_t block_count;
+	size_t block_capacity;
+	/**
+	 * Log2 of the block size. A file starts with small blocks and
+	 * switches to large ones when it grows bigger than a large block.
+	 */
+	int block_shift;
+	/**
+	 * Readers of the file share the lock, so as they work in parallel.
+	 * Writes and resizes take it exclusively.
+	 */
+	pthread_rwlock_t lock;
+	/**
+	 * How many file descriptors are opened on the file. Protected by the
+	 * lock of the index shard of the file name.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
+	/** Full path of the file. */
 	char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *next;
-	struct file *prev;
 
-	size_t occupied;
+	/** File size in bytes. */
+	size_t size;
 	bool marked_as_deleted;
+	/**
+	 * Hash of the name, to not compare the names in the index. It is
+	 * changed by a rename under the locks of the old and the new shards,
+	 * so it is atomic to find the shard without a lock.
+	 */
+	_Atomic uint32_t name_hash;
+	/**
+	 * Directory of the file and the links in its list, protected by the
+	 * tree lock. NULL for a deleted file and for a snapshot copy.
+	 */
+	struct dir *parent;
+	struct file *dir_prev;
+	struct file *dir_next;
+	/**
+	 * Unique number of the file. The journal records refer to the files
+	 * by it, because a name can be deleted and taken by a new file.
+	 */
+	uint64_t id;
+	/**
+	 * A file of up to FILE_INLINE_SIZE bytes is inline: its data is
+	 * here, the bytes after the file end are garbage. Most files are
+	 * small, and so they need neither a block nor the block array. The
+	 * data is moved into the blocks when the file grows bigger, and back
+	 * when it shrinks. Inline data is never shared, a clone copies it.
+	 */
+	bool is_inline;
+	char inline_data[FILE_INLINE_SIZE];
 	/* PUT HERE OTHER MEMBERS */
 };
 
+/**
+ * Bytes of a hole, for the callers which need the memory of a block. It is
+ * never written, so it takes no memory until read.
+ */
+static const char zero_block[LARGE_BLOCK_SIZE];
 
-
-/** List of all files. */
-static struct file *file_list = NULL;
-static struct file *last_file = NULL;
-
-enum ufs_error_code
-ufs_errno()
+static struct block_allocator *
+ufs_block_allocator(int block_shift)
 {
-	return ufs_error_code;
+	return block_shift == LARGE_BLOCK_SHIFT ? &large_blocks : &small_blocks;
 }
 
-struct file*
-ufs_find_file(const char *filename)
+static char *
+ufs_block_alloc(int block_shift)
 {
-	struct file* current_file = file_list;
+	struct block_allocator *a = ufs_block_allocator(block_shift);
+	pthread_mutex_lock(&a->lock);
+	char *block = slab_alloc(&a->slab);
+	pthread_mutex_unlock(&a->lock);
+	return block;
+}
 
-	while (current_file != NULL)
+/**
+ * Hash of a block content for the dedup index. Four independent lanes mix 8
+ * bytes each per step, so as their multiplications run in parallel. The
+ * size is a multiple of 32.
+ */
+static uint64_t
+ufs_block_hash(const char *block, size_t size)
+{
+	uint64_t lanes[4] = {1, 2, 3, 4};
+	for (size_t pos = 0; pos < size; pos += sizeof(lanes))
 	{
-		if (strcmp(current_file->name, filename) == 0 && !current_file->marked_as_deleted)
+		for (int i = 0; i < 4; i++)
 		{
-			return current_file;
+			uint64_t word;
+			memcpy(&word, block + pos + i * sizeof(word), sizeof(word));
+			lanes[i] = (lanes[i] ^ word) * 0x9e3779b97f4a7c15ull;
+			lanes[i] ^= lanes[i] >> 29;
 		}
-		current_file = current_file->next;
 	}
-	return NULL;
+	uint64_t hash = size;
+	for (int i = 0; i < 4; i++)
+	{
+		hash = (hash ^ lanes[i]) * 0xff51afd7ed558ccdull;
+		hash ^= hash >> 32;
+	}
+	return hash;
 }
 
-struct file*
-ufs_create_file(const char* filename)
+static int
+ufs_dedup_grow(struct dedup_index *d)
 {
-	struct file *new_file = (struct file*)malloc(sizeof(struct file));
-    if (new_file == NULL)
-	{
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return NULL;
-    }
-	new_file->refs = 0;
-	new_file->occupied = 0;
-	new_file->marked_as_deleted = false;
-
-	new_file->prev = last_file;
-	new_file->next = NULL;
-	if (file_list == NULL)
-	{
-		file_list = new_file;
-	}
-	if (last_file != NULL)
-	{
-		last_file->next = new_file;
-	}
-	last_file = new_file;
-	
-	new_file->block_list = ufs_add_block(NULL);
-	if (new_file->block_list == NULL)
+	size_t capacity = d->capacity == 0 ? 1024 : d->capacity * 2;
+	struct dedup_entry *entries = calloc(capacity, sizeof(*entries));
+	if (entries == NULL)
+		return -1;
+	for (size_t i = 0; i < d->capacity; i++)
 	{
-        ufs_error_code = UFS_ERR_NO_MEM;
-		free(new_file);
-        return NULL;
+		if (d->entries[i].block == NULL)
+			continue;
+		size_t j = d->entries[i].hash & (capacity - 1);
+		while (entries[j].block != NULL)
+			j = (j + 1) & (capacity - 1);
+		entries[j] = d->entries[i];
 	}
-	new_file->last_block = new_file->block_list;
-
-    new_file->name = (char *)malloc(sizeof(char) * strlen(filename));
-    if (new_file->name == NULL)
-	{
-        ufs_error_code = UFS_ERR_NO_MEM;
-		free(new_file->block_list);
-        free(new_file);
-        return NULL;
-    }
-	strcpy(new_file->name, filename);
-
-	return new_file;
+	free(d->entries);
+	d->entries = entries;
+	d->capacity = capacity;
+	return 0;
 }
 
-void ufs_delete_file(struct file* file_to_delete)
+/**
+ * Find a block equal to @a block in the index and reference it, or add
+ * @a block into the index. The index lock should be taken.
+ * @retval NULL The block is added, or is kept as is when there is no memory
+ *     for the index.
+ * @retval not NULL The equal block.
+ */
+static char *
+ufs_dedup_find_or_add(struct dedup_index *d, char *block, uint64_t hash, size_t block_size)
 {
-    ufs_delete_blocks(file_to_delete->block_list);
-    free(file_to_delete->name);
-
-    if (file_to_delete->prev != NULL)
+	if ((d->count + 1) * 4 > d->capacity * 3 && ufs_dedup_grow(d) != 0)
+		return NULL;
+	size_t mask = d->capacity - 1;
+	size_t i = hash & mask;
+	for (; d->entries[i].block != NULL; i = (i + 1) & mask)
 	{
-		file_to_delete->prev->next = file_to_delete->next;
+		struct dedup_entry *e = &d->entries[i];
+		if (e->hash == hash && memcmp(e->block, block, block_size) == 0)
+		{
+			slab_ref(e->block);
+			d->hit_count++;
+			return e->block;
+		}
 	}
-    if (file_to_delete->next != NULL) {
-        file_to_delete->next->prev = file_to_delete->prev;
-    }  
-
-    if (file_list == file_to_delete)
-        file_list = file_to_delete->next;
-
-    if (last_file == file_to_delete) {
-        last_file = file_to_delete->prev;
-    }
-
-    free(file_to_delete);
+	d->entries[i].hash = hash;
+	d->entries[i].block = block;
+	d->count++;
+	slab_mark(block);
+	return NULL;
 }
 
-struct filedesc {
-	struct file *file;
-	struct block* current_block;
-	enum open_flags mode;
-	int current_block_offset;
-};
-
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * Remove the block from the index, shifting the next entries of the probe
+ * chain back like ufs_index_remove() does. The index lock should be taken.
  */
-static struct filedesc **file_descriptors = NULL;
-static int file_descriptors_count = 0;
-static int file_descriptors_capacity = 0;
-
-int
-ufs_create_file_descriptor(struct file *current_file, enum open_flags fd_flag)
+static void
+ufs_dedup_remove(struct dedup_index *d, const char *block, size_t block_size)
 {
-	struct filedesc* file_descriptor = (struct filedesc*)malloc(sizeof(struct filedesc));
-	if (file_descriptor == NULL)
+	size_t mask = d->capacity - 1;
+	size_t i = ufs_block_hash(block, block_size) & mask;
+	while (d->entries[i].block != block)
+		i = (i + 1) & mask;
+	size_t j = i;
+	while (true)
 	{
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return -1;
-    }
-	file_descriptor->file = current_file;
-	file_descriptor->current_block = current_file->block_list;
-	file_descriptor->mode = fd_flag;
-	file_descriptor->current_block_offset = 0;
+		j = (j + 1) & mask;
+		struct dedup_entry *e = &d->entries[j];
+		if (e->block == NULL)
+			break;
+		size_t home = e->hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+		d->entries[i] = *e;
+		i = j;
+	}
+	d->entries[i].block = NULL;
+	d->count--;
+}
 
-	current_file->refs++;
+/**
+ * Drop a reference to the block, and free it if it was the last one. A hole
+ * is skipped.
+ */
+static void
+ufs_block_unref(int block_shift, char *block)
+{
+	if (block == NULL)
+		return;
+	struct block_allocator *a = ufs_block_allocator(block_shift);
+	/*
+	 * Only the owner of the only reference marks a block, so the mark
+	 * can't appear while the reference is dropped here.
+	 */
+	bool is_marked = slab_is_marked(block);
+	if (is_marked)
+		pthread_mutex_lock(&a->dedup.lock);
+	bool is_last = slab_unref(block);
+	if (is_marked && is_last)
+		ufs_dedup_remove(&a->dedup, block, a->slab.block_size);
+	if (is_marked)
+		pthread_mutex_unlock(&a->dedup.lock);
+	if (!is_last)
+		return;
+	pthread_mutex_lock(&a->lock);
+	slab_free(&a->slab, block);
+	pthread_mutex_unlock(&a->lock);
+}
 
-	if (file_descriptors == NULL)
+/** Make the file have exactly @a block_count blocks. New blocks are holes. */
+static int
+ufs_file_set_block_count(struct file *file, size_t block_count)
+{
+	while (file->block_count > block_count)
+		ufs_block_unref(file->block_shift, file->blocks[--file->block_count]);
+	if (block_count > file->block_capacity)
 	{
-		file_descriptors = (struct filedesc **)malloc(sizeof(struct filedesc*) * 20);
-		if (file_descriptors == NULL)
+		size_t new_capacity = file->block_capacity == 0 ? 8 : file->block_capacity * 2;
+		if (new_capacity < block_count)
+			new_capacity = block_count;
+		char **new_blocks = realloc(file->blocks, new_capacity * sizeof(*new_blocks));
+		if (new_blocks == NULL)
 		{
 			ufs_error_code = UFS_ERR_NO_MEM;
-			free(file_descriptor);
 			return -1;
 		}
-		file_descriptors_capacity = 20;
+		file->blocks = new_blocks;
+		file->block_capacity = new_capacity;
+	}
+	while (file->block_count < block_count)
+		file->blocks[file->block_count++] = NULL;
+	return 0;
+}
+
+/**
+ * Move the file content into blocks of another size. The holes stay holes
+ * where the new block is not written at all. The file is not changed on
+ * failure.
+ */
+static int
+ufs_file_set_block_shift(struct file *file, int block_shift)
+{
+	size_t block_size = (size_t)1 << block_shift;
+	size_t block_count = (file->size + block_size - 1) >> block_shift;
+	char **blocks = calloc(block_count + 1, sizeof(*blocks));
+	if (blocks == NULL)
+		return -1;
+	size_t old_block_size = (size_t)1 << file->block_shift;
+	size_t pos = 0;
+	while (pos < file->size)
+	{
+		size_t old_offset = pos & (old_block_size - 1);
+		size_t new_offset = pos & (block_size - 1);
+		size_t part = file->size - pos;
+		if (part > old_block_size - old_offset)
+			part = old_block_size - old_offset;
+		if (part > block_size - new_offset)
+			part = block_size - new_offset;
+		const char *src = file->blocks[pos >> file->block_shift];
+		char **dst = &blocks[pos >> block_shift];
+		pos += part;
+		if (src == NULL)
+			continue;
+		if (*dst == NULL)
+		{
+			*dst = ufs_block_alloc(block_shift);
+			if (*dst == NULL)
+			{
+				for (size_t i = 0; i < block_count; ++i)
+					ufs_block_unref(block_shift, blocks[i]);
+				free(blocks);
+				return -1;
+			}
+			/* The parts of the holes are not copied. */
+			memset(*dst, 0, block_size);
+		}
+		memcpy(*dst + new_offset, src + old_offset, part);
 	}
-	if (file_descriptors_count == file_descriptors_capacity)
+	ufs_file_set_block_count(file, 0);
+	free(file->blocks);
+	file->blocks = blocks;
+	file->block_count = block_count;
+	file->block_capacity = block_count + 1;
+	file->block_shift = block_shift;
+	return 0;
+}
+
+/**
+ * Make the blocks of the bytes [offset, offset + size) owned only by this
+ * file, so as they can be changed. The shared and the deduplicated ones
+ * are replaced with copies, the holes get zeroed blocks. The bytes beyond the last block are
+ * skipped.
+ */
+static int
+ufs_file_unshare(struct file *file, size_t offset, size_t size)
+{
+	size_t block_size = (size_t)1 << file->block_shift;
+	size_t end = (offset + size - 1) >> file->block_shift;
+	if (size == 0 || offset >= file->block_count << file->block_shift)
+		return 0;
+	if (end >= file->block_count)
+		end = file->block_count - 1;
+	for (size_t i = offset >> file->block_shift; i <= end; i++)
 	{
-		struct filedesc **new_file_descriptors = (struct filedesc **)malloc(sizeof(struct filedesc*) * file_descriptors_capacity * 2);
-		if (new_file_descriptors == NULL)
+		char *block = file->blocks[i];
+		/*
+		 * The references are added only under the file lock, which is
+		 * taken exclusively for changes. So a block owned only by this
+		 * file stays so.
+		 */
+		if (block != NULL && slab_refs(block) == 1 && !slab_is_marked(block))
+			continue;
+		char *copy = ufs_block_alloc(file->block_shift);
+		if (copy == NULL)
 		{
 			ufs_error_code = UFS_ERR_NO_MEM;
-			free(file_descriptor);
 			return -1;
 		}
-		file_descriptors_capacity *= 2;
-		memcpy(new_file_descriptors, file_descriptors, sizeof(struct filedesc*) * file_descriptors_count);
-		free(file_descriptors);
-		file_descriptors = new_file_descriptors;
+		memcpy(copy, block != NULL ? block : zero_block, block_size);
+		file->blocks[i] = copy;
+		ufs_block_unref(file->block_shift, block);
+	}
+	return 0;
+}
 
-		
-		file_descriptors[file_descriptors_count] = file_descriptor;
-		file_descriptors_count++;
-		return file_descriptors_count;
+/**
+ * Fill the bytes [offset, offset + size) of one block with zeros. A hole is
+ * zeros already, a shared block is copied.
+ */
+static int
+ufs_file_zero(struct file *file, size_t offset, size_t size)
+{
+	if (file->is_inline)
+	{
+		memset(file->inline_data + offset, 0, size);
+		return 0;
 	}
+	char *block = file->blocks[offset >> file->block_shift];
+	if (block == NULL)
+		return 0;
+	if (ufs_file_unshare(file, offset, size) != 0)
+		return -1;
+	block = file->blocks[offset >> file->block_shift];
+	memset(block + (offset & (((size_t)1 << file->block_shift) - 1)), 0, size);
+	return 0;
+}
 
-	for (int i = 0; i < file_descriptors_capacity; i++)
+/**
+ * Move the data of an inline file into a block. Zeros stay a hole. The
+ * file is not changed on failure.
+ */
+static int
+ufs_file_uninline(struct file *file)
+{
+	char *block = NULL;
+	if (memcmp(file->inline_data, zero_block, file->size) != 0)
 	{
-		if (file_descriptors[i] == NULL)
+		block = ufs_block_alloc(SMALL_BLOCK_SHIFT);
+		if (block == NULL)
 		{
-			file_descriptors[i] = file_descriptor;
-			file_descriptors_count++;
-			return i + 1;
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
 		}
+		memcpy(block, file->inline_data, file->size);
 	}
-	
-	return -1;
+	file->block_shift = SMALL_BLOCK_SHIFT;
+	if (ufs_file_set_block_count(file, file->size == 0 ? 0 : 1) != 0)
+	{
+		ufs_block_unref(SMALL_BLOCK_SHIFT, block);
+		return -1;
+	}
+	if (file->block_count != 0)
+		file->blocks[0] = block;
+	file->is_inline = false;
+	return 0;
 }
 
-struct file*
-ufs_delete_file_descriptor(int fd)
+/** Move the data of a file small enough to be inline out of its blocks. */
+static void
+ufs_file_inline(struct file *file)
 {
-	int index = fd - 1;
-    struct filedesc * file_descriptor = file_descriptors[index];
-    file_descriptors[index] = NULL;
-
-    struct file* file = file_descriptor->file;
-    file->refs--;
-    free(file_descriptor);
-    file_descriptors_count--;
-
-	return file;
+	/* The data fits into the first block. */
+	const char *block = file->block_count == 0 ? NULL : file->blocks[0];
+	memcpy(file->inline_data, block != NULL ? block : zero_block, file->size);
+	ufs_file_set_block_count(file, 0);
+	free(file->blocks);
+	file->blocks = NULL;
+	file->block_capacity = 0;
+	file->block_shift = SMALL_BLOCK_SHIFT;
+	file->is_inline = true;
 }
 
-
-int
-ufs_open(const char *filename, int flags)
+/**
+ * Change the size of a file which is not inline. The new bytes are holes,
+ * only the garbage after the end in the last block is zeroed. The file
+ * becomes inline when it is small enough.
+ */
+static int
+ufs_file_resize_blocks(struct file *file, size_t new_size)
 {
-	struct file* current_file = ufs_find_file(filename);
-	enum open_flags fd_flag = flags;
-	if (!(flags == UFS_READ_ONLY || flags == UFS_WRITE_ONLY))
+	if (file->block_shift == SMALL_BLOCK_SHIFT && new_size > LARGE_BLOCK_SIZE &&
+	    ufs_file_set_block_shift(file, LARGE_BLOCK_SHIFT) != 0)
 	{
-		fd_flag = UFS_READ_WRITE;
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
 	}
-	if (current_file == NULL)
+	size_t block_size = (size_t)1 << file->block_shift;
+	size_t tail = file->size & (block_size - 1);
+	if (new_size > file->size && tail != 0)
 	{
-		if (flags == UFS_CREATE)
-		{
-			current_file = ufs_create_file(filename);
-		}
-		else
-		{
-			ufs_error_code = UFS_ERR_NO_FILE;
+		size_t size = block_size - tail;
+		if (size > new_size - file->size)
+			size = new_size - file->size;
+		if (ufs_file_zero(file, file->size, size) != 0)
 			return -1;
-		}
 	}
-	return ufs_create_file_descriptor(current_file, fd_flag);
+	size_t block_count = (new_size + block_size - 1) >> file->block_shift;
+	if (ufs_file_set_block_count(file, block_count) != 0)
+		return -1;
+	file->size = new_size;
+	if (new_size <= FILE_INLINE_SIZE)
+	{
+		ufs_file_inline(file);
+		return 0;
+	}
+	/*
+	 * Go back to the small blocks only when the file is much smaller than
+	 * a large block, to not move the data back and forth on each resize
+	 * around the border. A failure is fine, the large blocks still work.
+	 */
+	if (file->block_shift == LARGE_BLOCK_SHIFT && new_size <= LARGE_BLOCK_SIZE / 4)
+		ufs_file_set_block_shift(file, SMALL_BLOCK_SHIFT);
+	return 0;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+/** Change the file size. The new bytes are holes. */
+static int
+ufs_file_resize(struct file *file, size_t new_size)
 {
-	if (fd <= 0 || fd > file_descriptors_capacity || file_descriptors[fd - 1] == NULL)
+	if (!file->is_inline)
+		return ufs_file_resize_blocks(file, new_size);
+	if (new_size <= FILE_INLINE_SIZE)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		if (new_size > file->size)
+			memset(file->inline_data + file->size, 0, new_size - file->size);
+		file->size = new_size;
+		return 0;
 	}
-	struct filedesc* file_desc = file_descriptors[fd - 1];
-	if (file_desc->mode == UFS_READ_ONLY)
+	if (ufs_file_uninline(file) != 0)
+		return -1;
+	if (ufs_file_resize_blocks(file, new_size) != 0)
 	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		ufs_file_inline(file);
 		return -1;
 	}
-	if (size > MAX_FILE_SIZE - file_desc->file->occupied)
+	return 0;
+}
+
+/**
+ * Make the bytes [offset, offset + size) ready to be written: grow the file
+ * to cover them, and give them blocks owned by the file. The file is not
+ * changed on failure.
+ */
+static int
+ufs_file_prepare(struct file *file, size_t offset, size_t size)
+{
+	if (size > MAX_FILE_SIZE || offset > MAX_FILE_SIZE - size)
 	{
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	size_t remain_size = size;
-	const char* remain_buf = buf;
-	struct block* current_block = file_desc->current_block;
-	while (remain_size != 0)
+	size_t old_size = file->size;
+	if (offset + size > file->size && ufs_file_resize(file, offset + size) != 0)
+		return -1;
+	if (ufs_file_unshare(file, offset, size) != 0)
 	{
-		size_t write_size = BLOCK_SIZE - file_desc->current_block_offset;
-		if (remain_size < write_size)
-		{
-			write_size = remain_size;
-		}
-
-		memcpy(&current_block->memory[file_desc->current_block_offset], remain_buf, write_size);
-		file_desc->file->occupied += write_size;
-		remain_buf += write_size;
-		remain_size -= write_size;
-		if (file_desc->current_block_offset + (int)write_size - current_block->occupied > 0)
-		{
-			current_block->occupied += file_desc->current_block_offset + write_size - current_block->occupied;
-		}
-
-		file_desc->current_block_offset += write_size;
-		if (file_desc->current_block_offset == BLOCK_SIZE)
-		{
-			if (current_block->next == NULL)
-			{
-				current_block = ufs_add_block(current_block);
-				file_desc->file->last_block = current_block;
-				if (current_block == NULL)
-				{
-					return -1;
-				}			
-			}
-			else
-			{
-				current_block = current_block->next;
-			}
-			file_desc->current_block = current_block;
-			file_desc->current_block_offset = 0;
-		}
+		/* A shrink doesn't fail. */
+		ufs_file_resize(file, old_size);
+		return -1;
 	}
-	return size;
+	return 0;
 }
 
-ssize_t
-ufs_read(int fd, char *buf, size_t size)
+/**
+ * Deduplicate the blocks which a write into [offset, end) has filled up to
+ * their ends: a block of zeros becomes a hole, a block equal to an indexed
+ * one is replaced with it, the others are added into the index. The blocks
+ * of the range should be owned only by the file, like after a write.
+ */
+static void
+ufs_file_dedup(struct file *file, size_t offset, size_t end)
 {
-	if (fd <= 0 || fd > file_descriptors_capacity || file_descriptors[fd - 1] == NULL)
+	size_t block_size = (size_t)1 << file->block_shift;
+	struct dedup_index *d = &ufs_block_allocator(file->block_shift)->dedup;
+	for (size_t i = offset >> file->block_shift; i < end >> file->block_shift; i++)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		char *block = file->blocks[i];
+		/* Mostly stops at the first bytes. */
+		bool is_zero = memcmp(block, zero_block, block_size) == 0;
+		uint64_t hash = is_zero ? 0 : ufs_block_hash(block, block_size);
+		pthread_mutex_lock(&d->lock);
+		char *same = NULL;
+		if (is_zero)
+			d->zero_count++;
+		else
+			same = ufs_dedup_find_or_add(d, block, hash, block_size);
+		pthread_mutex_unlock(&d->lock);
+		if (!is_zero && same == NULL)
+			continue;
+		file->blocks[i] = same;
+		ufs_block_unref(file->block_shift, block);
 	}
+}
 
-	struct filedesc* file_desc = file_descriptors[fd - 1];
-	if (file_desc->mode == UFS_WRITE_ONLY)
-	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
+static ssize_t
+ufs_file_write(struct file *file, const char *buf, size_t size, size_t offset)
+{
+	/*
+	 * An empty write doesn't grow the file, like in POSIX. It is not
+	 * logged, so the growth would be lost on replay.
+	 */
+	if (size == 0)
+		return 0;
+	if (ufs_file_prepare(file, offset, size) != 0)
 		return -1;
+	if (file->is_inline)
+	{
+		memcpy(file->inline_data + offset, buf, size);
+		return size;
 	}
-	size_t already_readed = 0;
-	char* current_buf = buf;
-	while (already_readed != size && file_desc->current_block != NULL)
+	size_t start = offset;
+	size_t end = offset + size;
+	size_t block_size = (size_t)1 << file->block_shift;
+	while (offset < end)
 	{
-		size_t availble_to_read_size = file_desc->current_block->occupied - file_desc->current_block_offset;
-		if (availble_to_read_size > size){
-			availble_to_read_size = size;
-		}
-		memcpy(current_buf, &file_desc->current_block->memory[file_desc->current_block_offset], availble_to_read_size);
-
-		already_readed += availble_to_read_size;
-		current_buf += availble_to_read_size;
-		file_desc->current_block_offset += availble_to_read_size;
-
-		if (file_desc->current_block_offset == file_desc->current_block->occupied)
-		{
-			if (file_desc->current_block->occupied == BLOCK_SIZE && file_desc->current_block->next != NULL)
-			{
-				file_desc->current_block_offset = 0;
-				file_desc->current_block = file_desc->current_block->next;
-			}
-			else
-			{
-				return already_readed;
-			}
-		}
+		size_t block_offset = offset & (block_size - 1);
+		size_t part = block_size - block_offset;
+		if (part > end - offset)
+			part = end - offset;
+		memcpy(file->blocks[offset >> file->block_shift] + block_offset, buf, part);
+		buf += part;
+		offset += part;
 	}
-	return already_readed;
+	if (atomic_load_explicit(&dedup_is_enabled, memory_order_relaxed))
+		ufs_file_dedup(file, start, end);
+	return size;
 }
 
-int
-ufs_resize(int fd, size_t new_size)
+static ssize_t
+ufs_file_read(const struct file *file, char *buf, size_t size, size_t offset)
 {
-	int index = fd - 1;
-	if (fd <= 0 || fd > file_descriptors_capacity || file_descriptors[fd - 1] == NULL)
+	if (offset >= file->size)
+		return 0;
+	if (size > file->size - offset)
+		size = file->size - offset;
+	if (file->is_inline)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		memcpy(buf, file->inline_data + offset, size);
+		return size;
 	}
-
-	if (new_size > MAX_FILE_SIZE)
+	size_t block_size = (size_t)1 << file->block_shift;
+	size_t end = offset + size;
+	while (offset < end)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		size_t block_offset = offset & (block_size - 1);
+		size_t part = block_size - block_offset;
+		if (part > end - offset)
+			part = end - offset;
+		const char *block = file->blocks[offset >> file->block_shift];
+		if (block != NULL)
+			memcpy(buf, block + block_offset, part);
+		else
+			memset(buf, 0, part);
+		buf += part;
+		offset += part;
 	}
+	return size;
+}
 
-    struct file *file = file_descriptors[index]->file;
-
-    if (new_size == file->occupied)
+/**
+ * Make the bytes [offset, offset + size) a hole. The blocks inside it are
+ * freed, the parts of the blocks at its edges are zeroed. The file size
+ * is not changed. On failure a part of the bytes can be zeroed.
+ */
+static int
+ufs_file_punch_hole(struct file *file, size_t offset, size_t size)
+{
+	if (offset >= file->size || size == 0)
+		return 0;
+	if (size > file->size - offset)
+		size = file->size - offset;
+	if (file->is_inline)
+		return ufs_file_zero(file, offset, size);
+	size_t block_size = (size_t)1 << file->block_shift;
+	size_t end = offset + size;
+	/* The bytes after the file end are garbage, the last block goes whole. */
+	if (end == file->size)
+		end = file->block_count << file->block_shift;
+	size_t first = (offset + block_size - 1) >> file->block_shift;
+	size_t last = end >> file->block_shift;
+	if (first > last)
+		return ufs_file_zero(file, offset, size);
+	if ((offset & (block_size - 1)) != 0 &&
+	    ufs_file_zero(file, offset, (first << file->block_shift) - offset) != 0)
+		return -1;
+	if ((end & (block_size - 1)) != 0 &&
+	    ufs_file_zero(file, last << file->block_shift, end & (block_size - 1)) != 0)
+		return -1;
+	for (size_t i = first; i < last; i++)
 	{
-        return 0;
-    }
+		ufs_block_unref(file->block_shift, file->blocks[i]);
+		file->blocks[i] = NULL;
+	}
+	return 0;
+}
 
-    if (new_size > file->occupied)
-	{
-		size_t curr_block_occupied_offset = (file->occupied % BLOCK_SIZE);
-		while (file->occupied != new_size)
-		{
-			if (curr_block_occupied_offset == BLOCK_SIZE)
-			{
-				struct block* current_block = ufs_add_block(file->last_block);
-				file->last_block = current_block;
-				if (current_block == NULL)
-				{
-					return -1;
-				}
-				curr_block_occupied_offset = 0;
-			}
+enum {
+	INDEX_SHARD_BITS = 4,
+	INDEX_SHARD_COUNT = 1 << INDEX_SHARD_BITS,
+};
 
-			struct block *current_block = file->last_block;
+/**
+ * Index of the files by names. It is split into shards by the name hash,
+ * each with its own lock, so as the threads opening and deleting different
+ * files rarely wait for each other. A shard is an open addressing hash table
+ * with linear probing. Only the files which can be found by name are here,
+ * the ones deleted while still opened are referenced only by their
+ * descriptors. Capacity is a power of 2, empty slots are NULL.
+ */
+struct index_shard {
+	pthread_mutex_t lock;
+	struct file **files;
+	uint32_t capacity;
+	uint32_t count;
+};
 
-			size_t size_to_add = BLOCK_SIZE - curr_block_occupied_offset;
-			if (new_size - file->occupied < size_to_add)
-			{
-				size_to_add = new_size - file->occupied;
-			}
-			memset(&current_block->memory[curr_block_occupied_offset], 0, size_to_add);
-			file->occupied += size_to_add;
-			curr_block_occupied_offset += size_to_add;
-		}
-    } else {
-		size_t size_to_reduce = file->occupied - new_size;
-		size_t curr_block_occupied_offset = (file->occupied % BLOCK_SIZE);
+static struct index_shard file_index[INDEX_SHARD_COUNT] = {
+	[0 ... INDEX_SHARD_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
 
-		size_t number_block_to_free = 0;
-		if (size_to_reduce > curr_block_occupied_offset)
-		{
-			number_block_to_free += (int)((size_to_reduce - curr_block_occupied_offset) / BLOCK_SIZE);
+static _Atomic uint64_t next_file_id = 1;
 
-			struct block *start_block_to_free = file->last_block;
-			for (size_t i = 0; i < number_block_to_free; i++)
-			{
-				start_block_to_free = start_block_to_free->prev;
-			}
-			file->last_block = start_block_to_free->prev;
-			file->last_block->next = NULL;
-			ufs_delete_blocks(start_block_to_free);
-			size_to_reduce -= curr_block_occupied_offset + number_block_to_free * BLOCK_SIZE;
-		}
-		file->occupied -= size_to_reduce;
-		file->last_block->occupied -= size_to_reduce;
-		
-		
-		for (int i = 0; i < file_descriptors_count; i++)
-		{
-			if (file_descriptors[i] == NULL || file_descriptors[i]->file != file)
-			{
-				continue;
-			}
+/** Hash of the first @a len bytes of a path. */
+static uint32_t
+ufs_path_hash(const char *path, size_t len)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+	{
+		h ^= (unsigned char)path[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t
+ufs_name_hash(const char *name)
+{
+	return ufs_path_hash(name, strlen(name));
+}
+
+/** The shard is chosen by the high bits, the slot in it by the low ones. */
+static struct index_shard *
+ufs_index_shard(uint32_t hash)
+{
+	return &file_index[hash >> (32 - INDEX_SHARD_BITS)];
+}
+
+/**
+ * Find the slot of the file @a name in the shard. It is either the slot of
+ * the file, or an empty slot where it would be.
+ */
+static uint32_t
+ufs_index_find_slot(const struct index_shard *shard, const char *name, uint32_t hash)
+{
+	uint32_t mask = shard->capacity - 1;
+	uint32_t i = hash & mask;
+	while (shard->files[i] != NULL)
+	{
+		struct file *f = shard->files[i];
+		if (f->name_hash == hash && strcmp(f->name, name) == 0)
+			break;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static int
+ufs_index_grow(struct index_shard *shard)
+{
+	uint32_t new_capacity = shard->capacity == 0 ? 64 : shard->capacity * 2;
+	struct file **new_files = calloc(new_capacity, sizeof(*new_files));
+	if (new_files == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file **old_files = shard->files;
+	uint32_t old_capacity = shard->capacity;
+	shard->files = new_files;
+	shard->capacity = new_capacity;
+	for (uint32_t i = 0; i < old_capacity; ++i)
+	{
+		struct file *f = old_files[i];
+		if (f != NULL)
+			shard->files[ufs_index_find_slot(shard, f->name, f->name_hash)] = f;
+	}
+	free(old_files);
+	return 0;
+}
+
+static int
+ufs_index_insert(struct index_shard *shard, struct file *file)
+{
+	/* Keep the load factor below 3/4, so as the probe chains are short. */
+	if ((shard->count + 1) * 4 > shard->capacity * 3 && ufs_index_grow(shard) != 0)
+		return -1;
+	uint32_t i = ufs_index_find_slot(shard, file->name, file->name_hash);
+	assert(shard->files[i] == NULL);
+	shard->files[i] = file;
+	shard->count++;
+	return 0;
+}
+
+/**
+ * Remove the file from the shard. The next entries of the probe chain are
+ * shifted back into the hole, so there are no tombstones, and deleting and
+ * creating files doesn't degrade the lookups.
+ */
+static void
+ufs_index_remove(struct index_shard *shard, struct file *file)
+{
+	uint32_t mask = shard->capacity - 1;
+	uint32_t i = ufs_index_find_slot(shard, file->name, file->name_hash);
+	assert(shard->files[i] == file);
+	uint32_t j = i;
+	while (true)
+	{
+		j = (j + 1) & mask;
+		struct file *f = shard->files[j];
+		if (f == NULL)
+			break;
+		uint32_t home = f->name_hash & mask;
+		/* The entry can't be moved before its home slot. */
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+		shard->files[i] = f;
+		i = j;
+	}
+	shard->files[i] = NULL;
+	shard->count--;
+}
+
+/**
+ * Directory. The files and the directories are found by their full paths, in
+ * the file index and in the directory index, so a path of any depth is
+ * resolved by one lookup, like by the dentry cache of a kernel. The tree is
+ * walked only to list a directory, which takes O(children), to check that it
+ * is empty, and to rename it with its content.
+ */
+struct dir {
+	/** Full path, "" for the root. */
+	char *name;
+	uint32_t name_hash;
+	struct dir *parent;
+	/** Links in the directory list of the parent. */
+	struct dir *prev;
+	struct dir *next;
+	/** Next directory in the same bucket of the index. */
+	struct dir *hash_next;
+	/** Subdirectories and files, in no particular order. */
+	struct dir *dirs;
+	struct file *files;
+	size_t child_count;
+};
+
+/**
+ * Protects the directories: their index, their fields, and the tree links of
+ * the files. It is taken after the shard locks and before the file locks.
+ * Creation and deletion of a file take it only to link the file, the lookups
+ * don't take it.
+ */
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dir root_dir = {.name = (char *)""};
+
+/** Directories except the root by their paths, a chained hash table. */
+static struct {
+	struct dir **buckets;
+	size_t capacity;
+	size_t count;
+} dir_index;
+
+/** A path is not empty and has no empty names: no slash at the ends, no double slash. */
+static bool
+ufs_path_is_valid(const char *path)
+{
+	if (*path == 0 || *path == '/')
+		return false;
+	for (; *path != 0; ++path)
+	{
+		if (*path == '/' && (path[1] == '/' || path[1] == 0))
+			return false;
+	}
+	return true;
+}
+
+/** Find a directory by the first @a len bytes of a path. The tree lock should be taken. */
+static struct dir *
+ufs_dir_find(const char *path, size_t len)
+{
+	if (len == 0)
+		return &root_dir;
+	if (dir_index.count == 0)
+		return NULL;
+	uint32_t hash = ufs_path_hash(path, len);
+	struct dir *dir = dir_index.buckets[hash & (dir_index.capacity - 1)];
+	for (; dir != NULL; dir = dir->hash_next)
+	{
+		if (dir->name_hash == hash && strncmp(dir->name, path, len) == 0 && dir->name[len] == 0)
+			break;
+	}
+	return dir;
+}
+
+/** Find the directory a path is in, by the part before the last slash. */
+static struct dir *
+ufs_dir_parent(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return ufs_dir_find(path, slash == NULL ? 0 : slash - path);
+}
+
+static void
+ufs_dir_index_add(struct dir *dir)
+{
+	struct dir **bucket = &dir_index.buckets[dir->name_hash & (dir_index.capacity - 1)];
+	dir->hash_next = *bucket;
+	*bucket = dir;
+	dir_index.count++;
+}
+
+static void
+ufs_dir_index_remove(struct dir *dir)
+{
+	struct dir **link = &dir_index.buckets[dir->name_hash & (dir_index.capacity - 1)];
+	while (*link != dir)
+		link = &(*link)->hash_next;
+	*link = dir->hash_next;
+	dir_index.count--;
+}
+
+static int
+ufs_dir_index_grow(void)
+{
+	size_t new_capacity = dir_index.capacity == 0 ? 64 : dir_index.capacity * 2;
+	struct dir **new_buckets = calloc(new_capacity, sizeof(*new_buckets));
+	if (new_buckets == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct dir **old_buckets = dir_index.buckets;
+	size_t old_capacity = dir_index.capacity;
+	dir_index.buckets = new_buckets;
+	dir_index.capacity = new_capacity;
+	dir_index.count = 0;
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		while (old_buckets[i] != NULL)
+		{
+			struct dir *dir = old_buckets[i];
+			old_buckets[i] = dir->hash_next;
+			ufs_dir_index_add(dir);
+		}
+	}
+	free(old_buckets);
+	return 0;
+}
+
+static void
+ufs_dir_link_file(struct dir *dir, struct file *file)
+{
+	file->parent = dir;
+	file->dir_prev = NULL;
+	file->dir_next = dir->files;
+	if (dir->files != NULL)
+		dir->files->dir_prev = file;
+	dir->files = file;
+	dir->child_count++;
+}
+
+static void
+ufs_dir_unlink_file(struct file *file)
+{
+	struct dir *dir = file->parent;
+	if (file->dir_prev != NULL)
+		file->dir_prev->dir_next = file->dir_next;
+	else
+		dir->files = file->dir_next;
+	if (file->dir_next != NULL)
+		file->dir_next->dir_prev = file->dir_prev;
+	dir->child_count--;
+	file->parent = NULL;
+}
+
+static void
+ufs_dir_link_dir(struct dir *parent, struct dir *dir)
+{
+	dir->parent = parent;
+	dir->prev = NULL;
+	dir->next = parent->dirs;
+	if (parent->dirs != NULL)
+		parent->dirs->prev = dir;
+	parent->dirs = dir;
+	parent->child_count++;
+}
+
+static void
+ufs_dir_unlink_dir(struct dir *dir)
+{
+	struct dir *parent = dir->parent;
+	if (dir->prev != NULL)
+		dir->prev->next = dir->next;
+	else
+		parent->dirs = dir->next;
+	if (dir->next != NULL)
+		dir->next->prev = dir->prev;
+	parent->child_count--;
+	dir->parent = NULL;
+}
+
+/** Next directory of the subtree of @a root in the preorder, NULL after the last one. */
+static struct dir *
+ufs_dir_next(const struct dir *dir, const struct dir *root)
+{
+	if (dir->dirs != NULL)
+		return dir->dirs;
+	for (; dir != root; dir = dir->parent)
+	{
+		if (dir->next != NULL)
+			return dir->next;
+	}
+	return NULL;
+}
+
+/**
+ * Create the directory @a path in @a parent. The path should be free. The
+ * tree lock should be taken.
+ */
+static struct dir *
+ufs_dir_create(struct dir *parent, const char *path)
+{
+	if (dir_index.count >= dir_index.capacity && ufs_dir_index_grow() != 0)
+		return NULL;
+	struct dir *dir = calloc(1, sizeof(*dir));
+	if (dir == NULL || (dir->name = strdup(path)) == NULL)
+	{
+		free(dir);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	dir->name_hash = ufs_name_hash(path);
+	ufs_dir_index_add(dir);
+	ufs_dir_link_dir(parent, dir);
+	return dir;
+}
+
+/**
+ * Find the directory a path is in, creating the missing ones on the way. The
+ * images and the journals of the versions without directories have the
+ * names with slashes and no directories for them. The tree lock should be
+ * taken.
+ */
+static struct dir *
+ufs_dir_make_parents(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL)
+		return &root_dir;
+	struct dir *dir = ufs_dir_find(path, slash - path);
+	if (dir != NULL)
+		return dir;
+	char *name = strndup(path, slash - path);
+	if (name == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	struct dir *parent = ufs_dir_make_parents(name);
+	if (parent != NULL)
+		dir = ufs_dir_create(parent, name);
+	free(name);
+	return dir;
+}
+
+enum ufs_error_code
+ufs_errno()
+{
+	return ufs_error_code;
+}
+
+/** Find a file by name. The shard lock should be taken. */
+struct file*
+ufs_find_file(const struct index_shard *shard, const char *filename, uint32_t hash)
+{
+	if (shard->count == 0)
+		return NULL;
+	return shard->files[ufs_index_find_slot(shard, filename, hash)];
+}
+
+/** Create a file and add it into the index. The shard lock should be taken. */
+struct file*
+ufs_create_file(struct index_shard *shard, const char* filename, uint32_t hash)
+{
+	struct file *new_file = (struct file*)malloc(sizeof(struct file));
+	if (new_file == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	new_file->blocks = NULL;
+	new_file->block_count = 0;
+	new_file->block_capacity = 0;
+	new_file->block_shift = SMALL_BLOCK_SHIFT;
+	new_file->refs = 0;
+	new_file->size = 0;
+	new_file->is_inline = true;
+	new_file->marked_as_deleted = false;
+
+	new_file->name = strdup(filename);
+	if (new_file->name == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		free(new_file);
+		return NULL;
+	}
+	new_file->name_hash = hash;
+	new_file->parent = NULL;
+	new_file->id = atomic_fetch_add_explicit(&next_file_id, 1, memory_order_relaxed);
+	if (ufs_index_insert(shard, new_file) != 0)
+	{
+		free(new_file->name);
+		free(new_file);
+		return NULL;
+	}
+	pthread_rwlock_init(&new_file->lock, NULL);
+	return new_file;
+}
+
+/**
+ * Create a file in the index and in its directory. The shard lock should be
+ * taken. When @a is_loading an image or a journal, the missing directories
+ * are created, see ufs_dir_make_parents(), and the path is not checked.
+ */
+static struct file *
+ufs_file_create(struct index_shard *shard, const char *filename, uint32_t hash, bool is_loading)
+{
+	if (!is_loading && !ufs_path_is_valid(filename))
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return NULL;
+	}
+	struct file *file = NULL;
+	pthread_mutex_lock(&tree_lock);
+	struct dir *dir = is_loading ? ufs_dir_make_parents(filename) : ufs_dir_parent(filename);
+	if (dir == NULL)
+	{
+		if (!is_loading)
+			ufs_error_code = UFS_ERR_NO_FILE;
+	}
+	else if (!is_loading && ufs_dir_find(filename, strlen(filename)) != NULL)
+	{
+		ufs_error_code = UFS_ERR_EXISTS;
+	}
+	else if ((file = ufs_create_file(shard, filename, hash)) != NULL)
+	{
+		ufs_dir_link_file(dir, file);
+	}
+	pthread_mutex_unlock(&tree_lock);
+	return file;
+}
+
+/**
+ * Free the file. It should be already removed from the index, and have no
+ * descriptors.
+ */
+void ufs_delete_file(struct file* file_to_delete)
+{
+	ufs_file_set_block_count(file_to_delete, 0);
+	free(file_to_delete->blocks);
+	free(file_to_delete->name);
+	pthread_rwlock_destroy(&file_to_delete->lock);
+	free(file_to_delete);
+}
+
+/** Drop a reference of a closed descriptor, and free the file if needed. */
+static void
+ufs_file_unref(struct file *file)
+{
+	struct index_shard *shard;
+	while (true)
+	{
+		shard = ufs_index_shard(atomic_load_explicit(&file->name_hash, memory_order_relaxed));
+		pthread_mutex_lock(&shard->lock);
+		/* A rename could move the file into another shard meanwhile. */
+		if (shard == ufs_index_shard(file->name_hash))
+			break;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	bool is_unused = --file->refs == 0 && file->marked_as_deleted;
+	pthread_mutex_unlock(&shard->lock);
+	if (is_unused)
+		ufs_delete_file(file);
+}
+
+/** Types of the journal records, see ufs_replay() for how they apply. */
+enum ufs_record_type {
+	/** A new file, the payload is its name. */
+	UFS_RECORD_CREATE = 1,
+	UFS_RECORD_DELETE,
+	/** Write of the payload at the offset given in the argument. */
+	UFS_RECORD_WRITE,
+	/** Resize to the size given in the argument. */
+	UFS_RECORD_RESIZE,
+	/** Clone of the file which id is given in the argument. */
+	UFS_RECORD_CLONE,
+	/**
+	 * The file is emptied and resized to the size given in the argument,
+	 * the payload is written at its start. The writes of the rest of the
+	 * new content follow.
+	 */
+	UFS_RECORD_REPLACE,
+	/**
+	 * Hole at the offset given in the argument, the payload is its size
+	 * as uint64_t.
+	 */
+	UFS_RECORD_PUNCH,
+	/** A new directory, the payload is its path. The id is 0. */
+	UFS_RECORD_MKDIR,
+	/** Deletion of the directory which path is the payload. The id is 0. */
+	UFS_RECORD_RMDIR,
+	/**
+	 * Rename of a file or a directory, the payload is the old path, a
+	 * zero byte and the new path. The id is 0.
+	 */
+	UFS_RECORD_RENAME,
+};
+
+enum {
+	/** Growth of the journal which starts a background checkpoint. */
+	CHECKPOINT_JOURNAL_SIZE = 64 * 1024 * 1024,
+};
+
+/**
+ * The image the filesystem is attached to by ufs_image_open(). The journal
+ * is set before any other call and cleared by ufs_destroy(), so it is read
+ * without locks.
+ */
+static struct {
+	char *path;
+	struct journal *journal;
+	/** Serializes the checkpoints. */
+	pthread_mutex_t checkpoint_lock;
+	/** Journal size to start the next background checkpoint at. */
+	atomic_size_t checkpoint_size;
+	atomic_bool is_checkpoint_requested;
+	/** Protects the fields below, and is used for the condition. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t checkpointer;
+	bool is_stopped;
+} image = {
+	.checkpoint_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Save a change into the journal, if there is an image. It should be called
+ * under the lock which serializes the change, so as the records go in the
+ * order of the changes. A failure breaks the journal, it is reported by
+ * ufs_sync().
+ */
+static void
+ufs_log(enum ufs_record_type type, uint64_t id, uint64_t arg, const struct iovec *data, int count)
+{
+	if (image.journal == NULL)
+		return;
+	journal_append(image.journal, type, id, arg, data, count);
+	if (journal_size(image.journal) < atomic_load_explicit(&image.checkpoint_size, memory_order_relaxed) ||
+	    atomic_exchange(&image.is_checkpoint_requested, true))
+		return;
+	pthread_mutex_lock(&image.lock);
+	pthread_cond_signal(&image.cond);
+	pthread_mutex_unlock(&image.lock);
+}
+
+static void
+ufs_log_create(const struct file *file)
+{
+	struct iovec name = {file->name, strlen(file->name)};
+	ufs_log(UFS_RECORD_CREATE, file->id, 0, &name, 1);
+}
+
+static void
+ufs_log_write(const struct file *file, const char *buf, size_t size, size_t offset)
+{
+	struct iovec data = {(char *)buf, size};
+	ufs_log(UFS_RECORD_WRITE, file->id, offset, &data, 1);
+}
+
+/**
+ * Save the whole content of the file as the replacement of the old one. The
+ * data goes by runs of the blocks between the holes, big runs take several
+ * records, not to allocate an array of all the blocks.
+ */
+static void
+ufs_log_content(const struct file *file)
+{
+	if (image.journal == NULL)
+		return;
+	if (file->is_inline)
+	{
+		struct iovec data = {(char *)file->inline_data, file->size};
+		ufs_log(UFS_RECORD_REPLACE, file->id, file->size, &data, 1);
+		return;
+	}
+	ufs_log(UFS_RECORD_REPLACE, file->id, file->size, NULL, 0);
+	enum { BATCH = 256 };
+	struct iovec data[BATCH];
+	size_t block_size = (size_t)1 << file->block_shift;
+	size_t i = 0;
+	while (i < file->block_count)
+	{
+		if (file->blocks[i] == NULL)
+		{
+			i++;
+			continue;
+		}
+		size_t offset = i << file->block_shift;
+		int count = 0;
+		for (; i < file->block_count && file->blocks[i] != NULL && count < BATCH; i++, count++)
+		{
+			data[count].iov_base = file->blocks[i];
+			data[count].iov_len = block_size;
+		}
+		if (i == file->block_count)
+			data[count - 1].iov_len = file->size - ((i - 1) << file->block_shift);
+		ufs_log(UFS_RECORD_WRITE, file->id, offset, data, count);
+	}
+}
+
+struct filedesc {
+	struct file *file;
+	enum open_flags mode;
+	/**
+	 * Offset in the file for the next read or write. Changed either
+	 * under the exclusive file lock, or under the shared one plus
+	 * pos_lock, so as the threads using the same descriptor don't
+	 * race.
+	 */
+	size_t pos;
+	pthread_mutex_t pos_lock;
+};
+
+/**
+ * An array of file descriptors. When a file descriptor is created, its
+ * pointer drops here. When a file descriptor is closed, its place in this
+ * array is set to NULL and can be taken by next ufs_open() call.
+ *
+ * The descriptors are looked up without locks. For that the table is never
+ * reallocated in place. A copy of the other size is published instead, and
+ * the old one is freed when no lookup can be looking into it anymore, see
+ * ufs_file_descriptors_sync(). Opening and closing are serialized by a
+ * mutex.
+ */
+struct filedesc_table {
+	int capacity;
+	_Atomic(struct filedesc *) descs[];
+};
+
+enum {
+	/** Smallest capacity of the table, a power of 2 like all the others. */
+	FILEDESC_MIN_CAPACITY = 64,
+	/** How many closed descriptor objects are kept for reuse. */
+	FILEDESC_CACHE_SIZE = 1024,
+	/** Counters of the lookups, split not to share a cache line. */
+	FILEDESC_READER_SHARDS = 64,
+};
+
+static _Atomic(struct filedesc_table *) file_descriptors = NULL;
+static int file_descriptors_count = 0;
+static pthread_mutex_t file_descriptors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Used slots of the table, to take the lowest free one without a scan. The
+ * numbers stay dense, so the table can shrink after the descriptors are
+ * closed. Changed under file_descriptors_lock.
+ */
+static struct {
+	/** Bit per slot. */
+	uint64_t *used;
+	/**
+	 * Bit per word of the used bits, set when the word is full. The
+	 * bits of the words beyond the table are set too.
+	 */
+	uint64_t *full;
+	/** There are no free slots in the words of full before it. */
+	int hint;
+	/** Used slots in the upper half of the table. */
+	int upper_count;
+} filedesc_bits;
+
+/** Closed descriptors, their pos_lock stays initialized. Linked by file. */
+static struct filedesc *filedesc_cache = NULL;
+static int filedesc_cache_count = 0;
+
+/**
+ * Lookups in progress. A lookup counts itself in its thread's shard, in the
+ * counter of the current epoch. A replaced table is freed after the epoch is
+ * flipped and the lookups counted in the old one are done.
+ */
+static struct {
+	atomic_long count[2];
+} __attribute__((aligned(64))) filedesc_readers[FILEDESC_READER_SHARDS];
+static atomic_int filedesc_epoch = 0;
+static atomic_int filedesc_next_shard = 0;
+static __thread int filedesc_reader_shard = -1;
+
+static void
+ufs_file_descriptors_sync(void)
+{
+	/*
+	 * Two rounds: a lookup could read the epoch before the first flip,
+	 * and count itself in it after the wait. Then it could get the
+	 * table published right before, and is waited for by the second.
+	 */
+	for (int round = 0; round < 2; round++)
+	{
+		int epoch = atomic_fetch_xor(&filedesc_epoch, 1);
+		for (int i = 0; i < FILEDESC_READER_SHARDS; i++)
+		{
+			while (atomic_load(&filedesc_readers[i].count[epoch]) != 0)
+				sched_yield();
+		}
+	}
+}
+
+static int
+ufs_filedesc_word_count(int capacity)
+{
+	return capacity / 64;
+}
+
+static int
+ufs_filedesc_full_count(int capacity)
+{
+	return (ufs_filedesc_word_count(capacity) + 63) / 64;
+}
+
+/**
+ * Publish a copy of the table with the new capacity, together with the
+ * bitmaps for it. The slots beyond the new capacity must be free.
+ */
+static int
+ufs_file_descriptors_resize(int capacity)
+{
+	struct filedesc_table *old = atomic_load_explicit(&file_descriptors, memory_order_relaxed);
+	int old_capacity = old == NULL ? 0 : old->capacity;
+	int word_count = ufs_filedesc_word_count(capacity);
+	int full_count = ufs_filedesc_full_count(capacity);
+	struct filedesc_table *table = malloc(sizeof(*table) + capacity * sizeof(table->descs[0]));
+	uint64_t *used = calloc(word_count, sizeof(*used));
+	uint64_t *full = calloc(full_count, sizeof(*full));
+	if (table == NULL || used == NULL || full == NULL)
+	{
+		free(table);
+		free(used);
+		free(full);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	table->capacity = capacity;
+	int i = 0;
+	for (; i < old_capacity && i < capacity; i++)
+		atomic_init(&table->descs[i], atomic_load_explicit(&old->descs[i], memory_order_relaxed));
+	for (; i < capacity; i++)
+		atomic_init(&table->descs[i], NULL);
+	if (old != NULL)
+	{
+		int old_word_count = ufs_filedesc_word_count(old_capacity);
+		memcpy(used, filedesc_bits.used,
+		       (old_word_count < word_count ? old_word_count : word_count) * sizeof(*used));
+	}
+	filedesc_bits.upper_count = 0;
+	for (int w = 0; w < full_count * 64; w++)
+	{
+		if (w >= word_count || used[w] == UINT64_MAX)
+			full[w / 64] |= (uint64_t)1 << (w % 64);
+		if (w >= word_count / 2 && w < word_count)
+			filedesc_bits.upper_count += __builtin_popcountll(used[w]);
+	}
+	free(filedesc_bits.used);
+	free(filedesc_bits.full);
+	filedesc_bits.used = used;
+	filedesc_bits.full = full;
+	filedesc_bits.hint = 0;
+
+	atomic_store(&file_descriptors, table);
+	if (old != NULL)
+	{
+		ufs_file_descriptors_sync();
+		free(old);
+	}
+	return 0;
+}
+
+/** Take the lowest free slot, the table must have one. */
+static int
+ufs_filedesc_bits_take(int capacity)
+{
+	int i = filedesc_bits.hint;
+	while (filedesc_bits.full[i] == UINT64_MAX)
+		i++;
+	filedesc_bits.hint = i;
+	int word = i * 64 + __builtin_ctzll(~filedesc_bits.full[i]);
+	int bit = __builtin_ctzll(~filedesc_bits.used[word]);
+	filedesc_bits.used[word] |= (uint64_t)1 << bit;
+	if (filedesc_bits.used[word] == UINT64_MAX)
+		filedesc_bits.full[i] |= (uint64_t)1 << (word % 64);
+	int slot = word * 64 + bit;
+	if (slot >= capacity / 2)
+		filedesc_bits.upper_count++;
+	return slot;
+}
+
+static void
+ufs_filedesc_bits_release(int capacity, int slot)
+{
+	int word = slot / 64;
+	filedesc_bits.used[word] &= ~((uint64_t)1 << (slot % 64));
+	filedesc_bits.full[word / 64] &= ~((uint64_t)1 << (word % 64));
+	if (word / 64 < filedesc_bits.hint)
+		filedesc_bits.hint = word / 64;
+	if (slot >= capacity / 2)
+		filedesc_bits.upper_count--;
+}
+
+/** Check the slots in [from, to) are free, both are multiples of 64. */
+static bool
+ufs_filedesc_bits_are_free(int from, int to)
+{
+	for (int w = from / 64; w < to / 64; w++)
+	{
+		if (filedesc_bits.used[w] != 0)
+			return false;
+	}
+	return true;
+}
+
+int
+ufs_create_file_descriptor(struct file *current_file, enum open_flags fd_flag)
+{
+	pthread_mutex_lock(&file_descriptors_lock);
+	struct filedesc_table *table = atomic_load_explicit(&file_descriptors, memory_order_relaxed);
+	if (table == NULL || file_descriptors_count == table->capacity)
+	{
+		int capacity = table == NULL ? FILEDESC_MIN_CAPACITY : table->capacity * 2;
+		if (capacity < 0 || ufs_file_descriptors_resize(capacity) != 0)
+		{
+			pthread_mutex_unlock(&file_descriptors_lock);
+			if (capacity < 0)
+				ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		table = atomic_load_explicit(&file_descriptors, memory_order_relaxed);
+	}
+	struct filedesc *file_descriptor = filedesc_cache;
+	if (file_descriptor != NULL)
+	{
+		filedesc_cache = (struct filedesc *)file_descriptor->file;
+		filedesc_cache_count--;
+	}
+	else
+	{
+		file_descriptor = malloc(sizeof(struct filedesc));
+		if (file_descriptor == NULL)
+		{
+			pthread_mutex_unlock(&file_descriptors_lock);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		pthread_mutex_init(&file_descriptor->pos_lock, NULL);
+	}
+	file_descriptor->file = current_file;
+	file_descriptor->mode = fd_flag;
+	file_descriptor->pos = 0;
+
+	int slot = ufs_filedesc_bits_take(table->capacity);
+	atomic_store_explicit(&table->descs[slot], file_descriptor, memory_order_release);
+	file_descriptors_count++;
+	pthread_mutex_unlock(&file_descriptors_lock);
+	return slot + 1;
+}
+
+/** Get the descriptor object by its number, or NULL and set the error. */
+static struct filedesc *
+ufs_get_file_descriptor(int fd)
+{
+	if (filedesc_reader_shard < 0)
+		filedesc_reader_shard = atomic_fetch_add_explicit(&filedesc_next_shard, 1, memory_order_relaxed) % FILEDESC_READER_SHARDS;
+	atomic_long *readers = filedesc_readers[filedesc_reader_shard].count;
+	int epoch = atomic_load(&filedesc_epoch);
+	atomic_fetch_add(&readers[epoch], 1);
+	struct filedesc_table *table = atomic_load(&file_descriptors);
+	struct filedesc *desc = NULL;
+	if (table != NULL && fd > 0 && fd <= table->capacity)
+		desc = atomic_load_explicit(&table->descs[fd - 1], memory_order_acquire);
+	atomic_fetch_sub_explicit(&readers[epoch], 1, memory_order_release);
+	if (desc == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return desc;
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+	enum open_flags fd_flag = flags & ~UFS_CREATE;
+	if (!(fd_flag == UFS_READ_ONLY || fd_flag == UFS_WRITE_ONLY))
+	{
+		fd_flag = UFS_READ_WRITE;
+	}
+	uint32_t hash = ufs_name_hash(filename);
+	struct index_shard *shard = ufs_index_shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	struct file* current_file = ufs_find_file(shard, filename, hash);
+	if (current_file == NULL)
+	{
+		if ((flags & UFS_CREATE) != 0)
+		{
+			current_file = ufs_file_create(shard, filename, hash, false);
+			if (current_file != NULL)
+				ufs_log_create(current_file);
+		}
+		else
+		{
+			ufs_error_code = UFS_ERR_NO_FILE;
+		}
+		if (current_file == NULL)
+		{
+			pthread_mutex_unlock(&shard->lock);
+			return -1;
+		}
+	}
+	current_file->refs++;
+	pthread_mutex_unlock(&shard->lock);
+	int fd = ufs_create_file_descriptor(current_file, fd_flag);
+	if (fd == -1)
+		ufs_file_unref(current_file);
+	return fd;
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_READ_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_wrlock(&file->lock);
+	ssize_t rc = ufs_file_write(file, buf, size, file_desc->pos);
+	if (rc > 0)
+	{
+		ufs_log_write(file, buf, rc, file_desc->pos);
+		file_desc->pos += rc;
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_WRITE_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_rdlock(&file->lock);
+	pthread_mutex_lock(&file_desc->pos_lock);
+	ssize_t rc = ufs_file_read(file, buf, size, file_desc->pos);
+	file_desc->pos += rc;
+	pthread_mutex_unlock(&file_desc->pos_lock);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_READ_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_wrlock(&file->lock);
+	ssize_t rc = ufs_file_write(file, buf, size, offset);
+	if (rc > 0)
+		ufs_log_write(file, buf, rc, offset);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_WRITE_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_rdlock(&file->lock);
+	ssize_t rc = ufs_file_read(file, buf, size, offset);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+/** Check the count of the buffers the same way as readv() and writev(). */
+static int
+ufs_check_iovcnt(int iovcnt)
+{
+	if (iovcnt < 0 || iovcnt > UFS_IOV_MAX)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (ufs_check_iovcnt(iovcnt) != 0)
+		return -1;
+	if (file_desc->mode == UFS_READ_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		if (iov[i].iov_len > MAX_FILE_SIZE - total)
+		{
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_wrlock(&file->lock);
+	ssize_t rc = -1;
+	/* Prepare all the blocks at once, then the parts can't fail. */
+	if (total > 0)
+	{
+		if (ufs_file_prepare(file, file_desc->pos, total) != 0)
+			goto out;
+		ufs_log(UFS_RECORD_WRITE, file->id, file_desc->pos, iov, iovcnt);
+	}
+	for (int i = 0; i < iovcnt; i++)
+	{
+		ufs_file_write(file, iov[i].iov_base, iov[i].iov_len, file_desc->pos);
+		file_desc->pos += iov[i].iov_len;
+	}
+	rc = total;
+out:
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (ufs_check_iovcnt(iovcnt) != 0)
+		return -1;
+	if (file_desc->mode == UFS_WRITE_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	ssize_t rc = 0;
+	pthread_rwlock_rdlock(&file->lock);
+	pthread_mutex_lock(&file_desc->pos_lock);
+	for (int i = 0; i < iovcnt; i++)
+	{
+		ssize_t part = ufs_file_read(file, iov[i].iov_base, iov[i].iov_len, file_desc->pos);
+		file_desc->pos += part;
+		rc += part;
+		if ((size_t)part < iov[i].iov_len)
+			break;
+	}
+	pthread_mutex_unlock(&file_desc->pos_lock);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+/**
+ * References to the blocks of a read view. The data of an inline file can
+ * change in place, so it is copied after the blocks.
+ */
+struct ufs_pin {
+	int block_shift;
+	int block_count;
+	char *blocks[];
+};
+
+ssize_t
+ufs_read_view(int fd, size_t size, struct iovec *iov, int *iovcnt, struct ufs_pin **pin)
+{
+	*pin = NULL;
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_WRITE_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	/* Each part is in its own block. */
+	struct ufs_pin *new_pin = malloc(sizeof(*new_pin) + *iovcnt * sizeof(new_pin->blocks[0]) +
+					 FILE_INLINE_SIZE);
+	if (new_pin == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	size_t total = 0;
+	int count = 0;
+	int iov_count = 0;
+	pthread_rwlock_rdlock(&file->lock);
+	pthread_mutex_lock(&file_desc->pos_lock);
+	size_t offset = file_desc->pos;
+	if (offset < file->size && size > file->size - offset)
+		size = file->size - offset;
+	if (file->is_inline && offset < file->size && size > 0 && *iovcnt > 0)
+	{
+		char *copy = (char *)&new_pin->blocks[*iovcnt];
+		memcpy(copy, file->inline_data + offset, size);
+		iov[0].iov_base = copy;
+		iov[0].iov_len = size;
+		iov_count = 1;
+		total = size;
+		offset += size;
+	}
+	size_t block_size = (size_t)1 << file->block_shift;
+	while (!file->is_inline && offset < file->size && total < size && count < *iovcnt)
+	{
+		size_t block_offset = offset & (block_size - 1);
+		size_t part = block_size - block_offset;
+		if (part > size - total)
+			part = size - total;
+		char *block = file->blocks[offset >> file->block_shift];
+		new_pin->blocks[count] = block;
+		if (block != NULL)
+			slab_ref(block);
+		else
+			block = (char *)zero_block;
+		iov[count].iov_base = block + block_offset;
+		iov[count].iov_len = part;
+		iov_count = ++count;
+		total += part;
+		offset += part;
+	}
+	file_desc->pos = offset;
+	new_pin->block_shift = file->block_shift;
+	new_pin->block_count = count;
+	pthread_mutex_unlock(&file_desc->pos_lock);
+	pthread_rwlock_unlock(&file->lock);
+	*iovcnt = iov_count;
+	if (total == 0)
+	{
+		free(new_pin);
+		return 0;
+	}
+	*pin = new_pin;
+	return total;
+}
+
+void
+ufs_pin_release(struct ufs_pin *pin)
+{
+	if (pin == NULL)
+		return;
+	for (int i = 0; i < pin->block_count; i++)
+		ufs_block_unref(pin->block_shift, pin->blocks[i]);
+	free(pin);
+}
+
+/** File data shared with another file or a snapshot. */
+struct file_content {
+	char **blocks;
+	size_t block_count;
+	int block_shift;
+	size_t size;
+	/** Copy of the data of an inline file, which has no blocks. */
+	char inline_data[FILE_INLINE_SIZE];
+};
+
+/** Share the blocks of the file. The file lock should be taken. */
+static int
+ufs_file_get_content(const struct file *file, struct file_content *content)
+{
+	content->size = file->size;
+	if (file->is_inline)
+	{
+		content->blocks = NULL;
+		content->block_count = 0;
+		content->block_shift = SMALL_BLOCK_SHIFT;
+		memcpy(content->inline_data, file->inline_data, file->size);
+		return 0;
+	}
+	content->blocks = malloc((file->block_count + 1) * sizeof(content->blocks[0]));
+	if (content->blocks == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	for (size_t i = 0; i < file->block_count; i++)
+	{
+		if (file->blocks[i] != NULL)
+			slab_ref(file->blocks[i]);
+		content->blocks[i] = file->blocks[i];
+	}
+	content->block_count = file->block_count;
+	content->block_shift = file->block_shift;
+	return 0;
+}
+
+/**
+ * Move the descriptors of the file which are beyond @a size to the file
+ * end. The exclusive file lock should be taken.
+ */
+static void
+ufs_file_clamp_positions(struct file *file, size_t size)
+{
+	/*
+	 * The other descriptors change their positions only under the file
+	 * lock, so they can be fixed without their own locks.
+	 */
+	pthread_mutex_lock(&file_descriptors_lock);
+	struct filedesc_table *table = atomic_load_explicit(&file_descriptors, memory_order_relaxed);
+	for (int i = 0; table != NULL && i < table->capacity; i++)
+	{
+		struct filedesc *desc = atomic_load_explicit(&table->descs[i], memory_order_relaxed);
+		if (desc != NULL && desc->file == file && desc->pos > size)
+			desc->pos = size;
+	}
+	pthread_mutex_unlock(&file_descriptors_lock);
+}
+
+/**
+ * Replace the file data with the content, which is consumed. The
+ * exclusive file lock should be taken.
+ */
+static void
+ufs_file_set_content(struct file *file, struct file_content *content)
+{
+	ufs_file_set_block_count(file, 0);
+	free(file->blocks);
+	file->blocks = content->blocks;
+	file->block_count = content->block_count;
+	file->block_capacity = content->blocks == NULL ? 0 : content->block_count + 1;
+	file->block_shift = content->block_shift;
+	file->size = content->size;
+	file->is_inline = content->blocks == NULL;
+	if (file->is_inline)
+		memcpy(file->inline_data, content->inline_data, content->size);
+}
+
+/** Find a file and reference it so as it is not deleted. */
+static struct file *
+ufs_file_find_ref(const char *filename, bool is_create)
+{
+	uint32_t hash = ufs_name_hash(filename);
+	struct index_shard *shard = ufs_index_shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	struct file *file = ufs_find_file(shard, filename, hash);
+	if (file == NULL && is_create)
+	{
+		file = ufs_file_create(shard, filename, hash, false);
+		if (file != NULL)
+			ufs_log_create(file);
+	}
+	else if (file == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	if (file != NULL)
+		file->refs++;
+	pthread_mutex_unlock(&shard->lock);
+	return file;
+}
+
+/**
+ * Replace the content of the file @a dst, creating it if needed. The
+ * content is saved into the journal as is.
+ */
+static int
+ufs_file_assign(const char *dst, struct file_content *content)
+{
+	struct file *file = ufs_file_find_ref(dst, true);
+	if (file == NULL)
+	{
+		free(content->blocks);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	ufs_file_set_content(file, content);
+	ufs_file_clamp_positions(file, file->size);
+	ufs_log_content(file);
+	pthread_rwlock_unlock(&file->lock);
+	ufs_file_unref(file);
+	return 0;
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	struct file *src_file = ufs_file_find_ref(src, false);
+	if (src_file == NULL)
+		return -1;
+	struct file *dst_file = ufs_file_find_ref(dst, true);
+	if (dst_file == NULL)
+	{
+		ufs_file_unref(src_file);
+		return -1;
+	}
+	int rc = 0;
+	if (src_file != dst_file)
+	{
+		/*
+		 * Both files are locked, so as the source doesn't change until
+		 * the clone is in the journal. The order by id avoids a
+		 * deadlock with a clone in the other direction.
+		 */
+		if (src_file->id < dst_file->id)
+			pthread_rwlock_rdlock(&src_file->lock);
+		pthread_rwlock_wrlock(&dst_file->lock);
+		if (src_file->id > dst_file->id)
+			pthread_rwlock_rdlock(&src_file->lock);
+		struct file_content content;
+		rc = ufs_file_get_content(src_file, &content);
+		if (rc == 0)
+		{
+			ufs_file_set_content(dst_file, &content);
+			ufs_file_clamp_positions(dst_file, dst_file->size);
+			ufs_log(UFS_RECORD_CLONE, dst_file->id, src_file->id, NULL, 0);
+		}
+		pthread_rwlock_unlock(&src_file->lock);
+		pthread_rwlock_unlock(&dst_file->lock);
+	}
+	ufs_file_unref(dst_file);
+	ufs_file_unref(src_file);
+	return rc;
+}
+
+/**
+ * Frozen copies of all the files. They are never changed, so they are kept
+ * in a single index shard, which lock is not used.
+ */
+struct ufs_snapshot {
+	struct index_shard files;
+	/** Paths of the directories, each one after its parent. */
+	char **dirs;
+	size_t dir_count;
+	/** Last journal record which changes are in the snapshot. */
+	uint64_t lsn;
+};
+
+struct ufs_snapshot *
+ufs_snapshot_create(void)
+{
+	struct ufs_snapshot *snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	/*
+	 * All the files are locked before copying any, so the snapshot is
+	 * consistent. Shard locks go before the tree lock, and it goes
+	 * before the file locks everywhere.
+	 */
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+		pthread_mutex_lock(&file_index[i].lock);
+	pthread_mutex_lock(&tree_lock);
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+	{
+		for (uint32_t j = 0; j < file_index[i].capacity; j++)
+		{
+			if (file_index[i].files[j] != NULL)
+				pthread_rwlock_rdlock(&file_index[i].files[j]->lock);
+		}
+	}
+	int rc = 0;
+	if (dir_index.count > 0 && (snap->dirs = malloc(dir_index.count * sizeof(snap->dirs[0]))) == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		rc = -1;
+	}
+	for (struct dir *dir = root_dir.dirs; dir != NULL && rc == 0; dir = ufs_dir_next(dir, &root_dir))
+	{
+		if ((snap->dirs[snap->dir_count] = strdup(dir->name)) == NULL)
+		{
+			ufs_error_code = UFS_ERR_NO_MEM;
+			rc = -1;
+		}
+		else
+			snap->dir_count++;
+	}
+	for (int i = 0; i < INDEX_SHARD_COUNT && rc == 0; i++)
+	{
+		struct index_shard *shard = &file_index[i];
+		for (uint32_t j = 0; j < shard->capacity && rc == 0; j++)
+		{
+			struct file *file = shard->files[j];
+			if (file == NULL)
+				continue;
+			struct file *copy = ufs_create_file(&snap->files, file->name, file->name_hash);
+			struct file_content content;
+			if (copy == NULL || ufs_file_get_content(file, &content) != 0)
+			{
+				rc = -1;
+				break;
+			}
+			ufs_file_set_content(copy, &content);
+			copy->id = file->id;
+		}
+	}
+	/* All the changes are logged under the locks taken above. */
+	if (image.journal != NULL)
+		snap->lsn = journal_lsn(image.journal);
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+	{
+		for (uint32_t j = 0; j < file_index[i].capacity; j++)
+		{
+			if (file_index[i].files[j] != NULL)
+				pthread_rwlock_unlock(&file_index[i].files[j]->lock);
+		}
+	}
+	pthread_mutex_unlock(&tree_lock);
+	for (int i = INDEX_SHARD_COUNT - 1; i >= 0; i--)
+		pthread_mutex_unlock(&file_index[i].lock);
+	if (rc != 0)
+	{
+		ufs_snapshot_delete(snap);
+		return NULL;
+	}
+	return snap;
+}
+
+int
+ufs_snapshot_clone(struct ufs_snapshot *snap, const char *src, const char *dst)
+{
+	struct file *file = ufs_find_file(&snap->files, src, ufs_name_hash(src));
+	if (file == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	struct file_content content;
+	if (ufs_file_get_content(file, &content) != 0)
+		return -1;
+	return ufs_file_assign(dst, &content);
+}
+
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap)
+{
+	for (uint32_t i = 0; i < snap->files.capacity; i++)
+	{
+		if (snap->files.files[i] != NULL)
+			ufs_delete_file(snap->files.files[i]);
+	}
+	free(snap->files.files);
+	for (size_t i = 0; i < snap->dir_count; i++)
+		free(snap->dirs[i]);
+	free(snap->dirs);
+	free(snap);
+}
+
+/**
+ * Layout of the image file. The header takes the first IMAGE_HEADER_SIZE
+ * bytes. Then go the chunks of the block allocators, each one is mapped
+ * into the memory as is and adopted by the allocator, so the blocks are
+ * read lazily by the page faults. The chunk i is at the offset
+ * IMAGE_HEADER_SIZE + i * SLAB_CHUNK_SIZE. The metadata follows the
+ * chunks: an image_chunk for each chunk, then for each file an
+ * image_file, its name and an image_block for each of its blocks. An inline
+ * file has IMAGE_INLINE instead of the block shift, and its data instead of
+ * the blocks. The directories go before the files, each one after its
+ * parent, as an image_file with IMAGE_DIR and the path.
+ */
+struct image_header {
+	char magic[8];
+	/** Last journal record which changes are in the image. */
+	uint64_t lsn;
+	uint64_t next_file_id;
+	uint64_t meta_size;
+	uint32_t chunk_count;
+	/** Files and directories. */
+	uint32_t file_count;
+	uint32_t meta_checksum;
+	/** Checksum of the header with this field zeroed. */
+	uint32_t checksum;
+};
+
+struct image_chunk {
+	uint32_t block_shift;
+	/** The first blocks of the chunk which are used by the files. */
+	uint32_t used;
+};
+
+struct image_file {
+	uint64_t id;
+	uint64_t size;
+	uint32_t block_shift;
+	uint32_t name_len;
+};
+
+struct image_block {
+	/** IMAGE_HOLE for a hole. */
+	uint32_t chunk;
+	uint32_t index;
+};
+
+enum {
+	/** A multiple of any page size, so as the chunks can be mapped. */
+	IMAGE_HEADER_SIZE = 64 * 1024,
+	/** Blocks written into the image by one system call. */
+	IMAGE_WRITE_BATCH = 64,
+	IMAGE_HOLE = UINT32_MAX,
+	IMAGE_INLINE = 0,
+	IMAGE_DIR = 1,
+};
+
+static const char image_magic[8] = "UFSIMG01";
+
+static bool
+ufs_image_header_is_valid(struct image_header *h)
+{
+	uint32_t checksum = h->checksum;
+	h->checksum = 0;
+	bool is_valid = memcmp(h->magic, image_magic, sizeof(image_magic)) == 0 &&
+			journal_checksum(0, h, sizeof(*h)) == checksum;
+	h->checksum = checksum;
+	return is_valid;
+}
+
+/** Where the blocks of one size are placed in the allocator chunks. */
+struct image_block_layout {
+	size_t capacity;
+	size_t first_offset;
+};
+
+static void
+ufs_image_block_layout(int block_shift, struct image_block_layout *layout)
+{
+	struct block_allocator *a = ufs_block_allocator(block_shift);
+	pthread_mutex_lock(&a->lock);
+	layout->capacity = slab_chunk_capacity(&a->slab);
+	layout->first_offset = slab_block_offset(&a->slab, 0);
+	pthread_mutex_unlock(&a->lock);
+}
+
+/** A block already written into the image. */
+struct image_placed_block {
+	const char *block;
+	struct image_block location;
+};
+
+/** State of an image being written. */
+struct image_writer {
+	int fd;
+	bool is_failed;
+	/** Blocks of the small and the large size. */
+	struct image_block_layout layouts[2];
+	/** The chunks being filled for each block size. */
+	uint32_t current[2];
+	struct image_chunk *chunks;
+	uint32_t chunk_count;
+	uint32_t chunk_capacity;
+	/**
+	 * Written blocks by their addresses, so as the blocks shared by clones
+	 * are stored once. An open addressing hash table.
+	 */
+	struct image_placed_block *placed;
+	size_t placed_capacity;
+	size_t placed_count;
+	/** Metadata of the files. */
+	char *meta;
+	size_t meta_size;
+	size_t meta_capacity;
+	/** Adjacent pieces of data to write with one call. */
+	struct iovec batch[IMAGE_WRITE_BATCH];
+	int batch_count;
+	off_t batch_offset;
+	size_t batch_size;
+};
+
+static void
+image_writer_flush(struct image_writer *w)
+{
+	struct iovec *iov = w->batch;
+	int count = w->batch_count;
+	off_t offset = w->batch_offset;
+	w->batch_count = 0;
+	w->batch_size = 0;
+	while (count > 0 && !w->is_failed)
+	{
+		ssize_t rc = pwritev(w->fd, iov, count, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+		{
+			w->is_failed = true;
+			break;
+		}
+		offset += rc;
+		for (; count > 0 && (size_t)rc >= iov->iov_len; iov++, count--)
+			rc -= iov->iov_len;
+		if (count > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+}
+
+/** Write the data at the offset. It should live until the next flush. */
+static void
+image_writer_data(struct image_writer *w, off_t offset, const void *data, size_t size)
+{
+	if (size == 0)
+		return;
+	if (w->batch_count == IMAGE_WRITE_BATCH ||
+	    (w->batch_count > 0 && w->batch_offset + (off_t)w->batch_size != offset))
+		image_writer_flush(w);
+	if (w->batch_count == 0)
+		w->batch_offset = offset;
+	w->batch[w->batch_count].iov_base = (void *)data;
+	w->batch[w->batch_count].iov_len = size;
+	w->batch_count++;
+	w->batch_size += size;
+}
+
+static void
+image_writer_meta(struct image_writer *w, const void *data, size_t size)
+{
+	if (w->meta_capacity - w->meta_size < size)
+	{
+		size_t new_capacity = (w->meta_capacity + size) * 2;
+		char *new_meta = realloc(w->meta, new_capacity);
+		if (new_meta == NULL)
+		{
+			w->is_failed = true;
+			return;
+		}
+		w->meta = new_meta;
+		w->meta_capacity = new_capacity;
+	}
+	memcpy(w->meta + w->meta_size, data, size);
+	w->meta_size += size;
+}
+
+static size_t
+image_writer_find(const struct image_writer *w, const char *block)
+{
+	size_t mask = w->placed_capacity - 1;
+	size_t i = ((uintptr_t)block >> SMALL_BLOCK_SHIFT) * 0x9e3779b97f4a7c15ull >> 32 & mask;
+	while (w->placed[i].block != NULL && w->placed[i].block != block)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static int
+image_writer_grow_placed(struct image_writer *w)
+{
+	struct image_placed_block *old = w->placed;
+	size_t old_capacity = w->placed_capacity;
+	size_t capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+	w->placed = calloc(capacity, sizeof(*w->placed));
+	if (w->placed == NULL)
+	{
+		w->placed = old;
+		return -1;
+	}
+	w->placed_capacity = capacity;
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old[i].block != NULL)
+			w->placed[image_writer_find(w, old[i].block)] = old[i];
+	}
+	free(old);
+	return 0;
+}
 
-			struct filedesc* curr_file_desc = file_descriptors[i];
-			int num_blocks = 0;
-			struct block* curr_block = file->block_list;
-			bool flag = false;
-			while (curr_block != curr_file_desc->current_block)
+/** Write the block into the image, unless it is there already. */
+static void
+image_writer_block(struct image_writer *w, const char *block, int block_shift, struct image_block *location)
+{
+	if ((w->placed_count + 1) * 2 > w->placed_capacity && image_writer_grow_placed(w) != 0)
+	{
+		w->is_failed = true;
+		return;
+	}
+	size_t slot = image_writer_find(w, block);
+	if (w->placed[slot].block != NULL)
+	{
+		*location = w->placed[slot].location;
+		return;
+	}
+	int size_class = block_shift == LARGE_BLOCK_SHIFT;
+	const struct image_block_layout *layout = &w->layouts[size_class];
+	uint32_t chunk = w->current[size_class];
+	if (chunk == UINT32_MAX || w->chunks[chunk].used == layout->capacity)
+	{
+		if (w->chunk_count == w->chunk_capacity)
+		{
+			uint32_t new_capacity = w->chunk_capacity == 0 ? 16 : w->chunk_capacity * 2;
+			struct image_chunk *new_chunks = realloc(w->chunks, new_capacity * sizeof(*new_chunks));
+			if (new_chunks == NULL)
 			{
-				if (curr_block == NULL)
-				{
-					flag = true;
-					break;
-				}
-				num_blocks++;
-				curr_block = curr_block->next;
+				w->is_failed = true;
+				return;
 			}
-			if (!flag && (curr_file_desc->current_block_offset + num_blocks * BLOCK_SIZE) <= (int)file->occupied)
+			w->chunks = new_chunks;
+			w->chunk_capacity = new_capacity;
+		}
+		chunk = w->chunk_count++;
+		w->chunks[chunk].block_shift = block_shift;
+		w->chunks[chunk].used = 0;
+		w->current[size_class] = chunk;
+	}
+	location->chunk = chunk;
+	location->index = w->chunks[chunk].used++;
+	off_t offset = IMAGE_HEADER_SIZE + (off_t)chunk * SLAB_CHUNK_SIZE +
+		       layout->first_offset + ((size_t)location->index << block_shift);
+	image_writer_data(w, offset, block, (size_t)1 << block_shift);
+	w->placed[slot].block = block;
+	w->placed[slot].location = *location;
+	w->placed_count++;
+}
+
+static void
+image_writer_file(struct image_writer *w, const struct file *file)
+{
+	struct image_file f = {
+		.id = file->id,
+		.size = file->size,
+		.block_shift = file->is_inline ? IMAGE_INLINE : file->block_shift,
+		.name_len = strlen(file->name),
+	};
+	image_writer_meta(w, &f, sizeof(f));
+	image_writer_meta(w, file->name, f.name_len);
+	if (file->is_inline)
+	{
+		image_writer_meta(w, file->inline_data, file->size);
+		return;
+	}
+	for (size_t i = 0; i < file->block_count && !w->is_failed; i++)
+	{
+		struct image_block location = {.chunk = IMAGE_HOLE};
+		if (file->blocks[i] != NULL)
+			image_writer_block(w, file->blocks[i], file->block_shift, &location);
+		image_writer_meta(w, &location, sizeof(location));
+	}
+}
+
+static void
+image_writer_dir(struct image_writer *w, const char *path)
+{
+	struct image_file f = {
+		.block_shift = IMAGE_DIR,
+		.name_len = strlen(path),
+	};
+	image_writer_meta(w, &f, sizeof(f));
+	image_writer_meta(w, path, f.name_len);
+}
+
+/** Write the snapshot into a new image, which replaces the old one. */
+static int
+ufs_image_write(const struct ufs_snapshot *snap)
+{
+	struct image_writer w = {.current = {UINT32_MAX, UINT32_MAX}};
+	ufs_image_block_layout(SMALL_BLOCK_SHIFT, &w.layouts[0]);
+	ufs_image_block_layout(LARGE_BLOCK_SHIFT, &w.layouts[1]);
+	size_t path_len = strlen(image.path);
+	char *tmp_path = malloc(path_len + sizeof(".tmp"));
+	if (tmp_path == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	memcpy(tmp_path, image.path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+	w.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w.fd < 0)
+	{
+		free(tmp_path);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+
+	struct image_header h = {
+		.lsn = snap->lsn,
+		.next_file_id = atomic_load(&next_file_id),
+	};
+	memcpy(h.magic, image_magic, sizeof(image_magic));
+	for (size_t i = 0; i < snap->dir_count; i++)
+	{
+		image_writer_dir(&w, snap->dirs[i]);
+		h.file_count++;
+	}
+	for (uint32_t i = 0; i < snap->files.capacity && !w.is_failed; i++)
+	{
+		if (snap->files.files[i] == NULL)
+			continue;
+		image_writer_file(&w, snap->files.files[i]);
+		h.file_count++;
+	}
+	h.chunk_count = w.chunk_count;
+	size_t chunk_table_size = w.chunk_count * sizeof(w.chunks[0]);
+	h.meta_size = chunk_table_size + w.meta_size;
+	h.meta_checksum = journal_checksum(journal_checksum(0, w.chunks, chunk_table_size), w.meta, w.meta_size);
+	h.checksum = journal_checksum(0, &h, sizeof(h));
+	off_t meta_offset = IMAGE_HEADER_SIZE + (off_t)w.chunk_count * SLAB_CHUNK_SIZE;
+	image_writer_data(&w, meta_offset, w.chunks, chunk_table_size);
+	image_writer_data(&w, meta_offset + chunk_table_size, w.meta, w.meta_size);
+	image_writer_data(&w, 0, &h, sizeof(h));
+	image_writer_flush(&w);
+	/* The file covers all the chunks, the metadata goes after them. */
+	bool is_ok = !w.is_failed && ftruncate(w.fd, meta_offset + h.meta_size) == 0 &&
+		     fsync(w.fd) == 0;
+	close(w.fd);
+	/*
+	 * The old image is replaced only when the new one is complete. The
+	 * blocks mapped from the old one stay valid, the file lives until
+	 * they are unmapped.
+	 */
+	if (is_ok && rename(tmp_path, image.path) == 0)
+		journal_sync_dir(image.path);
+	else
+		is_ok = false;
+	if (!is_ok)
+	{
+		unlink(tmp_path);
+		ufs_error_code = UFS_ERR_IO;
+	}
+	free(tmp_path);
+	free(w.chunks);
+	free(w.placed);
+	free(w.meta);
+	return is_ok ? 0 : -1;
+}
+
+/** Read exactly @a size bytes at the offset. */
+static int
+ufs_image_read(int fd, void *buf, size_t size, off_t offset)
+{
+	while (size > 0)
+	{
+		ssize_t rc = pread(fd, buf, size, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+		buf = (char *)buf + rc;
+		size -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+/**
+ * Map the chunks of the image into the allocators. Each one is private, so
+ * the changes of the blocks are not written back into the image.
+ */
+static char *
+ufs_image_map(int fd, const struct image_chunk *chunks, uint32_t chunk_count)
+{
+	/* Reserve an aligned area, then replace it with the chunks. */
+	size_t size = (chunk_count + 1) * (size_t)SLAB_CHUNK_SIZE;
+	char *mem = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	char *start = (char *)(((uintptr_t)mem + SLAB_CHUNK_SIZE - 1) & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+	char *end = start + chunk_count * (size_t)SLAB_CHUNK_SIZE;
+	if (start > mem)
+		munmap(mem, start - mem);
+	if (mem + size > end)
+		munmap(end, mem + size - end);
+	for (uint32_t i = 0; i < chunk_count; i++)
+	{
+		char *chunk = start + i * (size_t)SLAB_CHUNK_SIZE;
+		if (mmap(chunk, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+			 IMAGE_HEADER_SIZE + i * (off_t)SLAB_CHUNK_SIZE) == MAP_FAILED)
+		{
+			/* The adopted chunks are unmapped by their allocators. */
+			munmap(chunk, end - chunk);
+			return NULL;
+		}
+		struct block_allocator *a = ufs_block_allocator(chunks[i].block_shift);
+		pthread_mutex_lock(&a->lock);
+		slab_adopt(&a->slab, chunk, chunks[i].used);
+		pthread_mutex_unlock(&a->lock);
+	}
+	return start;
+}
+
+/** Create the directory of an IMAGE_DIR entry. */
+static size_t
+ufs_image_load_dir(const struct image_file *f, const char *meta, size_t size)
+{
+	if (f->name_len == 0 || f->name_len > size - sizeof(*f))
+		return 0;
+	char *path = strndup(meta + sizeof(*f), f->name_len);
+	if (path == NULL || strlen(path) != f->name_len)
+	{
+		free(path);
+		return 0;
+	}
+	pthread_mutex_lock(&tree_lock);
+	struct dir *dir = ufs_dir_find(path, f->name_len);
+	if (dir == NULL && (dir = ufs_dir_make_parents(path)) != NULL)
+		dir = ufs_dir_create(dir, path);
+	pthread_mutex_unlock(&tree_lock);
+	free(path);
+	return dir == NULL ? 0 : sizeof(*f) + f->name_len;
+}
+
+/** Create the file described at the start of @a meta. */
+static size_t
+ufs_image_load_file(const char *meta, size_t size, const struct image_chunk *chunks, uint32_t chunk_count,
+		    const char *area)
+{
+	struct image_file f;
+	if (size < sizeof(f))
+		return 0;
+	memcpy(&f, meta, sizeof(f));
+	if (f.block_shift == IMAGE_DIR)
+		return ufs_image_load_dir(&f, meta, size);
+	bool is_inline = f.block_shift == IMAGE_INLINE;
+	if ((f.block_shift != SMALL_BLOCK_SHIFT && f.block_shift != LARGE_BLOCK_SHIFT && !is_inline) ||
+	    (is_inline && f.size > FILE_INLINE_SIZE) || f.size > MAX_FILE_SIZE || f.name_len == 0 ||
+	    f.name_len > size - sizeof(f))
+		return 0;
+	size_t block_count = is_inline ? 0 : (f.size + ((size_t)1 << f.block_shift) - 1) >> f.block_shift;
+	size_t file_meta_size = sizeof(f) + f.name_len +
+				(is_inline ? f.size : block_count * sizeof(struct image_block));
+	if (file_meta_size > size)
+		return 0;
+	struct image_block_layout layout;
+	ufs_image_block_layout(is_inline ? SMALL_BLOCK_SHIFT : (int)f.block_shift, &layout);
+	char **blocks = is_inline ? NULL : malloc((block_count + 1) * sizeof(*blocks));
+	char *name = strndup(meta + sizeof(f), f.name_len);
+	if ((blocks == NULL && !is_inline) || name == NULL || strlen(name) != f.name_len)
+		goto error;
+	const char *locations = meta + sizeof(f) + f.name_len;
+	for (size_t i = 0; i < block_count; i++)
+	{
+		struct image_block location;
+		memcpy(&location, locations + i * sizeof(location), sizeof(location));
+		if (location.chunk == IMAGE_HOLE)
+		{
+			blocks[i] = NULL;
+			continue;
+		}
+		if (location.chunk >= chunk_count || chunks[location.chunk].block_shift != f.block_shift ||
+		    location.index >= chunks[location.chunk].used)
+			goto error;
+		blocks[i] = (char *)area + location.chunk * (size_t)SLAB_CHUNK_SIZE + layout.first_offset +
+			    ((size_t)location.index << f.block_shift);
+	}
+	uint32_t hash = ufs_name_hash(name);
+	struct index_shard *shard = ufs_index_shard(hash);
+	if (ufs_find_file(shard, name, hash) != NULL)
+		goto error;
+	struct file *file = ufs_file_create(shard, name, hash, true);
+	if (file == NULL)
+		goto error;
+	for (size_t i = 0; i < block_count; i++)
+	{
+		if (blocks[i] != NULL)
+			slab_ref(blocks[i]);
+	}
+	file->size = f.size;
+	file->id = f.id;
+	if (is_inline)
+		memcpy(file->inline_data, meta + sizeof(f) + f.name_len, f.size);
+	else
+	{
+		file->blocks = blocks;
+		file->block_count = block_count;
+		file->block_capacity = block_count + 1;
+		file->block_shift = f.block_shift;
+		file->is_inline = false;
+		/* The images of the older versions keep the small files in blocks. */
+		if (f.size <= FILE_INLINE_SIZE)
+			ufs_file_inline(file);
+	}
+	free(name);
+	return file_meta_size;
+error:
+	free(blocks);
+	free(name);
+	return 0;
+}
+
+/**
+ * Load the files from the image. A missing image is empty. On failure some
+ * files can be loaded, the caller should drop them.
+ */
+static int
+ufs_image_load(const char *path, uint64_t *lsn)
+{
+	*lsn = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return 0;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	int rc = -1;
+	char *meta = NULL;
+	struct image_header h;
+	struct stat st;
+	if (ufs_image_read(fd, &h, sizeof(h), 0) != 0 || !ufs_image_header_is_valid(&h) ||
+	    fstat(fd, &st) != 0)
+		goto out;
+	off_t meta_offset = IMAGE_HEADER_SIZE + (off_t)h.chunk_count * SLAB_CHUNK_SIZE;
+	size_t chunk_table_size = h.chunk_count * sizeof(struct image_chunk);
+	/* A mapping beyond the file end would crash on access. */
+	if (h.meta_size < chunk_table_size || st.st_size < meta_offset ||
+	    (uint64_t)(st.st_size - meta_offset) < h.meta_size)
+		goto out;
+	meta = malloc(h.meta_size + 1);
+	if (meta == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out_no_io_error;
+	}
+	if (ufs_image_read(fd, meta, h.meta_size, meta_offset) != 0 ||
+	    journal_checksum(journal_checksum(0, meta, chunk_table_size), meta + chunk_table_size,
+			     h.meta_size - chunk_table_size) != h.meta_checksum)
+		goto out;
+	struct image_chunk *chunks = (struct image_chunk *)meta;
+	for (uint32_t i = 0; i < h.chunk_count; i++)
+	{
+		if (chunks[i].block_shift != SMALL_BLOCK_SHIFT && chunks[i].block_shift != LARGE_BLOCK_SHIFT)
+			goto out;
+		struct image_block_layout layout;
+		ufs_image_block_layout(chunks[i].block_shift, &layout);
+		if (chunks[i].used == 0 || chunks[i].used > layout.capacity)
+			goto out;
+	}
+	char *area = NULL;
+	if (h.chunk_count > 0 && (area = ufs_image_map(fd, chunks, h.chunk_count)) == NULL)
+		goto out;
+	size_t pos = chunk_table_size;
+	for (uint32_t i = 0; i < h.file_count; i++)
+	{
+		size_t file_meta_size = ufs_image_load_file(meta + pos, h.meta_size - pos, chunks,
+							    h.chunk_count, area);
+		if (file_meta_size == 0)
+			goto out;
+		pos += file_meta_size;
+	}
+	if (atomic_load(&next_file_id) < h.next_file_id)
+		atomic_store(&next_file_id, h.next_file_id);
+	*lsn = h.lsn;
+	rc = 0;
+out:
+	if (rc != 0)
+		ufs_error_code = UFS_ERR_IO;
+out_no_io_error:
+	free(meta);
+	close(fd);
+	return rc;
+}
+
+/** Entry of the files by their ids during the journal replay. */
+struct replay_entry {
+	uint64_t id;
+	/** NULL for a deleted file. */
+	struct file *file;
+};
+
+/** Files by ids, an open addressing hash table. */
+struct replay {
+	struct replay_entry *entries;
+	size_t capacity;
+	size_t count;
+};
+
+static struct replay_entry *
+ufs_replay_find(const struct replay *r, uint64_t id)
+{
+	size_t mask = r->capacity - 1;
+	size_t i = id * 0x9e3779b97f4a7c15ull >> 32 & mask;
+	while (r->entries[i].id != 0 && r->entries[i].id != id)
+		i = (i + 1) & mask;
+	return &r->entries[i];
+}
+
+static int
+ufs_replay_add(struct replay *r, struct file *file)
+{
+	if ((r->count + 1) * 2 > r->capacity)
+	{
+		struct replay old = *r;
+		r->capacity = old.capacity == 0 ? 64 : old.capacity * 2;
+		r->entries = calloc(r->capacity, sizeof(r->entries[0]));
+		if (r->entries == NULL)
+		{
+			*r = old;
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		for (size_t i = 0; i < old.capacity; i++)
+		{
+			if (old.entries[i].id != 0)
+				*ufs_replay_find(r, old.entries[i].id) = old.entries[i];
+		}
+		free(old.entries);
+	}
+	struct replay_entry *entry = ufs_replay_find(r, file->id);
+	if (entry->id == 0)
+		r->count++;
+	entry->id = file->id;
+	entry->file = file;
+	return 0;
+}
+
+static struct file *
+ufs_replay_get(const struct replay *r, uint64_t id)
+{
+	if (r->capacity == 0)
+		return NULL;
+	return ufs_replay_find(r, id)->file;
+}
+
+/** Apply a change of the directory tree, by the same call which was logged. */
+static void
+ufs_replay_tree(const struct journal_record *record, struct replay *r)
+{
+	char *path = strndup(record->data, record->data_size);
+	if (path == NULL)
+		return;
+	if (record->type == UFS_RECORD_MKDIR)
+		ufs_mkdir(path);
+	else if (record->type == UFS_RECORD_RMDIR)
+		ufs_rmdir(path);
+	else if (strlen(path) < record->data_size)
+	{
+		const char *new_path = record->data + strlen(path) + 1;
+		char *new_name = strndup(new_path, record->data + record->data_size - new_path);
+		uint32_t hash = new_name == NULL ? 0 : ufs_name_hash(new_name);
+		struct file *target = new_name == NULL ? NULL : ufs_find_file(ufs_index_shard(hash), new_name, hash);
+		uint64_t target_id = target == NULL ? 0 : target->id;
+		/* The replaced file is gone, like after a delete. */
+		if (new_name != NULL && ufs_rename(path, new_name) == 0 && target_id != 0 &&
+		    ufs_find_file(ufs_index_shard(hash), new_name, hash)->id != target_id)
+			ufs_replay_find(r, target_id)->file = NULL;
+		free(new_name);
+	}
+	free(path);
+}
+
+/**
+ * Apply a journal record, the same way as the logged change was done. The
+ * records of the files deleted before are skipped, they could be deleted
+ * while opened.
+ */
+static void
+ufs_replay(const struct journal_record *record, void *ctx)
+{
+	struct replay *r = ctx;
+	if (record->type == UFS_RECORD_MKDIR || record->type == UFS_RECORD_RMDIR ||
+	    record->type == UFS_RECORD_RENAME)
+	{
+		ufs_replay_tree(record, r);
+		return;
+	}
+	if (record->type == UFS_RECORD_CREATE)
+	{
+		char *name = strndup(record->data, record->data_size);
+		if (name == NULL)
+			return;
+		uint32_t hash = ufs_name_hash(name);
+		struct index_shard *shard = ufs_index_shard(hash);
+		struct file *file = NULL;
+		if (ufs_find_file(shard, name, hash) == NULL)
+			file = ufs_file_create(shard, name, hash, true);
+		free(name);
+		if (file == NULL)
+			return;
+		file->id = record->id;
+		if (atomic_load(&next_file_id) <= record->id)
+			atomic_store(&next_file_id, record->id + 1);
+		ufs_replay_add(r, file);
+		return;
+	}
+	struct file *file = ufs_replay_get(r, record->id);
+	if (file == NULL)
+		return;
+	switch (record->type)
+	{
+	case UFS_RECORD_DELETE:
+		ufs_index_remove(ufs_index_shard(file->name_hash), file);
+		ufs_dir_unlink_file(file);
+		ufs_delete_file(file);
+		ufs_replay_find(r, record->id)->file = NULL;
+		break;
+	case UFS_RECORD_WRITE:
+		ufs_file_write(file, record->data, record->data_size, record->arg);
+		break;
+	case UFS_RECORD_RESIZE:
+		if (record->arg <= MAX_FILE_SIZE)
+			ufs_file_resize(file, record->arg);
+		break;
+	case UFS_RECORD_CLONE:
+	{
+		struct file *src = ufs_replay_get(r, record->arg);
+		struct file_content content;
+		if (src != NULL && src != file && ufs_file_get_content(src, &content) == 0)
+			ufs_file_set_content(file, &content);
+		break;
+	}
+	case UFS_RECORD_REPLACE:
+		ufs_file_resize(file, 0);
+		if (record->arg <= MAX_FILE_SIZE)
+			ufs_file_resize(file, record->arg);
+		ufs_file_write(file, record->data, record->data_size, 0);
+		break;
+	case UFS_RECORD_PUNCH:
+	{
+		uint64_t size;
+		if (record->data_size != sizeof(size))
+			break;
+		memcpy(&size, record->data, sizeof(size));
+		ufs_file_punch_hole(file, record->arg, size);
+		break;
+	}
+	}
+}
+
+static void *
+ufs_checkpointer_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&image.lock);
+	while (!image.is_stopped)
+	{
+		if (!atomic_load(&image.is_checkpoint_requested))
+		{
+			pthread_cond_wait(&image.cond, &image.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&image.lock);
+		/* On failure the next try is when the journal grows more. */
+		ufs_checkpoint();
+		atomic_store(&image.is_checkpoint_requested, false);
+		pthread_mutex_lock(&image.lock);
+	}
+	pthread_mutex_unlock(&image.lock);
+	return NULL;
+}
+
+/** Stop the checkpoints and close the journal. */
+static void
+ufs_image_close(void)
+{
+	if (image.journal == NULL)
+		return;
+	pthread_mutex_lock(&image.lock);
+	image.is_stopped = true;
+	pthread_cond_signal(&image.cond);
+	pthread_mutex_unlock(&image.lock);
+	pthread_join(image.checkpointer, NULL);
+	journal_close(image.journal);
+	image.journal = NULL;
+	free(image.path);
+	image.path = NULL;
+	atomic_store(&image.is_checkpoint_requested, false);
+}
+
+int
+ufs_image_open(const char *path)
+{
+	bool has_files = root_dir.child_count > 0;
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+		has_files = has_files || file_index[i].count > 0;
+	if (image.journal != NULL || has_files)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	size_t path_len = strlen(path);
+	char *journal_path = malloc(path_len + sizeof(".journal"));
+	image.path = strdup(path);
+	if (journal_path == NULL || image.path == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto error;
+	}
+	memcpy(journal_path, path, path_len);
+	memcpy(journal_path + path_len, ".journal", sizeof(".journal"));
+	uint64_t lsn;
+	if (ufs_image_load(path, &lsn) != 0)
+		goto error;
+	struct replay replay = {0};
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+	{
+		for (uint32_t j = 0; j < file_index[i].capacity; j++)
+		{
+			struct file *file = file_index[i].files[j];
+			if (file != NULL && ufs_replay_add(&replay, file) != 0)
 			{
-				continue;
+				free(replay.entries);
+				goto error;
 			}
+		}
+	}
+	struct journal *journal = journal_open(journal_path, lsn, ufs_replay, &replay);
+	free(replay.entries);
+	if (journal == NULL)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		goto error;
+	}
+	image.is_stopped = false;
+	atomic_store(&image.checkpoint_size, CHECKPOINT_JOURNAL_SIZE);
+	if (pthread_create(&image.checkpointer, NULL, ufs_checkpointer_f, NULL) != 0)
+	{
+		journal_close(journal);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto error;
+	}
+	image.journal = journal;
+	free(journal_path);
+	return 0;
+error:
+	free(journal_path);
+	free(image.path);
+	image.path = NULL;
+	/* Drop what is loaded. */
+	ufs_destroy();
+	return -1;
+}
+
+int
+ufs_checkpoint(void)
+{
+	if (image.journal == NULL)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_mutex_lock(&image.checkpoint_lock);
+	int rc = -1;
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	if (snap != NULL)
+	{
+		rc = ufs_image_write(snap);
+		if (rc == 0 && journal_compact(image.journal, snap->lsn) != 0)
+		{
+			ufs_error_code = UFS_ERR_IO;
+			rc = -1;
+		}
+		ufs_snapshot_delete(snap);
+	}
+	atomic_store(&image.checkpoint_size, journal_size(image.journal) + CHECKPOINT_JOURNAL_SIZE);
+	pthread_mutex_unlock(&image.checkpoint_lock);
+	return rc;
+}
+
+int
+ufs_sync(void)
+{
+	if (image.journal == NULL)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	if (journal_sync(image.journal) != 0)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+off_t
+ufs_seek(int fd, off_t offset, int whence)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	struct file *file = file_desc->file;
+	off_t rc = -1;
+	pthread_rwlock_rdlock(&file->lock);
+	pthread_mutex_lock(&file_desc->pos_lock);
+	size_t base;
+	switch (whence)
+	{
+	case UFS_SEEK_SET:
+		base = 0;
+		break;
+	case UFS_SEEK_CUR:
+		base = file_desc->pos;
+		break;
+	case UFS_SEEK_END:
+		base = file->size;
+		break;
+	default:
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	if ((offset < 0 && (size_t)-offset > base) ||
+	    (offset > 0 && (size_t)offset > MAX_FILE_SIZE - base))
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	file_desc->pos = base + offset;
+	rc = file_desc->pos;
+out:
+	pthread_mutex_unlock(&file_desc->pos_lock);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_READ_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	if (new_size > MAX_FILE_SIZE)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_wrlock(&file->lock);
+	bool is_shrink = new_size < file->size;
+	int rc = ufs_file_resize(file, new_size);
+	if (rc == 0)
+		ufs_log(UFS_RECORD_RESIZE, file->id, new_size, NULL, 0);
+	if (rc == 0 && is_shrink)
+		ufs_file_clamp_positions(file, new_size);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+int
+ufs_punch_hole(int fd, size_t offset, size_t size)
+{
+	struct filedesc *file_desc = ufs_get_file_descriptor(fd);
+	if (file_desc == NULL)
+		return -1;
+	if (file_desc->mode == UFS_READ_ONLY)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *file = file_desc->file;
+	pthread_rwlock_wrlock(&file->lock);
+	int rc = ufs_file_punch_hole(file, offset, size);
+	if (rc == 0)
+	{
+		uint64_t hole_size = size;
+		struct iovec data = {&hole_size, sizeof(hole_size)};
+		ufs_log(UFS_RECORD_PUNCH, file->id, offset, &data, 1);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
 
-			curr_file_desc->current_block = file->last_block;
-			curr_file_desc->current_block_offset = file->last_block->occupied;
-		}
-    }
-    return 0;
+void
+ufs_dedup_enable(bool is_enabled)
+{
+	atomic_store(&dedup_is_enabled, is_enabled);
+}
+
+void
+ufs_get_stats(struct ufs_stats *stats)
+{
+	struct block_allocator *allocators[] = {&small_blocks, &large_blocks};
+	memset(stats, 0, sizeof(*stats));
+	for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+	{
+		struct block_allocator *a = allocators[i];
+		pthread_mutex_lock(&a->lock);
+		size_t ref_total = slab_ref_total(&a->slab);
+		stats->block_count += a->slab.block_count;
+		stats->block_memory += a->slab.block_count * a->slab.block_size;
+		/* The blocks loaded from an image can have no references yet. */
+		if (ref_total > a->slab.block_count)
+			stats->shared_memory += (ref_total - a->slab.block_count) * a->slab.block_size;
+		pthread_mutex_unlock(&a->lock);
+		pthread_mutex_lock(&a->dedup.lock);
+		stats->dedup_block_count += a->dedup.count;
+		stats->dedup_hit_count += a->dedup.hit_count;
+		stats->dedup_zero_count += a->dedup.zero_count;
+		pthread_mutex_unlock(&a->dedup.lock);
+	}
+	pthread_mutex_lock(&file_descriptors_lock);
+	struct filedesc_table *table = atomic_load_explicit(&file_descriptors, memory_order_relaxed);
+	stats->fd_count = file_descriptors_count;
+	stats->fd_capacity = table == NULL ? 0 : table->capacity;
+	pthread_mutex_unlock(&file_descriptors_lock);
 }
 
 int
 ufs_close(int fd)
 {
-	
-	if (fd <= 0 || fd > file_descriptors_capacity || file_descriptors[fd - 1] == NULL)
+	pthread_mutex_lock(&file_descriptors_lock);
+	struct filedesc_table *table = atomic_load_explicit(&file_descriptors, memory_order_relaxed);
+	struct filedesc *file_desc = NULL;
+	if (table != NULL && fd > 0 && fd <= table->capacity)
+		file_desc = atomic_load_explicit(&table->descs[fd - 1], memory_order_relaxed);
+	if (file_desc == NULL)
 	{
+		pthread_mutex_unlock(&file_descriptors_lock);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
-	struct file* current_file = ufs_delete_file_descriptor(fd);
-
-	if (current_file->refs == 0 && current_file->marked_as_deleted)
+	atomic_store_explicit(&table->descs[fd - 1], NULL, memory_order_relaxed);
+	file_descriptors_count--;
+	ufs_filedesc_bits_release(table->capacity, fd - 1);
+	/*
+	 * Halve the table when its upper half is free and it is at most a
+	 * quarter full, so as the next opens don't grow it right back. And
+	 * again while the same is true for the halved one.
+	 */
+	if (table->capacity > FILEDESC_MIN_CAPACITY && filedesc_bits.upper_count == 0 &&
+	    file_descriptors_count <= table->capacity / 4)
 	{
-		ufs_delete_file(current_file);
+		int capacity = table->capacity / 2;
+		while (capacity > FILEDESC_MIN_CAPACITY && file_descriptors_count <= capacity / 4 &&
+		       ufs_filedesc_bits_are_free(capacity / 2, capacity))
+			capacity /= 2;
+		ufs_file_descriptors_resize(capacity);
 	}
+	struct file *file = file_desc->file;
+	if (filedesc_cache_count < FILEDESC_CACHE_SIZE)
+	{
+		file_desc->file = (struct file *)filedesc_cache;
+		filedesc_cache = file_desc;
+		filedesc_cache_count++;
+		file_desc = NULL;
+	}
+	pthread_mutex_unlock(&file_descriptors_lock);
 
+	if (file_desc != NULL)
+	{
+		pthread_mutex_destroy(&file_desc->pos_lock);
+		free(file_desc);
+	}
+	ufs_file_unref(file);
 	return 0;
 }
 
 int
 ufs_delete(const char *filename)
 {
-	struct file* file_to_delete = ufs_find_file(filename);
+	uint32_t hash = ufs_name_hash(filename);
+	struct index_shard *shard = ufs_index_shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	struct file* file_to_delete = ufs_find_file(shard, filename, hash);
 	if (file_to_delete == NULL)
 	{
+		pthread_mutex_unlock(&shard->lock);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
+	/* The name is free for new files already. */
+	ufs_index_remove(shard, file_to_delete);
+	ufs_log(UFS_RECORD_DELETE, file_to_delete->id, 0, NULL, 0);
+	pthread_mutex_lock(&tree_lock);
+	ufs_dir_unlink_file(file_to_delete);
+	pthread_mutex_unlock(&tree_lock);
+	bool is_unused = file_to_delete->refs == 0;
+	if (!is_unused)
+		file_to_delete->marked_as_deleted = true;
+	pthread_mutex_unlock(&shard->lock);
+	if (is_unused)
+		ufs_delete_file(file_to_delete);
+	return 0;
+}
+
+static void
+ufs_log_path(enum ufs_record_type type, const char *path)
+{
+	struct iovec data = {(char *)path, strlen(path)};
+	ufs_log(type, 0, 0, &data, 1);
+}
 
-	if (file_to_delete->refs > 0)
+int
+ufs_mkdir(const char *path)
+{
+	if (!ufs_path_is_valid(path))
 	{
-		file_to_delete->marked_as_deleted = true;
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
 	}
-	else
+	/* The shard lock keeps a file with the same path from being created. */
+	uint32_t hash = ufs_name_hash(path);
+	struct index_shard *shard = ufs_index_shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	pthread_mutex_lock(&tree_lock);
+	int rc = -1;
+	struct dir *parent = ufs_dir_parent(path);
+	if (parent == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	else if (ufs_find_file(shard, path, hash) != NULL || ufs_dir_find(path, strlen(path)) != NULL)
+		ufs_error_code = UFS_ERR_EXISTS;
+	else if (ufs_dir_create(parent, path) != NULL)
 	{
-		ufs_delete_file(file_to_delete);
+		ufs_log_path(UFS_RECORD_MKDIR, path);
+		rc = 0;
+	}
+	pthread_mutex_unlock(&tree_lock);
+	pthread_mutex_unlock(&shard->lock);
+	return rc;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	if (*path == 0)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_mutex_lock(&tree_lock);
+	struct dir *dir = ufs_dir_find(path, strlen(path));
+	if (dir == NULL || dir->child_count > 0)
+	{
+		pthread_mutex_unlock(&tree_lock);
+		ufs_error_code = dir == NULL ? UFS_ERR_NO_FILE : UFS_ERR_NOT_EMPTY;
+		return -1;
+	}
+	ufs_dir_index_remove(dir);
+	ufs_dir_unlink_dir(dir);
+	ufs_log_path(UFS_RECORD_RMDIR, path);
+	pthread_mutex_unlock(&tree_lock);
+	free(dir->name);
+	free(dir);
+	return 0;
+}
+
+/**
+ * Make room in the shard for @a count more files, so as the next inserts
+ * can't fail.
+ */
+static int
+ufs_index_reserve(struct index_shard *shard, uint32_t count)
+{
+	while ((shard->count + count) * 4 > shard->capacity * 3)
+	{
+		if (ufs_index_grow(shard) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/** Give the file a new path. The index has room for it. */
+static void
+ufs_file_move(struct file *file, char *name, uint32_t hash)
+{
+	ufs_index_remove(ufs_index_shard(file->name_hash), file);
+	free(file->name);
+	file->name = name;
+	file->name_hash = hash;
+	int rc = ufs_index_insert(ufs_index_shard(hash), file);
+	assert(rc == 0);
+	(void)rc;
+}
+
+/**
+ * Rename a file, replacing the file at the new path. The replaced file is
+ * returned in @a replaced when it has to be freed. All the shard locks and
+ * the tree lock should be taken.
+ */
+static int
+ufs_rename_file(struct file *file, const char *new_path, struct file **replaced)
+{
+	uint32_t hash = ufs_name_hash(new_path);
+	struct index_shard *shard = ufs_index_shard(hash);
+	struct dir *parent = ufs_dir_parent(new_path);
+	if (parent == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
 	}
+	if (ufs_dir_find(new_path, strlen(new_path)) != NULL)
+	{
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	struct file *target = ufs_find_file(shard, new_path, hash);
+	if (target == file)
+		return 0;
+	char *name = strdup(new_path);
+	if (name == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (ufs_index_reserve(shard, 1) != 0)
+	{
+		free(name);
+		return -1;
+	}
+	if (target != NULL)
+	{
+		ufs_index_remove(shard, target);
+		ufs_dir_unlink_file(target);
+		if (target->refs == 0)
+			*replaced = target;
+		else
+			target->marked_as_deleted = true;
+	}
+	ufs_file_move(file, name, hash);
+	ufs_dir_unlink_file(file);
+	ufs_dir_link_file(parent, file);
+	return 0;
+}
+
+/** New path of a directory or a file of a renamed subtree. */
+struct rename_entry {
+	char *name;
+	uint32_t hash;
+};
+
+/** Make the new path: @a new_path instead of the first @a old_len bytes of @a old_name. */
+static int
+ufs_rename_entry_make(struct rename_entry *entry, const char *old_name, size_t old_len, const char *new_path,
+		      size_t new_len)
+{
+	size_t tail_size = strlen(old_name) - old_len + 1;
+	entry->name = malloc(new_len + tail_size);
+	if (entry->name == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	memcpy(entry->name, new_path, new_len);
+	memcpy(entry->name + new_len, old_name + old_len, tail_size);
+	entry->hash = ufs_name_hash(entry->name);
+	return 0;
+}
+
+/**
+ * Rename a directory and everything in it. All the new paths are made and
+ * the indexes are grown first, so as a failure changes nothing. All the
+ * shard locks and the tree lock should be taken.
+ */
+static int
+ufs_rename_dir(struct dir *dir, const char *new_path)
+{
+	size_t old_len = strlen(dir->name);
+	size_t new_len = strlen(new_path);
+	if (strncmp(new_path, dir->name, old_len) == 0 && (new_path[old_len] == 0 || new_path[old_len] == '/'))
+	{
+		if (new_len == old_len)
+			return 0;
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct dir *parent = ufs_dir_parent(new_path);
+	if (parent == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	uint32_t hash = ufs_name_hash(new_path);
+	if (ufs_dir_find(new_path, new_len) != NULL || ufs_find_file(ufs_index_shard(hash), new_path, hash) != NULL)
+	{
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	size_t count = 0;
+	for (struct dir *d = dir; d != NULL; d = ufs_dir_next(d, dir))
+		count += d->child_count + 1;
+	struct rename_entry *entries = malloc(count * sizeof(*entries));
+	if (entries == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	uint32_t shard_counts[INDEX_SHARD_COUNT] = {0};
+	size_t entry_count = 0;
+	int rc = 0;
+	/* Each directory goes before its files. */
+	for (struct dir *d = dir; d != NULL && rc == 0; d = ufs_dir_next(d, dir))
+	{
+		rc = ufs_rename_entry_make(&entries[entry_count], d->name, old_len, new_path, new_len);
+		for (struct file *f = d->files; f != NULL && rc == 0; f = f->dir_next)
+		{
+			entry_count++;
+			rc = ufs_rename_entry_make(&entries[entry_count], f->name, old_len, new_path, new_len);
+			if (rc == 0)
+				shard_counts[ufs_index_shard(entries[entry_count].hash) - file_index]++;
+		}
+		if (rc == 0)
+			entry_count++;
+	}
+	for (int i = 0; i < INDEX_SHARD_COUNT && rc == 0; i++)
+		rc = ufs_index_reserve(&file_index[i], shard_counts[i]);
+	if (rc != 0)
+	{
+		for (size_t i = 0; i < entry_count; i++)
+			free(entries[i].name);
+		free(entries);
+		return -1;
+	}
+	/* The same walk, the tree is not changed by the renames. */
+	size_t i = 0;
+	for (struct dir *d = dir; d != NULL; d = ufs_dir_next(d, dir))
+	{
+		ufs_dir_index_remove(d);
+		free(d->name);
+		d->name = entries[i].name;
+		d->name_hash = entries[i].hash;
+		ufs_dir_index_add(d);
+		i++;
+		for (struct file *f = d->files; f != NULL; f = f->dir_next, i++)
+			ufs_file_move(f, entries[i].name, entries[i].hash);
+	}
+	assert(i == entry_count);
+	free(entries);
+	ufs_dir_unlink_dir(dir);
+	ufs_dir_link_dir(parent, dir);
 	return 0;
 }
 
+int
+ufs_rename(const char *old_path, const char *new_path)
+{
+	if (!ufs_path_is_valid(old_path) || !ufs_path_is_valid(new_path))
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	/*
+	 * The renames are rare, so all the shards are locked: a file moves
+	 * between two of them, and a directory can move files between any.
+	 */
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+		pthread_mutex_lock(&file_index[i].lock);
+	pthread_mutex_lock(&tree_lock);
+	int rc = -1;
+	struct file *replaced = NULL;
+	uint32_t hash = ufs_name_hash(old_path);
+	struct file *file = ufs_find_file(ufs_index_shard(hash), old_path, hash);
+	struct dir *dir = ufs_dir_find(old_path, strlen(old_path));
+	if (file != NULL)
+		rc = ufs_rename_file(file, new_path, &replaced);
+	else if (dir != NULL)
+		rc = ufs_rename_dir(dir, new_path);
+	else
+		ufs_error_code = UFS_ERR_NO_FILE;
+	if (rc == 0)
+	{
+		struct iovec data[] = {
+			{(char *)old_path, strlen(old_path) + 1},
+			{(char *)new_path, strlen(new_path)},
+		};
+		ufs_log(UFS_RECORD_RENAME, 0, 0, data, 2);
+	}
+	pthread_mutex_unlock(&tree_lock);
+	for (int i = INDEX_SHARD_COUNT - 1; i >= 0; i--)
+		pthread_mutex_unlock(&file_index[i].lock);
+	if (replaced != NULL)
+		ufs_delete_file(replaced);
+	return rc;
+}
+
+/** Listing of a directory, the names are stored after the entries. */
+struct ufs_dir {
+	size_t count;
+	size_t pos;
+	struct ufs_dirent entries[];
+};
+
+struct ufs_dir *
+ufs_opendir(const char *path)
+{
+	pthread_mutex_lock(&tree_lock);
+	struct dir *dir = ufs_dir_find(path, strlen(path));
+	if (dir == NULL)
+	{
+		pthread_mutex_unlock(&tree_lock);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	/* A name in the directory is the path after the one of the directory and a slash. */
+	size_t skip = dir == &root_dir ? 0 : strlen(dir->name) + 1;
+	size_t names_size = 0;
+	for (struct dir *d = dir->dirs; d != NULL; d = d->next)
+		names_size += strlen(d->name) - skip + 1;
+	for (struct file *f = dir->files; f != NULL; f = f->dir_next)
+		names_size += strlen(f->name) - skip + 1;
+	struct ufs_dir *list = malloc(sizeof(*list) + dir->child_count * sizeof(list->entries[0]) + names_size);
+	if (list == NULL)
+	{
+		pthread_mutex_unlock(&tree_lock);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	list->count = dir->child_count;
+	list->pos = 0;
+	char *names = (char *)&list->entries[list->count];
+	size_t i = 0;
+	for (struct dir *d = dir->dirs; d != NULL; d = d->next, i++)
+	{
+		size_t size = strlen(d->name) - skip + 1;
+		memcpy(names, d->name + skip, size);
+		list->entries[i].name = names;
+		list->entries[i].is_dir = true;
+		names += size;
+	}
+	for (struct file *f = dir->files; f != NULL; f = f->dir_next, i++)
+	{
+		size_t size = strlen(f->name) - skip + 1;
+		memcpy(names, f->name + skip, size);
+		list->entries[i].name = names;
+		list->entries[i].is_dir = false;
+		names += size;
+	}
+	pthread_mutex_unlock(&tree_lock);
+	return list;
+}
+
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir)
+{
+	if (dir->pos == dir->count)
+		return NULL;
+	return &dir->entries[dir->pos++];
+}
+
 void
-ufs_destroy(void)
+ufs_closedir(struct ufs_dir *dir)
+{
+	free(dir);
+}
+
+enum {
+	/**
+	 * Most operations done at once, by a worker or by a submit without
+	 * workers. The runs of one descriptor are grouped inside a batch.
+	 */
+	RING_BATCH = 32,
+	RING_MAX_ENTRIES = 1 << 16,
+};
+
+/**
+ * A ring of operations. The entries, their head and tail and the count of
+ * the operations in flight are used only by the owner thread. The pending
+ * operations and the completions are shared with the workers under the
+ * lock. There are at most as many of them as the operations in flight, so
+ * all the arrays have the size of the ring and never overflow.
+ */
+struct ufs_ring {
+	unsigned mask;
+	/** Entries got and not submitted are [sq_head, sq_tail). */
+	struct ufs_sqe *sqes;
+	unsigned sq_head;
+	unsigned sq_tail;
+	/** Submitted and not reaped. */
+	unsigned in_flight;
+	pthread_mutex_t lock;
+	/** Signaled on new pending operations and on the stop. */
+	pthread_cond_t work_cond;
+	/** Signaled on new completions. */
+	pthread_cond_t done_cond;
+	/** Submitted and not taken by the workers yet. */
+	struct ufs_sqe *pending;
+	unsigned pending_head;
+	unsigned pending_tail;
+	struct ufs_cqe *cqes;
+	unsigned cq_head;
+	unsigned cq_tail;
+	bool is_stopped;
+	int worker_count;
+	pthread_t workers[];
+};
+
+static void
+ufs_ring_complete_with(struct ufs_cqe *cqe, const struct ufs_sqe *sqe, ssize_t res)
+{
+	cqe->user_data = sqe->user_data;
+	cqe->res = res;
+	cqe->error = res < 0 ? ufs_error_code : UFS_ERR_NO_ERR;
+}
+
+/**
+ * Do the positional reads or the writes of one descriptor at the start of
+ * the batch, with one lookup and one file lock for all of them.
+ * @return How many operations are done, 0 when there is no such run.
+ */
+static int
+ufs_ring_execute_run(const struct ufs_sqe *sqes, int count, struct ufs_cqe *cqes)
+{
+	enum ufs_op op = sqes[0].op;
+	if (op != UFS_OP_PREAD && op != UFS_OP_PWRITE)
+		return 0;
+	int run = 1;
+	while (run < count && sqes[run].op == op && sqes[run].fd == sqes[0].fd)
+		run++;
+	if (run == 1)
+		return 0;
+	struct filedesc *file_desc = ufs_get_file_descriptor(sqes[0].fd);
+	bool is_read = op == UFS_OP_PREAD;
+	if (file_desc != NULL && file_desc->mode == (is_read ? UFS_WRITE_ONLY : UFS_READ_ONLY))
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		file_desc = NULL;
+	}
+	if (file_desc == NULL)
+	{
+		for (int i = 0; i < run; i++)
+			ufs_ring_complete_with(&cqes[i], &sqes[i], -1);
+		return run;
+	}
+	struct file *file = file_desc->file;
+	if (is_read)
+		pthread_rwlock_rdlock(&file->lock);
+	else
+		pthread_rwlock_wrlock(&file->lock);
+	for (int i = 0; i < run; i++)
+	{
+		const struct ufs_sqe *sqe = &sqes[i];
+		ssize_t res;
+		if (is_read)
+		{
+			res = ufs_file_read(file, sqe->buf, sqe->size, sqe->offset);
+		}
+		else
+		{
+			res = ufs_file_write(file, sqe->buf, sqe->size, sqe->offset);
+			if (res > 0)
+				ufs_log_write(file, sqe->buf, res, sqe->offset);
+		}
+		ufs_ring_complete_with(&cqes[i], sqe, res);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return run;
+}
+
+static void
+ufs_ring_execute_one(const struct ufs_sqe *sqe, struct ufs_cqe *cqe)
+{
+	ssize_t res;
+	switch (sqe->op)
+	{
+	case UFS_OP_NOP:
+		res = 0;
+		break;
+	case UFS_OP_OPEN:
+		res = ufs_open(sqe->name, sqe->flags);
+		break;
+	case UFS_OP_CLOSE:
+		res = ufs_close(sqe->fd);
+		break;
+	case UFS_OP_DELETE:
+		res = ufs_delete(sqe->name);
+		break;
+	case UFS_OP_READ:
+		res = ufs_read(sqe->fd, sqe->buf, sqe->size);
+		break;
+	case UFS_OP_WRITE:
+		res = ufs_write(sqe->fd, sqe->buf, sqe->size);
+		break;
+	case UFS_OP_PREAD:
+		res = ufs_pread(sqe->fd, sqe->buf, sqe->size, sqe->offset);
+		break;
+	case UFS_OP_PWRITE:
+		res = ufs_pwrite(sqe->fd, sqe->buf, sqe->size, sqe->offset);
+		break;
+	case UFS_OP_RESIZE:
+		res = ufs_resize(sqe->fd, sqe->offset);
+		break;
+	default:
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		res = -1;
+		break;
+	}
+	ufs_ring_complete_with(cqe, sqe, res);
+}
+
+static void
+ufs_ring_execute(const struct ufs_sqe *sqes, int count, struct ufs_cqe *cqes)
+{
+	int i = 0;
+	while (i < count)
+	{
+		int run = ufs_ring_execute_run(sqes + i, count - i, cqes + i);
+		if (run == 0)
+		{
+			ufs_ring_execute_one(&sqes[i], &cqes[i]);
+			run = 1;
+		}
+		i += run;
+	}
+}
+
+/** Publish the completions of a batch. */
+static void
+ufs_ring_complete(struct ufs_ring *ring, const struct ufs_cqe *cqes, int count)
+{
+	pthread_mutex_lock(&ring->lock);
+	for (int i = 0; i < count; i++)
+		ring->cqes[ring->cq_tail++ & ring->mask] = cqes[i];
+	pthread_cond_signal(&ring->done_cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void *
+ufs_ring_worker_f(void *arg)
+{
+	struct ufs_ring *ring = arg;
+	struct ufs_sqe sqes[RING_BATCH];
+	struct ufs_cqe cqes[RING_BATCH];
+	pthread_mutex_lock(&ring->lock);
+	while (true)
+	{
+		while (ring->pending_head == ring->pending_tail && !ring->is_stopped)
+			pthread_cond_wait(&ring->work_cond, &ring->lock);
+		/* A stopped ring is drained first. */
+		if (ring->pending_head == ring->pending_tail)
+			break;
+		/* An equal part for each worker, so as they all have work. */
+		unsigned count = ring->pending_tail - ring->pending_head;
+		count = (count + ring->worker_count - 1) / ring->worker_count;
+		if (count > RING_BATCH)
+			count = RING_BATCH;
+		for (unsigned i = 0; i < count; i++)
+			sqes[i] = ring->pending[ring->pending_head++ & ring->mask];
+		pthread_mutex_unlock(&ring->lock);
+		ufs_ring_execute(sqes, count, cqes);
+		ufs_ring_complete(ring, cqes, count);
+		pthread_mutex_lock(&ring->lock);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+static void
+ufs_ring_stop(struct ufs_ring *ring, int worker_count)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->is_stopped = true;
+	pthread_cond_broadcast(&ring->work_cond);
+	pthread_mutex_unlock(&ring->lock);
+	for (int i = 0; i < worker_count; i++)
+		pthread_join(ring->workers[i], NULL);
+	pthread_cond_destroy(&ring->done_cond);
+	pthread_cond_destroy(&ring->work_cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->sqes);
+	free(ring->pending);
+	free(ring->cqes);
+	free(ring);
+}
+
+struct ufs_ring *
+ufs_ring_create(unsigned entries, int worker_count)
+{
+	if (entries == 0 || entries > RING_MAX_ENTRIES || worker_count < 0)
+	{
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return NULL;
+	}
+	unsigned capacity = 1;
+	while (capacity < entries)
+		capacity *= 2;
+	struct ufs_ring *ring = calloc(1, sizeof(*ring) + worker_count * sizeof(ring->workers[0]));
+	if (ring == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	ring->mask = capacity - 1;
+	ring->sqes = malloc(capacity * sizeof(ring->sqes[0]));
+	ring->pending = malloc(capacity * sizeof(ring->pending[0]));
+	ring->cqes = malloc(capacity * sizeof(ring->cqes[0]));
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->work_cond, NULL);
+	pthread_cond_init(&ring->done_cond, NULL);
+	ring->worker_count = worker_count;
+	if (ring->sqes == NULL || ring->pending == NULL || ring->cqes == NULL)
+	{
+		ufs_ring_stop(ring, 0);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	for (int i = 0; i < worker_count; i++)
+	{
+		if (pthread_create(&ring->workers[i], NULL, ufs_ring_worker_f, ring) != 0)
+		{
+			ufs_ring_stop(ring, i);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return NULL;
+		}
+	}
+	return ring;
+}
+
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring)
+{
+	if (ring->sq_tail - ring->sq_head + ring->in_flight > ring->mask)
+		return NULL;
+	struct ufs_sqe *sqe = &ring->sqes[ring->sq_tail++ & ring->mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+ufs_ring_submit(struct ufs_ring *ring)
 {
-	for (int i = 0; i < file_descriptors_count; i++) {
-		ufs_close(i + 1);
+	int count = ring->sq_tail - ring->sq_head;
+	ring->in_flight += count;
+	if (ring->worker_count == 0)
+	{
+		struct ufs_sqe sqes[RING_BATCH];
+		struct ufs_cqe cqes[RING_BATCH];
+		while (ring->sq_head != ring->sq_tail)
+		{
+			int batch = 0;
+			for (; batch < RING_BATCH && ring->sq_head != ring->sq_tail; batch++)
+				sqes[batch] = ring->sqes[ring->sq_head++ & ring->mask];
+			ufs_ring_execute(sqes, batch, cqes);
+			ufs_ring_complete(ring, cqes, batch);
+		}
+		return count;
 	}
+	pthread_mutex_lock(&ring->lock);
+	while (ring->sq_head != ring->sq_tail)
+		ring->pending[ring->pending_tail++ & ring->mask] = ring->sqes[ring->sq_head++ & ring->mask];
+	pthread_cond_broadcast(&ring->work_cond);
+	pthread_mutex_unlock(&ring->lock);
+	return count;
+}
+
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count, int min_count)
+{
+	if (min_count > (int)ring->in_flight)
+		min_count = ring->in_flight;
+	if (min_count > count)
+		min_count = count;
+	pthread_mutex_lock(&ring->lock);
+	while ((int)(ring->cq_tail - ring->cq_head) < min_count)
+		pthread_cond_wait(&ring->done_cond, &ring->lock);
+	int reaped = 0;
+	for (; reaped < count && ring->cq_head != ring->cq_tail; reaped++)
+		cqes[reaped] = ring->cqes[ring->cq_head++ & ring->mask];
+	pthread_mutex_unlock(&ring->lock);
+	ring->in_flight -= reaped;
+	return reaped;
+}
+
+void
+ufs_ring_delete(struct ufs_ring *ring)
+{
+	ufs_ring_stop(ring, ring->worker_count);
+}
 
-	struct file* current_file = file_list;
-	struct file* next_file = NULL;
-	while (current_file != NULL)
+void
+ufs_destroy(void)
+{
+	ufs_image_close();
+	/* The closes can shrink the table, it is loaded again each time. */
+	struct filedesc_table *table;
+	for (int i = 0; (table = atomic_load(&file_descriptors)) != NULL && i < table->capacity; i++) {
+		if (atomic_load(&table->descs[i]) != NULL)
+			ufs_close(i + 1);
+	}
+	free(atomic_load(&file_descriptors));
+	atomic_store(&file_descriptors, NULL);
+	file_descriptors_count = 0;
+	free(filedesc_bits.used);
+	free(filedesc_bits.full);
+	memset(&filedesc_bits, 0, sizeof(filedesc_bits));
+	while (filedesc_cache != NULL)
 	{
-		next_file = current_file->next;
-		ufs_delete_file(current_file);
-		current_file = next_file;
+		struct filedesc *desc = filedesc_cache;
+		filedesc_cache = (struct filedesc *)desc->file;
+		pthread_mutex_destroy(&desc->pos_lock);
+		free(desc);
 	}
+	filedesc_cache_count = 0;
 
-	free(file_list);
-	free(last_file);
-	free(file_descriptors);
+	for (int i = 0; i < INDEX_SHARD_COUNT; i++)
+	{
+		struct index_shard *shard = &file_index[i];
+		for (uint32_t j = 0; j < shard->capacity; j++)
+		{
+			if (shard->files[j] != NULL)
+				ufs_delete_file(shard->files[j]);
+		}
+		free(shard->files);
+		shard->files = NULL;
+		shard->capacity = 0;
+		shard->count = 0;
+	}
+	for (size_t i = 0; i < dir_index.capacity; i++)
+	{
+		while (dir_index.buckets[i] != NULL)
+		{
+			struct dir *dir = dir_index.buckets[i];
+			dir_index.buckets[i] = dir->hash_next;
+			free(dir->name);
+			free(dir);
+		}
+	}
+	free(dir_index.buckets);
+	memset(&dir_index, 0, sizeof(dir_index));
+	root_dir.dirs = NULL;
+	root_dir.files = NULL;
+	root_dir.child_count = 0;
+	struct block_allocator *allocators[] = {&small_blocks, &large_blocks};
+	for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+	{
+		struct dedup_index *d = &allocators[i]->dedup;
+		/* Left pins and snapshots keep entries, their blocks go away. */
+		free(d->entries);
+		d->entries = NULL;
+		d->capacity = 0;
+		d->count = 0;
+		d->hit_count = 0;
+		d->zero_count = 0;
+		slab_destroy(&allocators[i]->slab);
+	}
 }
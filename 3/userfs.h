@@ -1,12 +1,23 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of blocks, so any offset
+ * is accessed in constant time. A file of up to 128 bytes takes no
+ * blocks, its data is kept inline. A file has an unique path: names
+ * of the directories and of the file, separated by slashes, like
+ * "dir/subdir/file", without a leading slash. The directories are made
+ * by ufs_mkdir(), a name without slashes is in the root.
+ *
+ * All the functions except ufs_destroy() can be called from multiple
+ * threads. Reads of a file run in parallel, writes into it are
+ * serialized. Closing a descriptor while another thread uses it is
+ * not allowed.
  */
 
 
@@ -54,9 +65,23 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARG,
+	UFS_ERR_IO,
+	UFS_ERR_EXISTS,
+	UFS_ERR_NOT_EMPTY,
+};
+
+/** Where the offset of ufs_seek() is counted from. */
+enum ufs_seek_whence {
+	/** From the file start. */
+	UFS_SEEK_SET = 0,
+	/** From the current descriptor position. */
+	UFS_SEEK_CUR,
+	/** From the file end. */
+	UFS_SEEK_END,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the current thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -65,10 +90,13 @@ ufs_errno();
  * @param filename Name of a file to open.
  * @param flags Bitwise combination of open_flags.
  *
- * @retval > 0 File descriptor.
+ * @retval > 0 File descriptor, the lowest free number.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or no directory to create it in.
+ *     - UFS_ERR_EXISTS - a directory has this path.
+ *     - UFS_ERR_INVALID_ARG - the path of a new file is empty, or
+ *       has an empty name in it, like "a//b" or "a/".
  */
 int
 ufs_open(const char *filename, int flags);
@@ -101,6 +129,182 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the given offset. The descriptor position
+ * is not changed. If @a offset is beyond the file end, the gap is
+ * filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is read only.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the file would be
+ *       bigger than the max file size.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 @a offset is at or beyond the file end.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is write only.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+enum {
+	/** Max count of buffers for ufs_writev() and ufs_readv(). */
+	UFS_IOV_MAX = 1024,
+};
+
+/**
+ * Write data from several buffers to the file, one after another, as
+ * a single write. Other threads see either none or all of it.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Count of @a iov, from 0 to UFS_IOV_MAX.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - @a iovcnt is negative or above UFS_IOV_MAX.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is read only.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the file would be
+ *       bigger than the max file size.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data from the file into several buffers, filling them one
+ * after another.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Count of @a iov, from 0 to UFS_IOV_MAX.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - @a iovcnt is negative or above UFS_IOV_MAX.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is write only.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Pin of the file data returned by ufs_read_view(). */
+struct ufs_pin;
+
+/**
+ * Read data from the file without copying. @a iov is filled with
+ * pointers to the file's own memory, which can be passed to writev()
+ * or sendmsg() as is. The memory must not be written. The descriptor
+ * position is moved like by ufs_read().
+ *
+ * The memory stays valid and unchanged until the pin is released, even
+ * if the file is changed, truncated, deleted or the descriptor is
+ * closed. The pin shares the file blocks, so the file copies a block
+ * on its next change instead.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to read.
+ * @param iov Array to fill with the data parts.
+ * @param[in,out] iovcnt Count of @a iov. On return - how many of them
+ *     are filled. When they are not enough, less than @a size bytes
+ *     are read.
+ * @param[out] pin Pin to release with ufs_pin_release(). NULL when
+ *     nothing was read.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is write only.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_read_view(int fd, size_t size, struct iovec *iov, int *iovcnt,
+	      struct ufs_pin **pin);
+
+/** Release the pin of ufs_read_view(). NULL is allowed. */
+void
+ufs_pin_release(struct ufs_pin *pin);
+
+/**
+ * Make the file @a dst a copy of the file @a src. If @a dst exists,
+ * its content is replaced, like by a write, otherwise it is created.
+ * The data is not copied, the files share it until changed, a block
+ * is copied on its first write. So the cost depends on the block
+ * count, not on the size.
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/** Frozen state of all the files. */
+struct ufs_snapshot;
+
+/**
+ * Make a snapshot of all the files, like ufs_clone() of each, and of
+ * the directories. The files are captured at the same moment.
+ * @retval not NULL Snapshot to delete with ufs_snapshot_delete().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_snapshot *
+ufs_snapshot_create(void);
+
+/**
+ * Make the file @a dst a copy of the file @a src from the snapshot,
+ * like ufs_clone() does.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src in the snapshot.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_snapshot_clone(struct ufs_snapshot *snap, const char *src,
+		   const char *dst);
+
+/** Delete the snapshot. The files are not affected. */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap);
+
+/**
+ * Move the position of a file descriptor. It is allowed to move
+ * beyond the file end, then the next write fills the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 The new position from the file start.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - invalid @a whence, or the new position
+ *       is negative or bigger than the max file size.
+ */
+off_t
+ufs_seek(int fd, off_t offset, int whence);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -126,15 +330,154 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory. Its parent should exist.
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_EXISTS - a file or a directory has this path.
+ *     - UFS_ERR_INVALID_ARG - the path is empty, or has an empty name
+ *       in it.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has files or directories.
+ *     - UFS_ERR_INVALID_ARG - the root can't be deleted.
+ */
+int
+ufs_rmdir(const char *path);
+
+/**
+ * Move a file or a directory with all its content to a new path. A
+ * file replaces the file at the new path, if there is one, like
+ * ufs_delete() of it, the opened descriptors of both stay valid. A
+ * directory can't replace anything.
+ *
+ * The paths are resolved by one lookup whatever their depth, so a
+ * directory rename updates the paths of all its content, and takes
+ * the time proportional to its size. The other calls wait for it.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file or directory @a old_path, or no
+ *       parent directory of @a new_path.
+ *     - UFS_ERR_EXISTS - a directory has the path @a new_path, or a
+ *       file has it and a directory is moved.
+ *     - UFS_ERR_INVALID_ARG - invalid path, or a directory is moved
+ *       inside itself.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_rename(const char *old_path, const char *new_path);
+
+/** Entry of a directory listing. */
+struct ufs_dirent {
+	/** Name in the directory, without the path of the directory. */
+	const char *name;
+	bool is_dir;
+};
+
+/** Listing of a directory, see ufs_opendir(). */
+struct ufs_dir;
+
+/**
+ * List a directory. The names are copied at once, in no particular
+ * order, so the listing doesn't see the later changes. It takes the
+ * time proportional to the size of the directory, not of the FS.
+ * @param path Path of the directory, "" for the root.
+ * @retval not NULL Listing to read with ufs_readdir() and free with
+ *     ufs_closedir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Get the next entry of the listing. It is valid until ufs_closedir().
+ * @retval NULL There are no more entries.
+ */
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir);
+
+/** Free the listing. NULL is allowed. */
+void
+ufs_closedir(struct ufs_dir *dir);
+
+/**
+ * Attach the filesystem to an image file, loading the files from it.
+ * Should be called when there are no files, usually right after the
+ * start or ufs_destroy().
+ *
+ * The image is mapped into the memory, so the data is read lazily on
+ * the first access, and the blocks are copied only when changed. The
+ * changes made after the last checkpoint are kept in an append-only
+ * journal next to the image, "<path>.journal", and are replayed on
+ * load. A record torn by a crash and everything after it is dropped.
+ *
+ * A checkpoint writes a new image and drops the journal records saved
+ * in it. It runs in a background thread when the journal grows big,
+ * and can be done with ufs_checkpoint().
+ *
+ * @param path Image file name. A missing image is an empty one.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - an image is already attached, or there
+ *       are files or directories.
+ *     - UFS_ERR_IO - the image or the journal can't be read, or the
+ *       image is corrupted.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_image_open(const char *path);
+
+/**
+ * Write all the files into a new image, which atomically replaces
+ * the old one, and drop the saved changes from the journal. The
+ * files are captured like by ufs_snapshot_create(), so the writers
+ * are not blocked while the image is written.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no image is attached.
+ *     - UFS_ERR_IO - write error, the old image stays.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_checkpoint(void);
+
+/**
+ * Flush the journal to the disk. The changes are in the journal
+ * right after each call, so they survive a crash of the process,
+ * and after this call they survive a crash of the system.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no image is attached.
+ *     - UFS_ERR_IO - a write into the journal has failed since it was
+ *       opened. The next changes are not saved.
+ */
+int
+ufs_sync(void);
+
 #ifdef NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
- * changed. If the current size is bigger than @a new_size, then
- * the blocks are truncated. Opened file descriptors behind the
- * new file size should proceed from the new file end.
+ * file size is less than @a new_size, then the new bytes are a
+ * hole of zeros, which takes no memory until written, and positions
+ * of opened file descriptors are not changed. If the current size is
+ * bigger than @a new_size, then the blocks are truncated. Opened file
+ * descriptors behind the new file size should proceed from the new
+ * file end.
  *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
@@ -151,10 +494,185 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Make a hole in a file: the bytes [offset, offset + size) become
+ * zeros and their blocks are freed. The file size is not changed,
+ * the part of the range beyond the file end is ignored. A file grown
+ * by ufs_resize() or by a write beyond its end has holes too, they
+ * take memory only when written.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Start of the hole.
+ * @param size Size of the hole.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the descriptor is read only.
+ *     - UFS_ERR_NO_MEM - not enough memory to zero a shared block at
+ *       an edge of the hole. A part of the range can be zeroed.
+ */
+int
+ufs_punch_hole(int fd, size_t offset, size_t size);
+
+/**
+ * Turn the deduplication of the written blocks on or off, it is off
+ * at start. When a write fills a block up to its end, the block is
+ * hashed and looked up among the blocks filled before. An equal one
+ * is shared instead, copy-on-write like by ufs_clone(), and a block
+ * of zeros becomes a hole. The blocks shared already stay so when it
+ * is turned off.
+ */
+void
+ufs_dedup_enable(bool is_enabled);
+
+/** Memory taken by the file data, and the descriptor table size. */
+struct ufs_stats {
+	/**
+	 * Allocated blocks, including the ones of the snapshots, the
+	 * pins and the image. A block shared by several files is
+	 * counted once.
+	 */
+	size_t block_count;
+	/** Bytes in the allocated blocks. */
+	size_t block_memory;
+	/**
+	 * How many bytes more the blocks would take if none was shared -
+	 * by the deduplication, clones, snapshots or pins. The ratio of
+	 * the data to the memory is
+	 * (block_memory + shared_memory) / block_memory.
+	 */
+	size_t shared_memory;
+	/** Distinct blocks known to the deduplication. */
+	size_t dedup_block_count;
+	/**
+	 * Written blocks replaced with equal ones by the deduplication,
+	 * since the start or ufs_destroy().
+	 */
+	size_t dedup_hit_count;
+	/** Written blocks of zeros made holes by the deduplication. */
+	size_t dedup_zero_count;
+	/** Open descriptors. */
+	size_t fd_count;
+	/**
+	 * Slots in the descriptor table. It grows twice when full, and
+	 * shrinks twice after the closes, when the upper half is free.
+	 */
+	size_t fd_capacity;
+};
+
+/** Get the memory statistics. */
+void
+ufs_get_stats(struct ufs_stats *stats);
+
+/** Operations of a ring, each one is the call of the same name. */
+enum ufs_op {
+	UFS_OP_NOP = 0,
+	/** ufs_open(name, flags). */
+	UFS_OP_OPEN,
+	/** ufs_close(fd). */
+	UFS_OP_CLOSE,
+	/** ufs_delete(name). */
+	UFS_OP_DELETE,
+	/** ufs_read(fd, buf, size). */
+	UFS_OP_READ,
+	/** ufs_write(fd, buf, size). */
+	UFS_OP_WRITE,
+	/** ufs_pread(fd, buf, size, offset). */
+	UFS_OP_PREAD,
+	/** ufs_pwrite(fd, buf, size, offset). */
+	UFS_OP_PWRITE,
+	/** ufs_resize(fd, offset). */
+	UFS_OP_RESIZE,
+};
+
+/** Submission queue entry, an operation to do. */
+struct ufs_sqe {
+	enum ufs_op op;
+	int fd;
+	int flags;
+	const char *name;
+	/** Buffer to read into, or the data to write. */
+	void *buf;
+	size_t size;
+	/** Offset of a positional operation, the new size of a resize. */
+	size_t offset;
+	/** Returned in the completion as is. */
+	uint64_t user_data;
+};
+
+/** Completion queue entry, the result of an operation. */
+struct ufs_cqe {
+	uint64_t user_data;
+	/** What the call returns. */
+	ssize_t res;
+	/** Error code when @a res is -1, what ufs_errno() would return. */
+	enum ufs_error_code error;
+};
+
+struct ufs_ring;
+
+/**
+ * Create a ring for batches of operations, like io_uring. The entries are
+ * taken by ufs_ring_get_sqe(), filled, and sent by ufs_ring_submit(). The
+ * results are taken by ufs_ring_reap(), one per operation.
+ *
+ * Without workers the batch is done by ufs_ring_submit() in its order. A
+ * run of positional reads or writes of one descriptor looks it up and
+ * locks the file once. With workers the batches are split between them,
+ * the operations of one batch run in parallel and in any order, and
+ * complete in the order they are done. An operation depending on another
+ * one should be submitted after the other one is reaped.
+ *
+ * A ring is used by one thread at a time. It should be deleted before
+ * ufs_destroy().
+ *
+ * @param entries Maximum of the operations submitted and not reaped,
+ *     rounded up to a power of 2.
+ * @param worker_count Threads doing the operations, can be 0.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no entries, or too many.
+ *     - UFS_ERR_NO_MEM - not enough memory, or threads.
+ */
+struct ufs_ring *
+ufs_ring_create(unsigned entries, int worker_count);
+
+/**
+ * Get an entry for the next operation. It is sent by the next
+ * ufs_ring_submit().
+ * @retval NULL The ring is full, the operations should be submitted or
+ *     reaped.
+ */
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Send the entries got since the last submit. Their memory can be reused
+ * right after the call, the buffers - after the completion.
+ * @return How many operations are submitted.
+ */
+int
+ufs_ring_submit(struct ufs_ring *ring);
+
+/**
+ * Take the completions of the submitted operations, waiting until there
+ * are at least @a min_count of them, or all the submitted ones are done.
+ * @return How many completions are written into @a cqes, up to @a count.
+ */
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count,
+	      int min_count);
+
+/** Wait for the submitted operations, stop the workers, free the ring. */
+void
+ufs_ring_delete(struct ufs_ring *ring);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
- * the files. After the destruction neither of the ufs functions are supposed to
- * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * the files, invalidate the pins and the snapshots. After the destruction
+ * neither of the ufs functions are supposed to be used. Purpose of the
+ * destruction is to reclaim all the dynamic memory.
+ * The image from ufs_image_open() is detached, the files stay in it
+ * and in its journal.
  */
 void
 ufs_destroy(void);
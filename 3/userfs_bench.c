@@ -0,0 +1,551 @@
+/**
+ * Benchmark of the userfs data access. A 100MB file is filled, then read
+ * sequentially and by 4KB parts at random offsets, both via ufs_pread() and
+ * via ufs_seek() + ufs_read(), and by a ring of batched operations, with and
+ * without workers. The file is also sent to /dev/null by 1MB
+ * parts, copied by ufs_read(), and without copying via ufs_read_view(). The
+ * file is copied by reading and writing, and by ufs_clone(), the copy is
+ * freed by ufs_punch_hole(). A sparse file is made by ufs_resize() and
+ * read. Then the same random reads, and writes, are done by several threads,
+ * into one shared file and into a file per thread, to see how they scale.
+ * The file is written with an image attached, and loaded from the journal
+ * and from the image. Two equal files are written with the deduplication.
+ * 100K descriptors are opened, reopened at random and closed. 100K files of
+ * 64 bytes are created. At last 100K files are made in 1000 directories, one
+ * of them is listed and renamed, and a deep path is opened. Usage:
+ *
+ *     ./userfs_bench [random read count] [max thread count]
+ */
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+enum {
+	FILE_SIZE = 100 * 1024 * 1024,
+	READ_SIZE = 4096,
+	SEND_SIZE = 1024 * 1024,
+	/* Enough for SEND_SIZE by 64KB blocks. */
+	IOV_MAX_COUNT = 16,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+check(int ok, const char *what)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "%s failed, error %d\n", what, (int)ufs_errno());
+	exit(1);
+}
+
+static void
+report(const char *name, double duration, long count, size_t bytes)
+{
+	printf("%-32s %10.1f MB/s %12.0f ops/s %8.3f us/op\n", name,
+	       bytes / duration / 1000000, count / duration,
+	       duration * 1000000 / count);
+}
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	bool is_write;
+	long count;
+	unsigned seed;
+};
+
+static void *
+worker_f(void *data)
+{
+	struct worker *w = data;
+	char buf[READ_SIZE];
+	memset(buf, 'x', sizeof(buf));
+	size_t max_offset = FILE_SIZE - READ_SIZE;
+	unsigned seed = w->seed;
+	for (long i = 0; i < w->count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		size_t offset = ((size_t)seed * 2654435761u) % max_offset;
+		if (w->is_write)
+			check(ufs_pwrite(w->fd, buf, READ_SIZE, offset) ==
+			      READ_SIZE, "pwrite");
+		else
+			check(ufs_pread(w->fd, buf, READ_SIZE, offset) ==
+			      READ_SIZE, "pread");
+	}
+	return NULL;
+}
+
+/**
+ * Run @a thread_count threads doing @a count random operations each. The
+ * threads use @a fds[0] if @a is_shared, otherwise own files.
+ */
+static void
+run_threads(const char *op, bool is_write, bool is_shared, const int *fds,
+	    int thread_count, long count)
+{
+	struct worker *workers = calloc(thread_count, sizeof(*workers));
+	double start = now_sec();
+	for (int i = 0; i < thread_count; ++i) {
+		struct worker *w = &workers[i];
+		w->fd = is_shared ? fds[0] : fds[i];
+		w->is_write = is_write;
+		w->count = count;
+		w->seed = i + 1;
+		check(pthread_create(&w->thread, NULL, worker_f, w) == 0,
+		      "thread create");
+	}
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(workers[i].thread, NULL);
+	char name[64];
+	snprintf(name, sizeof(name), "%s, %s, %d thr", op,
+		 is_shared ? "shared" : "own files", thread_count);
+	report(name, now_sec() - start, count * thread_count,
+	       count * thread_count * READ_SIZE);
+	free(workers);
+}
+
+/**
+ * Random reads of @a size bytes through a ring, keeping it full. Each read
+ * in flight has its own buffer.
+ */
+static void
+run_ring_reads(const char *op, int fd, long count, size_t size, int workers)
+{
+	enum { RING_SIZE = 64 };
+	struct ufs_ring *ring = ufs_ring_create(RING_SIZE, workers);
+	check(ring != NULL, "ring create");
+	char *bufs = malloc(RING_SIZE * size);
+	int free_bufs[RING_SIZE];
+	for (int i = 0; i < RING_SIZE; ++i)
+		free_bufs[i] = i;
+	int free_count = RING_SIZE;
+	struct ufs_cqe cqes[RING_SIZE];
+	size_t max_offset = FILE_SIZE - size;
+	unsigned seed = 1;
+	long submitted = 0;
+	long done = 0;
+	double start = now_sec();
+	while (done < count) {
+		struct ufs_sqe *sqe;
+		while (submitted < count && (sqe = ufs_ring_get_sqe(ring)) != NULL) {
+			seed = seed * 1103515245 + 12345;
+			int buf = free_bufs[--free_count];
+			sqe->op = UFS_OP_PREAD;
+			sqe->fd = fd;
+			sqe->buf = bufs + buf * size;
+			sqe->size = size;
+			sqe->offset = ((size_t)seed * 2654435761u) % max_offset;
+			sqe->user_data = buf;
+			++submitted;
+		}
+		ufs_ring_submit(ring);
+		int reaped = ufs_ring_reap(ring, cqes, RING_SIZE, RING_SIZE / 2);
+		for (int i = 0; i < reaped; ++i) {
+			check(cqes[i].res == (ssize_t)size, "ring pread");
+			free_bufs[free_count++] = cqes[i].user_data;
+		}
+		done += reaped;
+	}
+	report(op, now_sec() - start, count, count * size);
+	ufs_ring_delete(ring);
+	free(bufs);
+}
+
+/**
+ * Random reads by 64 bytes, where the cost of a call matters, and by 4KB,
+ * directly and through a ring without and with workers.
+ */
+static void
+run_ring(int fd, long count, int max_threads)
+{
+	enum { SMALL_READ = 64 };
+	char buf[SMALL_READ];
+	size_t max_offset = FILE_SIZE - SMALL_READ;
+	unsigned seed = 1;
+	double start = now_sec();
+	for (long i = 0; i < count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		size_t offset = ((size_t)seed * 2654435761u) % max_offset;
+		check(ufs_pread(fd, buf, SMALL_READ, offset) == SMALL_READ,
+		      "pread");
+	}
+	report("random pread 64B", now_sec() - start, count,
+	       count * SMALL_READ);
+	run_ring_reads("random pread 64B, ring", fd, count, SMALL_READ, 0);
+	run_ring_reads("random pread, ring", fd, count, READ_SIZE, 0);
+	char op[64];
+	snprintf(op, sizeof(op), "random pread, ring, %d workers", max_threads);
+	run_ring_reads(op, fd, count, READ_SIZE, max_threads);
+}
+
+static void
+run_scaling(long count, int max_threads)
+{
+	int *fds = calloc(max_threads, sizeof(*fds));
+	char *buf = calloc(1, READ_SIZE);
+	char name[32];
+	for (int i = 0; i < max_threads; ++i) {
+		sprintf(name, "bench%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		check(fds[i] != -1, "open");
+		for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE)
+			check(ufs_write(fds[i], buf, READ_SIZE) == READ_SIZE,
+			      "write");
+	}
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		run_threads("pread", false, true, fds, threads, count);
+		run_threads("pread", false, false, fds, threads, count);
+		run_threads("pwrite", true, true, fds, threads, count);
+		run_threads("pwrite", true, false, fds, threads, count);
+	}
+	for (int i = 0; i < max_threads; ++i) {
+		sprintf(name, "bench%d", i);
+		check(ufs_close(fds[i]) == 0, "close");
+		check(ufs_delete(name) == 0, "delete");
+	}
+	free(buf);
+	free(fds);
+}
+
+static void
+run_image(char *buf)
+{
+	const char *path = "/tmp/userfs_bench.img";
+	const char *journal_path = "/tmp/userfs_bench.img.journal";
+	unlink(path);
+	unlink(journal_path);
+	check(ufs_image_open(path) == 0, "image open");
+	int fd = ufs_open("bench", UFS_CREATE);
+	check(fd != -1, "open");
+	double start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE)
+		check(ufs_write(fd, buf, READ_SIZE) == READ_SIZE, "write");
+	report("sequential write, journal", now_sec() - start,
+	       FILE_SIZE / READ_SIZE, FILE_SIZE);
+	check(ufs_close(fd) == 0, "close");
+	ufs_destroy();
+
+	start = now_sec();
+	check(ufs_image_open(path) == 0, "image open");
+	report("load by journal replay", now_sec() - start, 1, FILE_SIZE);
+	start = now_sec();
+	check(ufs_checkpoint() == 0, "checkpoint");
+	report("checkpoint", now_sec() - start, 1, FILE_SIZE);
+	ufs_destroy();
+
+	start = now_sec();
+	check(ufs_image_open(path) == 0, "image open");
+	report("load by image mapping", now_sec() - start, 1, FILE_SIZE);
+	fd = ufs_open("bench", 0);
+	check(fd != -1, "open");
+	start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE)
+		check(ufs_read(fd, buf, READ_SIZE) == READ_SIZE, "read");
+	report("sequential read, mapped image", now_sec() - start,
+	       FILE_SIZE / READ_SIZE, FILE_SIZE);
+	check(ufs_close(fd) == 0, "close");
+	ufs_destroy();
+	unlink(path);
+	unlink(journal_path);
+}
+
+/** Write a file of distinct blocks, then its copy, with deduplication. */
+static void
+run_dedup(char *buf)
+{
+	ufs_dedup_enable(true);
+	const char *names[] = {"bench", "bench_copy"};
+	const char *ops[] = {"sequential write, dedup, new",
+			     "sequential write, dedup, equal"};
+	for (int i = 0; i < 2; ++i) {
+		int fd = ufs_open(names[i], UFS_CREATE);
+		check(fd != -1, "open");
+		double start = now_sec();
+		for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE) {
+			memcpy(buf, &pos, sizeof(pos));
+			check(ufs_write(fd, buf, READ_SIZE) == READ_SIZE,
+			      "write");
+		}
+		report(ops[i], now_sec() - start, FILE_SIZE / READ_SIZE,
+		       FILE_SIZE);
+		check(ufs_close(fd) == 0, "close");
+	}
+	struct ufs_stats stats;
+	ufs_get_stats(&stats);
+	printf("%-32s %10.2f, %zu MB saved\n", "dedup ratio",
+	       (double)(stats.block_memory + stats.shared_memory) /
+	       stats.block_memory, stats.shared_memory / (1024 * 1024));
+	ufs_dedup_enable(false);
+	ufs_destroy();
+}
+
+/** Create many files of 64 bytes, like a namespace of small files. */
+static void
+run_small_files(void)
+{
+	enum { SMALL_FILE_COUNT = 100000 };
+	char name[32];
+	char data[64];
+	memset(data, 'x', sizeof(data));
+	double start = now_sec();
+	for (int i = 0; i < SMALL_FILE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "small%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "open");
+		check(ufs_write(fd, data, sizeof(data)) == sizeof(data), "write");
+		check(ufs_close(fd) == 0, "close");
+	}
+	report("create + write, 64B files", now_sec() - start,
+	       SMALL_FILE_COUNT, SMALL_FILE_COUNT * sizeof(data));
+	struct ufs_stats stats;
+	ufs_get_stats(&stats);
+	printf("%-32s %10zu bytes per file\n", "block memory",
+	       stats.block_memory / SMALL_FILE_COUNT);
+	ufs_destroy();
+}
+
+/**
+ * Make 1000 directories of 100 files, list one of them over and over, open a
+ * file 8 directories deep, and rename a directory.
+ */
+static void
+run_dirs(void)
+{
+	enum {
+		DIR_COUNT = 1000,
+		DIR_FILE_COUNT = 100,
+		LIST_COUNT = 100000,
+		OPEN_COUNT = 1000000,
+	};
+	char name[64];
+	for (int i = 0; i < DIR_COUNT; ++i) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		check(ufs_mkdir(name) == 0, "mkdir");
+		for (int j = 0; j < DIR_FILE_COUNT; ++j) {
+			snprintf(name, sizeof(name), "dir%d/file%d", i, j);
+			check(ufs_close(ufs_open(name, UFS_CREATE)) == 0, "create");
+		}
+	}
+	double start = now_sec();
+	long entry_count = 0;
+	for (int i = 0; i < LIST_COUNT; ++i) {
+		struct ufs_dir *dir = ufs_opendir("dir500");
+		check(dir != NULL, "opendir");
+		while (ufs_readdir(dir) != NULL)
+			++entry_count;
+		ufs_closedir(dir);
+	}
+	check(entry_count == (long)LIST_COUNT * DIR_FILE_COUNT, "readdir");
+	report("readdir, 100 of 100K files", now_sec() - start, LIST_COUNT, 0);
+
+	char path[64] = "";
+	for (int i = 0; i < 8; ++i) {
+		snprintf(name, sizeof(name), "%s%sl%d", path, i == 0 ? "" : "/", i);
+		strcpy(path, name);
+		check(ufs_mkdir(path) == 0, "mkdir");
+	}
+	snprintf(name, sizeof(name), "%s/file", path);
+	check(ufs_close(ufs_open(name, UFS_CREATE)) == 0, "create");
+	start = now_sec();
+	for (int i = 0; i < OPEN_COUNT; ++i)
+		check(ufs_close(ufs_open(name, 0)) == 0, "open");
+	report("open + close, depth 8", now_sec() - start, OPEN_COUNT, 0);
+	start = now_sec();
+	for (int i = 0; i < OPEN_COUNT; ++i)
+		check(ufs_close(ufs_open("dir500/file50", 0)) == 0, "open");
+	report("open + close, depth 1", now_sec() - start, OPEN_COUNT, 0);
+
+	start = now_sec();
+	check(ufs_rename("dir500", "renamed") == 0, "rename");
+	report("rename, 100 files", now_sec() - start, 1, 0);
+	ufs_destroy();
+}
+
+/**
+ * Open many descriptors of one file, close and reopen them at random while
+ * they are open, and close all.
+ */
+static void
+run_fd_storm(void)
+{
+	enum { FD_COUNT = 100000, STORM_COUNT = 1000000 };
+	int *fds = malloc(FD_COUNT * sizeof(*fds));
+	check(ufs_close(ufs_open("bench", UFS_CREATE)) == 0, "create");
+	double start = now_sec();
+	for (int i = 0; i < FD_COUNT; ++i)
+		check((fds[i] = ufs_open("bench", 0)) != -1, "open");
+	report("open, 100K descriptors", now_sec() - start, FD_COUNT, 0);
+
+	unsigned seed = 1;
+	start = now_sec();
+	for (int i = 0; i < STORM_COUNT; ++i) {
+		seed = seed * 1103515245 + 12345;
+		int j = seed % FD_COUNT;
+		check(ufs_close(fds[j]) == 0, "close");
+		check((fds[j] = ufs_open("bench", 0)) != -1, "open");
+	}
+	report("close + open, 100K open", now_sec() - start, STORM_COUNT, 0);
+
+	start = now_sec();
+	for (int i = 0; i < FD_COUNT; ++i)
+		check(ufs_close(fds[i]) == 0, "close");
+	report("close, 100K descriptors", now_sec() - start, FD_COUNT, 0);
+	struct ufs_stats stats;
+	ufs_get_stats(&stats);
+	printf("%-32s %10zu slots\n", "descriptor table after", stats.fd_capacity);
+	check(ufs_delete("bench") == 0, "delete");
+	free(fds);
+}
+
+int
+main(int argc, char **argv)
+{
+	long count = 1000000;
+	if (argc > 1)
+		count = atol(argv[1]);
+	int max_threads = 4;
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	char *buf = malloc(READ_SIZE);
+	for (int i = 0; i < READ_SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("bench", UFS_CREATE);
+	check(fd != -1, "open");
+
+	double start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE)
+		check(ufs_write(fd, buf, READ_SIZE) == READ_SIZE, "write");
+	report("sequential write", now_sec() - start, FILE_SIZE / READ_SIZE,
+	       FILE_SIZE);
+
+	check(ufs_seek(fd, 0, UFS_SEEK_SET) == 0, "seek");
+	start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += READ_SIZE)
+		check(ufs_read(fd, buf, READ_SIZE) == READ_SIZE, "read");
+	report("sequential read", now_sec() - start, FILE_SIZE / READ_SIZE,
+	       FILE_SIZE);
+
+	int null_fd = open("/dev/null", O_WRONLY);
+	check(null_fd != -1, "open /dev/null");
+	char *big_buf = malloc(SEND_SIZE);
+	check(ufs_seek(fd, 0, UFS_SEEK_SET) == 0, "seek");
+	start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += SEND_SIZE) {
+		check(ufs_read(fd, big_buf, SEND_SIZE) == SEND_SIZE, "read");
+		check(write(null_fd, big_buf, SEND_SIZE) == SEND_SIZE, "write");
+	}
+	report("send, read + write", now_sec() - start, FILE_SIZE / SEND_SIZE,
+	       FILE_SIZE);
+	free(big_buf);
+
+	check(ufs_seek(fd, 0, UFS_SEEK_SET) == 0, "seek");
+	start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += SEND_SIZE) {
+		struct iovec iov[IOV_MAX_COUNT];
+		int iov_count = IOV_MAX_COUNT;
+		struct ufs_pin *pin;
+		check(ufs_read_view(fd, SEND_SIZE, iov, &iov_count, &pin) ==
+		      SEND_SIZE, "read view");
+		check(writev(null_fd, iov, iov_count) == SEND_SIZE, "writev");
+		ufs_pin_release(pin);
+	}
+	report("send, read view + writev", now_sec() - start,
+	       FILE_SIZE / SEND_SIZE, FILE_SIZE);
+	close(null_fd);
+
+	big_buf = malloc(SEND_SIZE);
+	check(ufs_seek(fd, 0, UFS_SEEK_SET) == 0, "seek");
+	int copy_fd = ufs_open("bench_copy", UFS_CREATE);
+	check(copy_fd != -1, "open");
+	start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += SEND_SIZE) {
+		check(ufs_read(fd, big_buf, SEND_SIZE) == SEND_SIZE, "read");
+		check(ufs_write(copy_fd, big_buf, SEND_SIZE) == SEND_SIZE,
+		      "write");
+	}
+	report("copy by read + write", now_sec() - start, 1, FILE_SIZE);
+	check(ufs_close(copy_fd) == 0, "close");
+	check(ufs_delete("bench_copy") == 0, "delete");
+	free(big_buf);
+
+	start = now_sec();
+	check(ufs_clone("bench", "bench_copy") == 0, "clone");
+	report("copy by clone", now_sec() - start, 1, FILE_SIZE);
+	copy_fd = ufs_open("bench_copy", 0);
+	check(copy_fd != -1, "open");
+	start = now_sec();
+	check(ufs_punch_hole(copy_fd, 0, FILE_SIZE) == 0, "punch hole");
+	report("punch hole", now_sec() - start, 1, FILE_SIZE);
+	check(ufs_close(copy_fd) == 0, "close");
+	check(ufs_delete("bench_copy") == 0, "delete");
+
+	int sparse_fd = ufs_open("bench_sparse", UFS_CREATE);
+	check(sparse_fd != -1, "open");
+	start = now_sec();
+	check(ufs_resize(sparse_fd, FILE_SIZE) == 0, "resize");
+	report("resize, sparse", now_sec() - start, 1, FILE_SIZE);
+	big_buf = malloc(SEND_SIZE);
+	start = now_sec();
+	for (size_t pos = 0; pos < FILE_SIZE; pos += SEND_SIZE) {
+		check(ufs_read(sparse_fd, big_buf, SEND_SIZE) == SEND_SIZE,
+		      "read");
+	}
+	report("sequential read, hole", now_sec() - start,
+	       FILE_SIZE / SEND_SIZE, FILE_SIZE);
+	free(big_buf);
+	check(ufs_close(sparse_fd) == 0, "close");
+	check(ufs_delete("bench_sparse") == 0, "delete");
+
+	/* Offsets are not aligned by blocks, like real random accesses. */
+	size_t max_offset = FILE_SIZE - READ_SIZE;
+	unsigned seed = 1;
+	start = now_sec();
+	for (long i = 0; i < count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		size_t offset = ((size_t)seed * 2654435761u) % max_offset;
+		check(ufs_pread(fd, buf, READ_SIZE, offset) == READ_SIZE,
+		      "pread");
+	}
+	report("random pread", now_sec() - start, count, count * READ_SIZE);
+
+	seed = 1;
+	start = now_sec();
+	for (long i = 0; i < count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		size_t offset = ((size_t)seed * 2654435761u) % max_offset;
+		check(ufs_seek(fd, offset, UFS_SEEK_SET) == (off_t)offset,
+		      "seek");
+		check(ufs_read(fd, buf, READ_SIZE) == READ_SIZE, "read");
+	}
+	report("random seek + read", now_sec() - start, count,
+	       count * READ_SIZE);
+	run_ring(fd, count, max_threads);
+
+	check(ufs_close(fd) == 0, "close");
+	check(ufs_delete("bench") == 0, "delete");
+
+	run_scaling(count / 4, max_threads);
+	ufs_destroy();
+	run_image(buf);
+	run_dedup(buf);
+	run_fd_storm();
+	ufs_destroy();
+	run_small_files();
+	run_dirs();
+	free(buf);
+	return 0;
+}
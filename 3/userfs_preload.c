@@ -0,0 +1,963 @@
+/**
+ * Preload library which routes the files under a path prefix into userfs, to
+ * run unmodified tools on it:
+ *
+ *     make preload
+ *     UFS_IMAGE=/tmp/ufs.img LD_PRELOAD=./libuserfs_preload.so \
+ *         dd if=/dev/zero of=/ufs/file bs=1M count=10
+ *
+ * The prefix is "/ufs/", or UFS_PREFIX from the environment, and the rest of
+ * the path is the userfs file name. The files live in the process memory and
+ * are gone at exit, unless UFS_IMAGE names an image to keep them in, see
+ * ufs_image_open(). An image can't be used by two processes at once.
+ *
+ * Each userfs descriptor gets a real descriptor number, taken by opening
+ * /dev/null, so it never collides with the libc descriptors, and the calls
+ * which are not intercepted see /dev/null. The descriptors don't survive
+ * exec(). Only absolute paths are routed, and only the direct calls - the
+ * calls made inside libc go to the system. So fopen() is intercepted too, but
+ * a descriptor made a stdio stream by fdopen() or a shell redirection is
+ * written to /dev/null. The directories are made, removed and renamed by
+ * the usual calls and are shown by stat(), the prefix itself is the root. But
+ * they can't be opened, so the calls like readdir() or getxattr() are not
+ * routed.
+ */
+#define _GNU_SOURCE
+#include "userfs.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+/* The 64-bit offset variants are forwarded to the plain calls. */
+_Static_assert(sizeof(off_t) == 8, "64-bit off_t is required");
+
+/** The libc functions, which the calls are passed to. */
+static struct {
+	int (*open)(const char *, int, ...);
+	int (*openat)(int, const char *, int, ...);
+	ssize_t (*read)(int, void *, size_t);
+	ssize_t (*write)(int, const void *, size_t);
+	ssize_t (*pread)(int, void *, size_t, off_t);
+	ssize_t (*pwrite)(int, const void *, size_t, off_t);
+	off_t (*lseek)(int, off_t, int);
+	int (*close)(int);
+	int (*ftruncate)(int, off_t);
+	int (*fallocate)(int, int, off_t, off_t);
+	int (*fsync)(int);
+	int (*fdatasync)(int);
+	int (*unlink)(const char *);
+	int (*unlinkat)(int, const char *, int);
+	int (*mkdir)(const char *, mode_t);
+	int (*mkdirat)(int, const char *, mode_t);
+	int (*rmdir)(const char *);
+	int (*rename)(const char *, const char *);
+	int (*renameat)(int, const char *, int, const char *);
+	int (*renameat2)(int, const char *, int, const char *, unsigned);
+	int (*dup)(int);
+	int (*dup2)(int, int);
+	int (*dup3)(int, int, int);
+	int (*fstat)(int, struct stat *);
+	int (*fstat64)(int, struct stat64 *);
+	int (*stat)(const char *, struct stat *);
+	int (*stat64)(const char *, struct stat64 *);
+	int (*lstat)(const char *, struct stat *);
+	int (*lstat64)(const char *, struct stat64 *);
+	int (*fstatat)(int, const char *, struct stat *, int);
+	int (*fstatat64)(int, const char *, struct stat64 *, int);
+	int (*statx)(int, const char *, int, unsigned, struct statx *);
+	FILE *(*fopen)(const char *, const char *);
+} real;
+
+static pthread_once_t real_once = PTHREAD_ONCE_INIT;
+static const char *prefix = "/ufs/";
+static size_t prefix_len;
+
+static void
+real_init(void)
+{
+	real.open = dlsym(RTLD_NEXT, "open");
+	real.openat = dlsym(RTLD_NEXT, "openat");
+	real.read = dlsym(RTLD_NEXT, "read");
+	real.write = dlsym(RTLD_NEXT, "write");
+	real.pread = dlsym(RTLD_NEXT, "pread");
+	real.pwrite = dlsym(RTLD_NEXT, "pwrite");
+	real.lseek = dlsym(RTLD_NEXT, "lseek");
+	real.close = dlsym(RTLD_NEXT, "close");
+	real.ftruncate = dlsym(RTLD_NEXT, "ftruncate");
+	real.fallocate = dlsym(RTLD_NEXT, "fallocate");
+	real.fsync = dlsym(RTLD_NEXT, "fsync");
+	real.fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+	real.unlink = dlsym(RTLD_NEXT, "unlink");
+	real.unlinkat = dlsym(RTLD_NEXT, "unlinkat");
+	real.mkdir = dlsym(RTLD_NEXT, "mkdir");
+	real.mkdirat = dlsym(RTLD_NEXT, "mkdirat");
+	real.rmdir = dlsym(RTLD_NEXT, "rmdir");
+	real.rename = dlsym(RTLD_NEXT, "rename");
+	real.renameat = dlsym(RTLD_NEXT, "renameat");
+	real.renameat2 = dlsym(RTLD_NEXT, "renameat2");
+	real.dup = dlsym(RTLD_NEXT, "dup");
+	real.dup2 = dlsym(RTLD_NEXT, "dup2");
+	real.dup3 = dlsym(RTLD_NEXT, "dup3");
+	real.fstat = dlsym(RTLD_NEXT, "fstat");
+	real.fstat64 = dlsym(RTLD_NEXT, "fstat64");
+	real.stat = dlsym(RTLD_NEXT, "stat");
+	real.stat64 = dlsym(RTLD_NEXT, "stat64");
+	real.lstat = dlsym(RTLD_NEXT, "lstat");
+	real.lstat64 = dlsym(RTLD_NEXT, "lstat64");
+	real.fstatat = dlsym(RTLD_NEXT, "fstatat");
+	real.fstatat64 = dlsym(RTLD_NEXT, "fstatat64");
+	real.statx = dlsym(RTLD_NEXT, "statx");
+	real.fopen = dlsym(RTLD_NEXT, "fopen");
+	const char *env = getenv("UFS_PREFIX");
+	if (env != NULL && *env != 0)
+		prefix = env;
+	prefix_len = strlen(prefix);
+}
+
+/**
+ * Load the image on the first use of a userfs path. The image is opened with
+ * the intercepted calls, so it should be outside of the prefix.
+ */
+static pthread_once_t image_once = PTHREAD_ONCE_INIT;
+
+static void
+image_init(void)
+{
+	const char *path = getenv("UFS_IMAGE");
+	if (path != NULL && *path != 0 && ufs_image_open(path) != 0)
+		fprintf(stderr, "userfs: can't open image %s, error %d\n",
+			path, (int)ufs_errno());
+}
+
+/** Userfs descriptor, shared by the real descriptors made by dup(). */
+struct shim_file {
+	int ufs_fd;
+	int refs;
+	bool is_append;
+	/** File name, for the inode number. */
+	char *name;
+};
+
+/**
+ * Userfs descriptors by the real descriptor numbers. The lock is not taken
+ * while there are none, so the other descriptors are not slowed down.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct shim_file **files;
+	int capacity;
+	atomic_int count;
+} shim = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct shim_file *
+shim_get(int fd)
+{
+	pthread_once(&real_once, real_init);
+	if (atomic_load_explicit(&shim.count, memory_order_acquire) == 0 ||
+	    fd < 0)
+		return NULL;
+	struct shim_file *file = NULL;
+	pthread_mutex_lock(&shim.lock);
+	if (fd < shim.capacity)
+		file = shim.files[fd];
+	pthread_mutex_unlock(&shim.lock);
+	return file;
+}
+
+/**
+ * Bind the real descriptor to the file. A file bound to it before is
+ * returned, its reference is moved to the caller.
+ */
+static int
+shim_set(int fd, struct shim_file *file, struct shim_file **old)
+{
+	*old = NULL;
+	pthread_mutex_lock(&shim.lock);
+	if (fd >= shim.capacity) {
+		int capacity = shim.capacity == 0 ? 64 : shim.capacity;
+		while (capacity <= fd)
+			capacity *= 2;
+		struct shim_file **files =
+			realloc(shim.files, capacity * sizeof(*files));
+		if (files == NULL) {
+			pthread_mutex_unlock(&shim.lock);
+			return -1;
+		}
+		memset(files + shim.capacity, 0,
+		       (capacity - shim.capacity) * sizeof(*files));
+		shim.files = files;
+		shim.capacity = capacity;
+	}
+	*old = shim.files[fd];
+	shim.files[fd] = file;
+	if (file != NULL)
+		++file->refs;
+	atomic_fetch_add(&shim.count, (file != NULL) - (*old != NULL));
+	pthread_mutex_unlock(&shim.lock);
+	return 0;
+}
+
+/** Drop a reference, the last one closes the userfs descriptor. */
+static void
+shim_unref(struct shim_file *file)
+{
+	if (file == NULL)
+		return;
+	pthread_mutex_lock(&shim.lock);
+	bool is_last = --file->refs == 0;
+	pthread_mutex_unlock(&shim.lock);
+	if (!is_last)
+		return;
+	ufs_close(file->ufs_fd);
+	free(file->name);
+	free(file);
+}
+
+/** Userfs file name of the path, or NULL if it is not routed. */
+static const char *
+shim_name(const char *path)
+{
+	pthread_once(&real_once, real_init);
+	if (path == NULL || strncmp(path, prefix, prefix_len) != 0)
+		return NULL;
+	return path + prefix_len;
+}
+
+static int
+shim_errno(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_FILE:
+		return ENOENT;
+	case UFS_ERR_NO_MEM:
+		return ENOMEM;
+	case UFS_ERR_NO_PERMISSION:
+		/* Like a write into a descriptor opened for reading. */
+		return EBADF;
+	case UFS_ERR_INVALID_ARG:
+		return EINVAL;
+	case UFS_ERR_EXISTS:
+		return EEXIST;
+	case UFS_ERR_NOT_EMPTY:
+		return ENOTEMPTY;
+	default:
+		return EIO;
+	}
+}
+
+static ssize_t
+shim_result(ssize_t rc)
+{
+	if (rc < 0)
+		errno = shim_errno();
+	return rc;
+}
+
+static int
+shim_open(const char *name, int flags)
+{
+	pthread_once(&image_once, image_init);
+	if (*name == 0 || (flags & O_DIRECTORY) != 0) {
+		/* The directories can't be opened. */
+		errno = *name == 0 ? EISDIR : ENOTDIR;
+		return -1;
+	}
+	int ufs_flags = UFS_READ_WRITE;
+	if ((flags & O_ACCMODE) == O_RDONLY)
+		ufs_flags = UFS_READ_ONLY;
+	else if ((flags & O_ACCMODE) == O_WRONLY)
+		ufs_flags = UFS_WRITE_ONLY;
+	if ((flags & O_CREAT) != 0) {
+		int ufs_fd = (flags & O_EXCL) != 0 ? ufs_open(name, 0) : -1;
+		if (ufs_fd != -1) {
+			ufs_close(ufs_fd);
+			errno = EEXIST;
+			return -1;
+		}
+		ufs_flags |= UFS_CREATE;
+	}
+	struct shim_file *file = malloc(sizeof(*file));
+	if (file == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	file->refs = 0;
+	file->is_append = (flags & O_APPEND) != 0;
+	file->name = strdup(name);
+	file->ufs_fd = ufs_open(name, ufs_flags);
+	if (file->name == NULL || file->ufs_fd == -1) {
+		errno = file->name == NULL ? ENOMEM : shim_errno();
+		if (file->ufs_fd != -1)
+			ufs_close(file->ufs_fd);
+		free(file->name);
+		free(file);
+		return -1;
+	}
+	if ((flags & O_TRUNC) != 0 && (flags & O_ACCMODE) != O_RDONLY &&
+	    ufs_resize(file->ufs_fd, 0) != 0) {
+		errno = shim_errno();
+		goto error;
+	}
+	int fd = real.open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		goto error;
+	struct shim_file *old;
+	if (shim_set(fd, file, &old) != 0) {
+		real.close(fd);
+		errno = ENOMEM;
+		goto error;
+	}
+	/* A stale binding of a descriptor closed not by close(). */
+	shim_unref(old);
+	return fd;
+error:
+	ufs_close(file->ufs_fd);
+	free(file->name);
+	free(file);
+	return -1;
+}
+
+int
+open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if ((flags & (O_CREAT | O_TMPFILE)) != 0) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	const char *name = shim_name(path);
+	if (name != NULL)
+		return shim_open(name, flags);
+	return real.open(path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int
+__open_2(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+int
+__open64_2(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if ((flags & (O_CREAT | O_TMPFILE)) != 0) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	const char *name = shim_name(path);
+	if (name != NULL)
+		return shim_open(name, flags);
+	return real.openat(dirfd, path, flags, mode);
+}
+
+int
+openat64(int dirfd, const char *path, int flags, ...)
+	__attribute__((alias("openat")));
+
+int
+creat(const char *path, mode_t mode)
+{
+	return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int
+creat64(const char *path, mode_t mode) __attribute__((alias("creat")));
+
+ssize_t
+read(int fd, void *buf, size_t size)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.read(fd, buf, size);
+	return shim_result(ufs_read(file->ufs_fd, buf, size));
+}
+
+ssize_t
+__read_chk(int fd, void *buf, size_t size, size_t buf_size)
+{
+	if (size > buf_size)
+		abort();
+	return read(fd, buf, size);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t size)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.write(fd, buf, size);
+	if (file->is_append && ufs_seek(file->ufs_fd, 0, UFS_SEEK_END) < 0)
+		return shim_result(-1);
+	return shim_result(ufs_write(file->ufs_fd, buf, size));
+}
+
+ssize_t
+pread(int fd, void *buf, size_t size, off_t offset)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.pread(fd, buf, size, offset);
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return shim_result(ufs_pread(file->ufs_fd, buf, size, offset));
+}
+
+ssize_t
+pread64(int fd, void *buf, size_t size, off_t offset)
+	__attribute__((alias("pread")));
+
+ssize_t
+__pread_chk(int fd, void *buf, size_t size, off_t offset, size_t buf_size)
+{
+	if (size > buf_size)
+		abort();
+	return pread(fd, buf, size, offset);
+}
+
+ssize_t
+__pread64_chk(int fd, void *buf, size_t size, off_t offset,
+	      size_t buf_size) __attribute__((alias("__pread_chk")));
+
+ssize_t
+pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.pwrite(fd, buf, size, offset);
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return shim_result(ufs_pwrite(file->ufs_fd, buf, size, offset));
+}
+
+ssize_t
+pwrite64(int fd, const void *buf, size_t size, off_t offset)
+	__attribute__((alias("pwrite")));
+
+off_t
+lseek(int fd, off_t offset, int whence)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.lseek(fd, offset, whence);
+	switch (whence) {
+	case SEEK_SET:
+		whence = UFS_SEEK_SET;
+		break;
+	case SEEK_CUR:
+		whence = UFS_SEEK_CUR;
+		break;
+	case SEEK_END:
+		whence = UFS_SEEK_END;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	return shim_result(ufs_seek(file->ufs_fd, offset, whence));
+}
+
+off_t
+lseek64(int fd, off_t offset, int whence) __attribute__((alias("lseek")));
+
+int
+close(int fd)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.close(fd);
+	struct shim_file *old;
+	shim_set(fd, NULL, &old);
+	shim_unref(old);
+	return real.close(fd);
+}
+
+/** Size of the file, found by a seek to the end and back. */
+static off_t
+shim_size(int ufs_fd)
+{
+	off_t pos = ufs_seek(ufs_fd, 0, UFS_SEEK_CUR);
+	off_t size = ufs_seek(ufs_fd, 0, UFS_SEEK_END);
+	ufs_seek(ufs_fd, pos, UFS_SEEK_SET);
+	return size;
+}
+
+int
+ftruncate(int fd, off_t length)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.ftruncate(fd, length);
+	if (length < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return shim_result(ufs_resize(file->ufs_fd, length));
+}
+
+int
+ftruncate64(int fd, off_t length) __attribute__((alias("ftruncate")));
+
+/**
+ * The blocks are allocated on write anyway, so an allocation only grows the
+ * file. A punched hole frees the blocks.
+ */
+int
+fallocate(int fd, int mode, off_t offset, off_t len)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.fallocate(fd, mode, offset, len);
+	if (offset < 0 || len <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+		return shim_result(ufs_punch_hole(file->ufs_fd, offset, len));
+	if (mode == FALLOC_FL_KEEP_SIZE)
+		return 0;
+	if (mode != 0) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (offset + len <= shim_size(file->ufs_fd))
+		return 0;
+	return shim_result(ufs_resize(file->ufs_fd, offset + len));
+}
+
+int
+fallocate64(int fd, int mode, off_t offset, off_t len)
+	__attribute__((alias("fallocate")));
+
+/** Without an image the files live in memory, there is nothing to flush. */
+static int
+shim_sync(void)
+{
+	if (ufs_sync() == 0 || ufs_errno() == UFS_ERR_INVALID_ARG)
+		return 0;
+	errno = EIO;
+	return -1;
+}
+
+int
+fsync(int fd)
+{
+	if (shim_get(fd) == NULL)
+		return real.fsync(fd);
+	return shim_sync();
+}
+
+int
+fdatasync(int fd)
+{
+	if (shim_get(fd) == NULL)
+		return real.fdatasync(fd);
+	return shim_sync();
+}
+
+int
+unlink(const char *path)
+{
+	const char *name = shim_name(path);
+	if (name == NULL)
+		return real.unlink(path);
+	pthread_once(&image_once, image_init);
+	return shim_result(ufs_delete(name));
+}
+
+int
+unlinkat(int dirfd, const char *path, int flags)
+{
+	const char *name = shim_name(path);
+	if (name == NULL)
+		return real.unlinkat(dirfd, path, flags);
+	pthread_once(&image_once, image_init);
+	if ((flags & AT_REMOVEDIR) != 0)
+		return shim_result(ufs_rmdir(name));
+	return shim_result(ufs_delete(name));
+}
+
+int
+mkdir(const char *path, mode_t mode)
+{
+	const char *name = shim_name(path);
+	if (name == NULL)
+		return real.mkdir(path, mode);
+	pthread_once(&image_once, image_init);
+	return shim_result(ufs_mkdir(name));
+}
+
+int
+mkdirat(int dirfd, const char *path, mode_t mode)
+{
+	const char *name = shim_name(path);
+	if (name == NULL)
+		return real.mkdirat(dirfd, path, mode);
+	pthread_once(&image_once, image_init);
+	return shim_result(ufs_mkdir(name));
+}
+
+int
+rmdir(const char *path)
+{
+	const char *name = shim_name(path);
+	if (name == NULL)
+		return real.rmdir(path);
+	pthread_once(&image_once, image_init);
+	return shim_result(ufs_rmdir(name));
+}
+
+/**
+ * Rename inside userfs. A move between it and the system can't be done. With
+ * RENAME_NOREPLACE the target is checked first, like O_EXCL in shim_open().
+ */
+static int
+shim_rename(const char *old_name, const char *new_name, unsigned flags)
+{
+	if (old_name == NULL || new_name == NULL) {
+		errno = EXDEV;
+		return -1;
+	}
+	if ((flags & ~RENAME_NOREPLACE) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once(&image_once, image_init);
+	if ((flags & RENAME_NOREPLACE) != 0) {
+		int ufs_fd = ufs_open(new_name, 0);
+		struct ufs_dir *dir = ufs_fd == -1 ? ufs_opendir(new_name) : NULL;
+		if (ufs_fd != -1 || dir != NULL) {
+			if (ufs_fd != -1)
+				ufs_close(ufs_fd);
+			ufs_closedir(dir);
+			errno = EEXIST;
+			return -1;
+		}
+	}
+	return shim_result(ufs_rename(old_name, new_name));
+}
+
+int
+rename(const char *old_path, const char *new_path)
+{
+	const char *old_name = shim_name(old_path);
+	const char *new_name = shim_name(new_path);
+	if (old_name == NULL && new_name == NULL)
+		return real.rename(old_path, new_path);
+	return shim_rename(old_name, new_name, 0);
+}
+
+int
+renameat(int old_dirfd, const char *old_path, int new_dirfd,
+	 const char *new_path)
+{
+	const char *old_name = shim_name(old_path);
+	const char *new_name = shim_name(new_path);
+	if (old_name == NULL && new_name == NULL)
+		return real.renameat(old_dirfd, old_path, new_dirfd, new_path);
+	return shim_rename(old_name, new_name, 0);
+}
+
+int
+renameat2(int old_dirfd, const char *old_path, int new_dirfd,
+	  const char *new_path, unsigned flags)
+{
+	const char *old_name = shim_name(old_path);
+	const char *new_name = shim_name(new_path);
+	if (old_name == NULL && new_name == NULL)
+		return real.renameat2(old_dirfd, old_path, new_dirfd, new_path,
+				      flags);
+	return shim_rename(old_name, new_name, flags);
+}
+
+/**
+ * Bind a new real descriptor, made by dup() of the placeholder, to the same
+ * userfs descriptor, and unbind the one it replaced.
+ */
+static int
+shim_dup_result(int new_fd, struct shim_file *file)
+{
+	if (new_fd < 0)
+		return new_fd;
+	struct shim_file *old;
+	if (shim_set(new_fd, file, &old) != 0) {
+		real.close(new_fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	shim_unref(old);
+	return new_fd;
+}
+
+int
+dup(int fd)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.dup(fd);
+	return shim_dup_result(real.dup(fd), file);
+}
+
+int
+dup2(int fd, int new_fd)
+{
+	struct shim_file *file = shim_get(fd);
+	if (fd == new_fd || (file == NULL && shim_get(new_fd) == NULL))
+		return real.dup2(fd, new_fd);
+	return shim_dup_result(real.dup2(fd, new_fd), file);
+}
+
+int
+dup3(int fd, int new_fd, int flags)
+{
+	struct shim_file *file = shim_get(fd);
+	if (fd == new_fd || (file == NULL && shim_get(new_fd) == NULL))
+		return real.dup3(fd, new_fd, flags);
+	return shim_dup_result(real.dup3(fd, new_fd, flags), file);
+}
+
+/**
+ * Fill the stat fields of a userfs file. The tools compare the inode numbers
+ * to find the same file, so they are made of the name hash.
+ */
+#define SHIM_STAT(st, name, size, is_dir) do {				\
+	memset((st), 0, sizeof(*(st)));					\
+	uint64_t h = 14695981039346656037ull;				\
+	for (const char *c = (name); *c != 0; ++c)			\
+		h = (h ^ (unsigned char)*c) * 1099511628211ull;		\
+	(st)->st_dev = 0x75667300;					\
+	(st)->st_ino = h;						\
+	(st)->st_mode = (is_dir) ? S_IFDIR | 0755 : S_IFREG | 0644;	\
+	(st)->st_nlink = 1;						\
+	(st)->st_uid = getuid();					\
+	(st)->st_gid = getgid();					\
+	(st)->st_size = (size);						\
+	(st)->st_blksize = 4096;					\
+	(st)->st_blocks = ((size) + 511) / 512;				\
+} while (0)
+
+int
+fstat(int fd, struct stat *st)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.fstat(fd, st);
+	SHIM_STAT(st, file->name, shim_size(file->ufs_fd), false);
+	return 0;
+}
+
+int
+fstat64(int fd, struct stat64 *st)
+{
+	struct shim_file *file = shim_get(fd);
+	if (file == NULL)
+		return real.fstat64(fd, st);
+	SHIM_STAT(st, file->name, shim_size(file->ufs_fd), false);
+	return 0;
+}
+
+/** Size of the file by name, the prefix itself is the root directory. */
+static off_t
+shim_stat_size(const char *name, bool *is_dir)
+{
+	pthread_once(&image_once, image_init);
+	*is_dir = false;
+	int ufs_fd = *name == 0 ? -1 : ufs_open(name, UFS_READ_ONLY);
+	if (ufs_fd == -1) {
+		errno = shim_errno();
+		/* Not a file, maybe a directory. */
+		struct ufs_dir *dir = ufs_opendir(name);
+		if (dir == NULL)
+			return -1;
+		ufs_closedir(dir);
+		*is_dir = true;
+		return 0;
+	}
+	off_t size = shim_size(ufs_fd);
+	ufs_close(ufs_fd);
+	return size;
+}
+
+#define SHIM_STAT_PATH(path, st, real_call) do {			\
+	const char *name = shim_name(path);				\
+	if (name == NULL)						\
+		return real_call;					\
+	bool is_dir;							\
+	off_t size = shim_stat_size(name, &is_dir);			\
+	if (size < 0)							\
+		return -1;						\
+	SHIM_STAT(st, name, size, is_dir);				\
+	return 0;							\
+} while (0)
+
+int
+stat(const char *path, struct stat *st)
+{
+	SHIM_STAT_PATH(path, st, real.stat(path, st));
+}
+
+int
+stat64(const char *path, struct stat64 *st)
+{
+	SHIM_STAT_PATH(path, st, real.stat64(path, st));
+}
+
+int
+lstat(const char *path, struct stat *st)
+{
+	SHIM_STAT_PATH(path, st, real.lstat(path, st));
+}
+
+int
+lstat64(const char *path, struct stat64 *st)
+{
+	SHIM_STAT_PATH(path, st, real.lstat64(path, st));
+}
+
+int
+fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+	if ((flags & AT_EMPTY_PATH) != 0 && *path == 0)
+		return fstat(dirfd, st);
+	SHIM_STAT_PATH(path, st, real.fstatat(dirfd, path, st, flags));
+}
+
+int
+fstatat64(int dirfd, const char *path, struct stat64 *st, int flags)
+{
+	if ((flags & AT_EMPTY_PATH) != 0 && *path == 0)
+		return fstat64(dirfd, st);
+	SHIM_STAT_PATH(path, st, real.fstatat64(dirfd, path, st, flags));
+}
+
+int
+statx(int dirfd, const char *path, int flags, unsigned mask, struct statx *stx)
+{
+	struct stat st;
+	if ((flags & AT_EMPTY_PATH) != 0 && *path == 0) {
+		if (shim_get(dirfd) == NULL)
+			return real.statx(dirfd, path, flags, mask, stx);
+		fstat(dirfd, &st);
+	} else if (shim_name(path) == NULL) {
+		return real.statx(dirfd, path, flags, mask, stx);
+	} else if (stat(path, &st) != 0) {
+		return -1;
+	}
+	memset(stx, 0, sizeof(*stx));
+	stx->stx_mask = STATX_BASIC_STATS;
+	stx->stx_blksize = st.st_blksize;
+	stx->stx_nlink = st.st_nlink;
+	stx->stx_uid = st.st_uid;
+	stx->stx_gid = st.st_gid;
+	stx->stx_mode = st.st_mode;
+	stx->stx_ino = st.st_ino;
+	stx->stx_size = st.st_size;
+	stx->stx_blocks = st.st_blocks;
+	stx->stx_dev_major = major(st.st_dev);
+	stx->stx_dev_minor = minor(st.st_dev);
+	return 0;
+}
+
+static ssize_t
+cookie_read(void *cookie, char *buf, size_t size)
+{
+	return read((int)(intptr_t)cookie, buf, size);
+}
+
+static ssize_t
+cookie_write(void *cookie, const char *buf, size_t size)
+{
+	return write((int)(intptr_t)cookie, buf, size);
+}
+
+static int
+cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+	off_t rc = lseek((int)(intptr_t)cookie, *offset, whence);
+	if (rc < 0)
+		return -1;
+	*offset = rc;
+	return 0;
+}
+
+static int
+cookie_close(void *cookie)
+{
+	return close((int)(intptr_t)cookie);
+}
+
+/** A stdio stream over a userfs file, its calls come back to the shim. */
+FILE *
+fopen(const char *path, const char *mode)
+{
+	const char *name = shim_name(path);
+	if (name == NULL)
+		return real.fopen(path, mode);
+	int flags;
+	switch (mode[0]) {
+	case 'r':
+		flags = 0;
+		break;
+	case 'w':
+		flags = O_CREAT | O_TRUNC;
+		break;
+	case 'a':
+		flags = O_CREAT | O_APPEND;
+		break;
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+	bool is_update = strchr(mode, '+') != NULL;
+	if (is_update)
+		flags |= O_RDWR;
+	else if (mode[0] != 'r')
+		flags |= O_WRONLY;
+	if (strchr(mode, 'x') != NULL)
+		flags |= O_EXCL;
+	int fd = shim_open(name, flags);
+	if (fd < 0)
+		return NULL;
+	cookie_io_functions_t io = {
+		.read = cookie_read,
+		.write = cookie_write,
+		.seek = cookie_seek,
+		.close = cookie_close,
+	};
+	FILE *f = fopencookie((void *)(intptr_t)fd, mode, io);
+	if (f == NULL)
+		close(fd);
+	return f;
+}
+
+FILE *
+fopen64(const char *path, const char *mode) __attribute__((alias("fopen")));
@@ -324,6 +324,8 @@ trace_sym_is_internal(const struct symbol *sym)
 		return true;
 	if (trace_sym_is_func(sym, "_IO_vfscanf"))
 		return true;
+	if (trace_sym_is_func(sym, "_IO_file_doallocate"))
+		return true;
 	if (trace_sym_file_starts_with(sym, "libpthread.so"))
 		return true;
 	return false;